@@ -1,74 +1,191 @@
-//------------------------------------------------------------------------------
-// File:    shell.h
-// Author:  Daniel Herce (NIP 848884), Alain Villagrasa (NIP 816787)
-// Date:    Marzo 2023
-// Coms:    Fichero que implementa la jerarquía de excepciones posibles sobre la 
-//          clase Shell
-//------------------------------------------------------------------------------
-
-#pragma once
-
-#include <exception>
-#include <string>
-
-class arbol_ficheros_error : public std::exception {
-    protected:
-        std::string _aux;
-    public:
-        arbol_ficheros_error(const std::string& aux = "") : _aux(aux) {}
-        virtual const char* what() const noexcept {
-            return _aux.c_str();
-        }
-};
-
-class negative_size : public arbol_ficheros_error {
-    public:
-        negative_size(const int sz) : arbol_ficheros_error(std::to_string(sz)) {}
-        const char* what() const noexcept override {
-            std::string s = "Invalid parameter: size must be greater or equal to 0, was " + _aux;
-            return s.c_str();
-        }
-};
-
-class is_a_directory : public arbol_ficheros_error {
-    public:
-        is_a_directory(const std::string& dirName) : arbol_ficheros_error(dirName) {}
-        const char* what() const noexcept override {
-            std::string s = _aux + " is a directory";
-            return s.c_str();
-        }
-};
-
-class dir_exists : public arbol_ficheros_error {
-    public:
-        dir_exists(const std::string& dirName) : arbol_ficheros_error(dirName) {}
-        const char* what() const noexcept override {
-            std::string s = "The directory " + _aux + " already exists";
-            return s.c_str();
-        }
-};
-
-class already_root : public arbol_ficheros_error {
-    public:
-        const char* what() const noexcept override {
-            return "Path already root, cannot cd ..";
-        }
-};
-
-class is_a_file : public arbol_ficheros_error {
-    public:
-        is_a_file(const std::string& fileName) : arbol_ficheros_error(fileName) {}
-        const char* what() const noexcept override {
-            std::string s = _aux + " is a file";
-            return s.c_str();
-        }
-};
-
-class elem_not_found : public arbol_ficheros_error {
-    public:
-        elem_not_found(const std::string& elem) : arbol_ficheros_error(elem) {}
-        const char* what() const noexcept override {
-            std::string s = _aux + " not found";
-            return s.c_str();
-        }
-};
+//------------------------------------------------------------------------------
+// File:    shell.h
+// Author:  Daniel Herce (NIP 848884), Alain Villagrasa (NIP 816787)
+// Date:    Marzo 2023
+// Coms:    Fichero que implementa la jerarquía de excepciones posibles sobre la 
+//          clase Shell
+//------------------------------------------------------------------------------
+
+#pragma once
+
+#include <exception>
+#include <string>
+
+// Cada clase compone su mensaje completo al construirse, para que what() pueda devolver un puntero que
+// siga siendo válido mientras viva la excepción
+class arbol_ficheros_error : public std::exception {
+    protected:
+        std::string _aux;
+    public:
+        arbol_ficheros_error(const std::string& aux = "") : _aux(aux) {}
+        virtual const char* what() const noexcept {
+            return _aux.c_str();
+        }
+        // Devuelve el nombre de la clase concreta del error
+        virtual const char* name() const noexcept {
+            return "arbol_ficheros_error";
+        }
+};
+
+class negative_size : public arbol_ficheros_error {
+    public:
+        negative_size(const long long sz)
+            : arbol_ficheros_error("Invalid parameter: size must be greater or equal to 0, was " + std::to_string(sz)) {}
+        const char* name() const noexcept override {
+            return "negative_size";
+        }
+};
+
+class is_a_directory : public arbol_ficheros_error {
+    public:
+        is_a_directory(const std::string& dirName) : arbol_ficheros_error(dirName + " is a directory") {}
+        const char* name() const noexcept override {
+            return "is_a_directory";
+        }
+};
+
+class dir_exists : public arbol_ficheros_error {
+    public:
+        dir_exists(const std::string& dirName) : arbol_ficheros_error("The directory " + dirName + " already exists") {}
+        const char* name() const noexcept override {
+            return "dir_exists";
+        }
+};
+
+class already_root : public arbol_ficheros_error {
+    public:
+        already_root() : arbol_ficheros_error("Path already root, cannot cd ..") {}
+        const char* name() const noexcept override {
+            return "already_root";
+        }
+};
+
+class is_a_file : public arbol_ficheros_error {
+    public:
+        is_a_file(const std::string& fileName) : arbol_ficheros_error(fileName + " is a file") {}
+        const char* name() const noexcept override {
+            return "is_a_file";
+        }
+};
+
+class elem_not_found : public arbol_ficheros_error {
+    public:
+        elem_not_found(const std::string& elem) : arbol_ficheros_error(elem + " not found") {}
+        const char* name() const noexcept override {
+            return "elem_not_found";
+        }
+};
+
+class size_overflow : public arbol_ficheros_error {
+    public:
+        size_overflow(const std::string& elem)
+            : arbol_ficheros_error("Size overflow: the size of a directory containing " + elem + " would exceed the maximum") {}
+        const char* name() const noexcept override {
+            return "size_overflow";
+        }
+};
+
+class snapshot_error : public arbol_ficheros_error {
+    public:
+        snapshot_error(const std::string& path, const std::string& reason)
+            : arbol_ficheros_error("Snapshot " + path + ": " + reason) {}
+        const char* name() const noexcept override {
+            return "snapshot_error";
+        }
+};
+
+class batch_error : public arbol_ficheros_error {
+    public:
+        batch_error(const std::size_t n, const std::string& reason)
+            : arbol_ficheros_error("Batch aborted at operation " + std::to_string(n) + ": " + reason) {}
+        const char* name() const noexcept override {
+            return "batch_error";
+        }
+};
+
+class import_error : public arbol_ficheros_error {
+    public:
+        import_error(const std::string& path, const std::string& reason)
+            : arbol_ficheros_error("Import " + path + ": " + reason) {}
+        const char* name() const noexcept override {
+            return "import_error";
+        }
+};
+
+class unknown_snapshot : public arbol_ficheros_error {
+    public:
+        unknown_snapshot(const std::string& name) : arbol_ficheros_error("Snapshot " + name + " not found") {}
+        const char* name() const noexcept override {
+            return "unknown_snapshot";
+        }
+};
+
+class read_only_snapshot : public arbol_ficheros_error {
+    public:
+        read_only_snapshot(const std::string& name) : arbol_ficheros_error("Snapshot " + name + " is read-only") {}
+        const char* name() const noexcept override {
+            return "read_only_snapshot";
+        }
+};
+
+class journal_error : public arbol_ficheros_error {
+    public:
+        journal_error(const std::string& path, const std::string& reason)
+            : arbol_ficheros_error("Journal " + path + ": " + reason) {}
+        const char* name() const noexcept override {
+            return "journal_error";
+        }
+};
+
+class server_error : public arbol_ficheros_error {
+    public:
+        server_error(const std::string& address, const std::string& reason)
+            : arbol_ficheros_error("Server " + address + ": " + reason) {}
+        const char* name() const noexcept override {
+            return "server_error";
+        }
+};
+
+class invalid_move : public arbol_ficheros_error {
+    public:
+        invalid_move(const std::string& elem, const std::string& reason)
+            : arbol_ficheros_error("Cannot move " + elem + ": " + reason) {}
+        const char* name() const noexcept override {
+            return "invalid_move";
+        }
+};
+
+class too_many_links : public arbol_ficheros_error {
+    public:
+        too_many_links(const std::string& elem, const unsigned max)
+            : arbol_ficheros_error("Too many levels of links: " + elem + " (max " + std::to_string(max) + ")") {}
+        const char* name() const noexcept override {
+            return "too_many_links";
+        }
+};
+
+class dir_removed : public arbol_ficheros_error {
+    public:
+        dir_removed(const std::string& path) : arbol_ficheros_error("The directory " + path + " is no longer in the tree") {}
+        const char* name() const noexcept override {
+            return "dir_removed";
+        }
+};
+
+class mount_error : public arbol_ficheros_error {
+    public:
+        mount_error(const std::string& origen, const std::string& reason)
+            : arbol_ficheros_error("Mount " + origen + ": " + reason) {}
+        const char* name() const noexcept override {
+            return "mount_error";
+        }
+};
+
+class host_access_denied : public arbol_ficheros_error {
+    public:
+        host_access_denied(const std::string& path, const std::string& reason)
+            : arbol_ficheros_error("Cannot access " + path + ": " + reason) {}
+        const char* name() const noexcept override {
+            return "host_access_denied";
+        }
+};
@@ -0,0 +1,140 @@
+//------------------------------------------------------------------------------
+// File:   arena.h
+// Author: Daniel Herce (NIP 848884), Alain Villagrasa (NIP 816787)
+// Date:   Marzo 2023
+// Coms:   Fichero que implementa la arena de memoria de la que se reservan
+//         los nodos de un árbol de ficheros
+//------------------------------------------------------------------------------
+
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+// Arena de bloques grandes dividida en clases de tamaño múltiplo de 16 bytes. Cada clase mantiene una
+// lista de huecos libres, de modo que la memoria de los nodos eliminados se reutiliza para los nuevos.
+// Al destruir la arena se liberan todos sus bloques de una vez.
+class Arena {
+    private:
+        static constexpr std::size_t ALINEACION = 16;           // Granularidad de las clases de tamaño
+        static constexpr std::size_t MAX_HUECO = 512;           // Mayor tamaño servido desde la arena
+        static constexpr std::size_t TAM_BLOQUE = 64 * 1024;    // Tamaño de cada bloque
+
+        struct Hueco {
+            Hueco* next;    // Siguiente hueco libre de la misma clase
+        };
+
+        std::vector<std::unique_ptr<std::byte[]>> _bloques;     // Bloques reservados
+        Hueco* _libres[MAX_HUECO / ALINEACION + 1] = {};        // Huecos libres de cada clase de tamaño
+        std::byte* _actual;                                     // Comienzo de la zona sin usar del último bloque
+        std::size_t _restante;                                  // Bytes sin usar del último bloque
+        std::size_t _enUso;                                     // Bytes entregados y no devueltos
+
+        // Devuelve la clase de tamaño de una reserva de <bytes>
+        static std::size_t clase(const std::size_t bytes) {
+            return (bytes + ALINEACION - 1) / ALINEACION;
+        }
+    public:
+        // Constructor
+        Arena() : _actual(nullptr), _restante(0), _enUso(0) {}
+
+        Arena(const Arena&) = delete;
+        Arena& operator=(const Arena&) = delete;
+
+        // Reserva <bytes> bytes, reutilizando un hueco libre de su clase si lo hay
+        void* allocate(const std::size_t bytes) {
+            if (bytes > MAX_HUECO)
+                return ::operator new(bytes, std::align_val_t(ALINEACION));
+            std::size_t c = clase(bytes);
+            _enUso += c * ALINEACION;
+            if (Hueco* h = _libres[c]) {
+                _libres[c] = h->next;
+                return h;
+            }
+            if (_restante < c * ALINEACION) {
+                _bloques.push_back(std::make_unique<std::byte[]>(TAM_BLOQUE));
+                _actual = _bloques.back().get();
+                _restante = TAM_BLOQUE;
+            }
+            void* p = _actual;
+            _actual += c * ALINEACION;
+            _restante -= c * ALINEACION;
+            return p;
+        }
+
+        // Devuelve a la arena los <bytes> bytes reservados en <p>
+        void deallocate(void* p, const std::size_t bytes) {
+            if (bytes > MAX_HUECO) {
+                ::operator delete(p, std::align_val_t(ALINEACION));
+                return;
+            }
+            std::size_t c = clase(bytes);
+            _enUso -= c * ALINEACION;
+            _libres[c] = new (p) Hueco{_libres[c]};
+        }
+
+        // Devuelve el número de bytes entregados y no devueltos
+        std::size_t enUso() const {
+            return _enUso;
+        }
+
+        // Devuelve el número de bytes reservados en bloques
+        std::size_t reservados() const {
+            return _bloques.size() * TAM_BLOQUE;
+        }
+
+        // Crea un objeto de tipo <T> en la arena, gestionado por un shared_ptr cuyo bloque de control
+        // también reside en la arena
+        template <typename T, typename... Args>
+        std::shared_ptr<T> crear(Args&&... args);
+
+        // Devuelve los bytes que ocupa en la arena un objeto de tipo <T> creado con crear(): el objeto y su
+        // bloque de control (estimado como dos contadores, su tabla virtual y el asignador)
+        template <typename T>
+        static constexpr std::size_t bytesCrear();
+};
+
+// Asignador compatible con la biblioteca estándar que reserva la memoria de una Arena. La arena debe
+// sobrevivir a todos los objetos creados con él
+template <typename T>
+class AsignadorArena {
+    private:
+        Arena* _arena;
+
+        template <typename U>
+        friend class AsignadorArena;
+    public:
+        using value_type = T;
+
+        // Constructores
+        explicit AsignadorArena(Arena& arena) : _arena(&arena) {}
+        template <typename U>
+        AsignadorArena(const AsignadorArena<U>& other) : _arena(other._arena) {}
+
+        T* allocate(const std::size_t n) {
+            return static_cast<T*>(_arena->allocate(n * sizeof(T)));
+        }
+
+        void deallocate(T* p, const std::size_t n) {
+            _arena->deallocate(p, n * sizeof(T));
+        }
+
+        template <typename U>
+        bool operator==(const AsignadorArena<U>& other) const {
+            return _arena == other._arena;
+        }
+};
+
+template <typename T, typename... Args>
+std::shared_ptr<T> Arena::crear(Args&&... args) {
+    return std::allocate_shared<T>(AsignadorArena<T>(*this), std::forward<Args>(args)...);
+}
+
+template <typename T>
+constexpr std::size_t Arena::bytesCrear() {
+    std::size_t bytes = sizeof(T) + 2 * sizeof(int) + sizeof(void*) + sizeof(AsignadorArena<T>);
+    return bytes > MAX_HUECO ? bytes : clase(bytes) * ALINEACION;
+}
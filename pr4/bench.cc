@@ -0,0 +1,463 @@
+//------------------------------------------------------------------------------
+// File:   bench.cc
+// Author: Daniel Herce (NIP 848884), Alain Villagrasa (NIP 816787)
+// Date:   Marzo 2023
+// Coms:   Banco de pruebas de rendimiento de la clase Shell sobre cargas
+//         sintéticas. Cada medida se escribe como una línea JSON
+//------------------------------------------------------------------------------
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <sstream>
+#include <vector>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "shell.h"
+
+using namespace std;
+using Reloj = chrono::steady_clock;
+
+// Parametros de la ejecucion
+struct Config
+{
+	size_t nodos = 100000;		// Tamaño del arbol de cada escenario
+	size_t ops = 100000;		// Operaciones medidas de cada tipo
+	size_t hilos = 8;			// Maximo de sesiones concurrentes
+	bool barrido = false;		// Repetir con tamaños 10^3, 10^4, ... hasta nodos
+	string escenario;			// Escenario a ejecutar (todos si esta vacio)
+};
+
+// Latencias de las operaciones de un tipo, con su informe en JSON
+class Medidas
+{
+	private:
+		string _escenario;
+		size_t _nodos;
+		string _op;
+		vector<long> _ns;			// Latencia de cada operacion, en nanosegundos
+		size_t _errores = 0;		// Operaciones que han lanzado una excepcion
+		double _segundos = 0;		// Tiempo de pared total
+
+	public:
+		Medidas(string escenario, size_t nodos, string op)
+			: _escenario(move(escenario)), _nodos(nodos), _op(move(op)) {}
+
+		// Ejecuta y mide <f> una vez
+		template <typename F>
+		void medir(F&& f)
+		{
+			Reloj::time_point t0 = Reloj::now();
+			try
+			{
+				f();
+			}
+			catch (const arbol_ficheros_error&)
+			{
+				_errores++;
+			}
+			long ns = chrono::duration_cast<chrono::nanoseconds>(Reloj::now() - t0).count();
+			_ns.push_back(ns);
+			_segundos += ns * 1e-9;
+		}
+
+		// Incorpora las medidas de <otras>, tomadas en paralelo con estas durante <segundos>
+		void juntar(const vector<Medidas>& otras, double segundos)
+		{
+			for (const Medidas& m : otras)
+			{
+				_ns.insert(_ns.end(), m._ns.begin(), m._ns.end());
+				_errores += m._errores;
+			}
+			_segundos = segundos;
+		}
+
+		// Escribe en <out> el informe de las medidas, con <extra> como campos adicionales
+		void informe(ostream& out, const string& extra = "")
+		{
+			if (_ns.empty())
+				return;
+			auto percentil = [this](double p) {
+				size_t k = min(_ns.size() - 1, size_t(p * _ns.size()));
+				nth_element(_ns.begin(), _ns.begin() + k, _ns.end());
+				return _ns[k];
+			};
+			long p50 = percentil(0.50), p99 = percentil(0.99);
+			out << "{\"escenario\":\"" << _escenario << "\",\"nodos\":" << _nodos
+				<< ",\"op\":\"" << _op << "\"" << extra
+				<< ",\"ops\":" << _ns.size() << ",\"errores\":" << _errores
+				<< ",\"ops_s\":" << size_t(_ns.size() / max(_segundos, 1e-9))
+				<< ",\"p50_ns\":" << p50 << ",\"p99_ns\":" << p99 << "}" << endl;
+		}
+};
+
+// Devuelve la ruta absoluta del nodo <name> dentro del directorio <dir>
+string unir(const string& dir, string_view name)
+{
+	return (dir == "/" ? dir : dir + "/") + string(name);
+}
+
+// Construye en <sh> un arbol de <nodos> nodos con forma de arbol de directorios real: cada directorio
+// tiene hasta 16 ficheros y 4 subdirectorios. Deja en <dirs> y <ficheros> las rutas de (como mucho)
+// <muestra> directorios y ficheros elegidos al azar
+void construir(Shell& sh, size_t nodos, size_t muestra, vector<string>& dirs, vector<string>& ficheros,
+			   mt19937_64& rnd)
+{
+	// Muestreo uniforme de rutas sin guardarlas todas
+	auto anotar = [&](vector<string>& v, size_t& vistos, const string& ruta) {
+		if (v.size() < muestra)
+			v.push_back(ruta);
+		else if (size_t k = rnd() % (vistos + 1); k < muestra)
+			v[k] = ruta;
+		vistos++;
+	};
+	size_t vistosDirs = 0, vistosFicheros = 0;
+
+	vector<string> pendientes = {"/"};
+	size_t creados = 0;
+	for (size_t i = 0; i < pendientes.size() && creados < nodos; i++)
+	{
+		sh.cd(pendientes[i]);
+		anotar(dirs, vistosDirs, pendientes[i]);
+		for (int f = 0; f < 16 && creados < nodos; f++, creados++)
+		{
+			string name = "f" + to_string(f);
+			sh.vi(name, rnd() % 4096);
+			anotar(ficheros, vistosFicheros, unir(pendientes[i], name));
+		}
+		for (int d = 0; d < 4 && creados < nodos; d++, creados++)
+		{
+			string name = "d" + to_string(d);
+			sh.mkdir(name);
+			pendientes.push_back(unir(pendientes[i], name));
+		}
+	}
+	sh.cd("/");
+}
+
+// Cadena de directorios muy profunda: coste de resolver rutas largas y de propagar tamaños hasta la raiz
+void profundo(const Config& cfg, size_t nodos)
+{
+	const size_t prof = min<size_t>(nodos, 10000);
+	Shell sh;
+	Medidas mkdir("profundo", prof, "mkdir");
+	string ruta;
+	for (size_t i = 0; i < prof; i++)
+	{
+		mkdir.medir([&] { sh.mkdir("d"); });
+		sh.cd("d");
+		ruta += "/d";
+	}
+	mkdir.informe(cout, ",\"profundidad\":" + to_string(prof));
+
+	Medidas vi("profundo", prof, "vi"), stat("profundo", prof, "stat"), cd("profundo", prof, "cd");
+	mt19937_64 rnd(1);
+	size_t ops = min<size_t>(cfg.ops, 1000000 / prof + 1);
+	for (size_t i = 0; i < ops; i++)
+		vi.medir([&] { sh.vi("f", rnd() % 4096); });
+	for (size_t i = 0; i < ops; i++)
+		stat.medir([&] { sh.stat(ruta + "/f"); });
+	for (size_t i = 0; i < ops; i++)
+		cd.medir([&] { sh.cd(ruta); });
+	vi.informe(cout);
+	stat.informe(cout);
+	cd.informe(cout);
+}
+
+// Un unico directorio con muchos ficheros: coste de la tabla de hijos y de los listados
+void ancho(const Config& cfg, size_t nodos)
+{
+	Shell sh;
+	mt19937_64 rnd(2);
+	Medidas crear("ancho", nodos, "vi_nuevo"), vi("ancho", nodos, "vi"), stat("ancho", nodos, "stat");
+	for (size_t i = 0; i < nodos; i++)
+		crear.medir([&] { sh.vi("f" + to_string(i), rnd() % 4096); });
+	crear.informe(cout);
+	for (size_t i = 0; i < cfg.ops; i++)
+		vi.medir([&] { sh.vi("f" + to_string(rnd() % nodos), rnd() % 4096); });
+	vi.informe(cout);
+	for (size_t i = 0; i < cfg.ops; i++)
+		stat.medir([&] { sh.stat("f" + to_string(rnd() % nodos)); });
+	stat.informe(cout);
+
+	Medidas ls("ancho", nodos, "ls"), du("ancho", nodos, "du");
+	for (int i = 0; i < 5; i++)
+	{
+		ls.medir([&] { sh.ls(); });
+		sh.vi("f0", i);	// Invalida el listado ordenado
+		du.medir([&] { sh.du(); });
+	}
+	ls.informe(cout);
+	du.informe(cout);
+
+	Medidas rm("ancho", nodos, "rm");
+	for (size_t i = 0; i < nodos; i++)
+		rm.medir([&] { sh.rm("f" + to_string(i)); });
+	rm.informe(cout);
+}
+
+// Grafo con muchos enlaces entre directorios: coste de crear enlaces (deteccion de ciclos) y de propagar
+// tamaños a traves de ellos
+void enlaces(const Config& cfg, size_t nodos)
+{
+	Shell sh;
+	mt19937_64 rnd(3);
+	vector<string> dirs, ficheros;
+	construir(sh, nodos, 100000, dirs, ficheros, rnd);
+
+	Medidas ln("enlaces", nodos, "ln");
+	size_t numEnlaces = min(cfg.ops, nodos / 10 + 1);
+	for (size_t i = 0; i < numEnlaces; i++)
+	{
+		sh.cd(dirs[rnd() % dirs.size()]);
+		string destino = rnd() % 2 ? dirs[rnd() % dirs.size()] : ficheros[rnd() % ficheros.size()];
+		ln.medir([&] { sh.ln(destino, "l" + to_string(i)); });
+	}
+	ln.informe(cout, ",\"enlaces\":" + to_string(numEnlaces));
+
+	Medidas vi("enlaces", nodos, "vi"), stat("enlaces", nodos, "stat"), du("enlaces", nodos, "du_r");
+	for (size_t i = 0; i < cfg.ops; i++)
+	{
+		const string& f = ficheros[rnd() % ficheros.size()];
+		sh.cd(f.substr(0, max<size_t>(1, f.find_last_of('/'))));
+		vi.medir([&] { sh.vi(f.substr(f.find_last_of('/') + 1), rnd() % 4096); });
+	}
+	vi.informe(cout, ",\"enlaces\":" + to_string(numEnlaces));
+	sh.cd("/");
+	for (size_t i = 0; i < cfg.ops; i++)
+		stat.medir([&] { sh.stat(dirs[rnd() % dirs.size()]); });
+	stat.informe(cout, ",\"enlaces\":" + to_string(numEnlaces));
+	du.medir([&] { sh.du(true); });
+	du.informe(cout, ",\"enlaces\":" + to_string(numEnlaces));
+}
+
+// Mezcla de lecturas (stat, cd, ls) y escrituras (vi, mkdir, rm) en distintas proporciones
+void mixto(const Config& cfg, size_t nodos)
+{
+	for (int lecturas : {50, 90, 99})
+	{
+		Shell sh;
+		mt19937_64 rnd(4);
+		vector<string> dirs, ficheros;
+		Medidas construccion("mixto", nodos, "construir");
+		Reloj::time_point t0 = Reloj::now();
+		construccion.medir([&] { construir(sh, nodos, 100000, dirs, ficheros, rnd); });
+		double segundos = chrono::duration<double>(Reloj::now() - t0).count();
+		if (lecturas == 50)
+			construccion.informe(cout, ",\"nodos_s\":" + to_string(size_t(nodos / max(segundos, 1e-9))));
+
+		Medidas m("mixto", nodos, "mezcla");
+		for (size_t i = 0; i < cfg.ops; i++)
+		{
+			const string& dir = dirs[rnd() % dirs.size()];
+			int op = rnd() % 100;
+			m.medir([&] {
+				if (op < lecturas)
+				{
+					switch (op % 3)
+					{
+						case 0: sh.stat(ficheros[rnd() % ficheros.size()]); break;
+						case 1: sh.cd(dir); break;
+						default: sh.stat(dir); break;
+					}
+				}
+				else
+				{
+					sh.cd(dir);
+					switch (op % 3)
+					{
+						case 0: sh.vi("f" + to_string(rnd() % 20), rnd() % 4096); break;
+						case 1: sh.mkdir("m" + to_string(rnd() % 1000)); break;
+						default: sh.rm("m" + to_string(rnd() % 1000)); break;
+					}
+				}
+			});
+		}
+		m.informe(cout, ",\"lecturas_pct\":" + to_string(lecturas));
+	}
+}
+
+// Lectores concurrentes sobre un mismo arbol, cada uno con su propia sesion, con y sin un escritor
+void concurrente(const Config& cfg, size_t nodos)
+{
+	Shell sh;
+	mt19937_64 rnd(5);
+	vector<string> dirs, ficheros;
+	construir(sh, nodos, 100000, dirs, ficheros, rnd);
+
+	for (bool escritor : {false, true})
+	{
+		for (size_t hilos = 1; hilos <= cfg.hilos; hilos *= 2)
+		{
+			vector<Medidas> medidas(hilos, Medidas("concurrente", nodos, "stat"));
+			atomic<bool> fin{false};
+			thread escritura;
+			if (escritor)
+			{
+				escritura = thread([&] {
+					Shell s(sh);
+					mt19937_64 r(6);
+					while (!fin.load(memory_order_relaxed))
+					{
+						const string& f = ficheros[r() % ficheros.size()];
+						s.stat(f);
+						s.cd(f.substr(0, max<size_t>(1, f.find_last_of('/'))));
+						s.vi(f.substr(f.find_last_of('/') + 1), r() % 4096);
+					}
+				});
+			}
+			Reloj::time_point t0 = Reloj::now();
+			vector<thread> lectores;
+			for (size_t h = 0; h < hilos; h++)
+			{
+				lectores.emplace_back([&, h] {
+					Shell s(sh);
+					mt19937_64 r(100 + h);
+					for (size_t i = 0; i < cfg.ops / hilos; i++)
+						medidas[h].medir([&] { s.stat(ficheros[r() % ficheros.size()]); });
+				});
+			}
+			for (thread& t : lectores)
+				t.join();
+			double segundos = chrono::duration<double>(Reloj::now() - t0).count();
+			fin = true;
+			if (escritura.joinable())
+				escritura.join();
+
+			Medidas total("concurrente", nodos, "stat");
+			total.juntar(medidas, segundos);
+			total.informe(cout, ",\"hilos\":" + to_string(hilos) + ",\"escritor\":" + (escritor ? "true" : "false"));
+		}
+	}
+}
+
+// Ejecuta <f> en un proceso hijo y escribe en <out> sus lineas de informe, añadiendo a cada una el maximo de
+// memoria residente del hijo, que solo refleja lo que ha ocupado <f> (el del propio proceso incluiria los
+// escenarios anteriores). Devuelve false si el hijo no termina bien
+bool enHijo(const function<void()>& f, ostream& out)
+{
+	int tubo[2];
+	if (pipe(tubo) != 0)
+		return false;
+	cout.flush();
+	pid_t pid = fork();
+	if (pid < 0)
+	{
+		close(tubo[0]);
+		close(tubo[1]);
+		return false;
+	}
+	if (pid == 0)
+	{
+		close(tubo[0]);
+		dup2(tubo[1], STDOUT_FILENO);
+		close(tubo[1]);
+		f();
+		cout.flush();
+		_exit(0);
+	}
+	close(tubo[1]);
+	string salida;
+	char buf[4096];
+	for (;;)
+	{
+		ssize_t n = read(tubo[0], buf, sizeof(buf));
+		if (n > 0)
+			salida.append(buf, n);
+		else if (n == 0 || errno != EINTR)
+			break;
+	}
+	close(tubo[0]);
+	int estado;
+	struct rusage uso;
+	if (wait4(pid, &estado, 0, &uso) < 0)
+		return false;
+	istringstream in(salida);
+	string linea;
+	while (getline(in, linea))
+	{
+		if (!linea.empty() && linea.back() == '}')
+		{
+			linea.pop_back();
+			linea += ",\"rss_max_kb\":" + to_string(uso.ru_maxrss) + "}";
+		}
+		out << linea << endl;
+	}
+	return WIFEXITED(estado) && WEXITSTATUS(estado) == 0;
+}
+
+int main(int argc, char* argv[])
+{
+	Config cfg;
+	for (int i = 1; i < argc; i++)
+	{
+		string_view opt = argv[i];
+		if (opt == "-n" && i + 1 < argc)
+			cfg.nodos = strtoull(argv[++i], nullptr, 10);
+		else if (opt == "-o" && i + 1 < argc)
+			cfg.ops = strtoull(argv[++i], nullptr, 10);
+		else if (opt == "-t" && i + 1 < argc)
+			cfg.hilos = strtoull(argv[++i], nullptr, 10);
+		else if (opt == "-e" && i + 1 < argc)
+			cfg.escenario = argv[++i];
+		else if (opt == "-s")
+			cfg.barrido = true;
+		else
+		{
+			cerr << "Uso: " << argv[0] << " [-n nodos] [-o operaciones] [-t hilos] [-s] "
+				 << "[-e profundo|ancho|enlaces|mixto|concurrente]" << endl;
+			return 1;
+		}
+	}
+	if (cfg.nodos == 0 || cfg.ops == 0 || cfg.hilos == 0)
+	{
+		cerr << "Los parametros deben ser positivos" << endl;
+		return 1;
+	}
+
+	const vector<pair<string, function<void(const Config&, size_t)>>> escenarios = {
+		{"profundo", profundo},
+		{"ancho", ancho},
+		{"enlaces", enlaces},
+		{"mixto", mixto},
+		{"concurrente", concurrente},
+	};
+
+	vector<size_t> tamanyos;
+	if (cfg.barrido)
+		for (size_t n = 1000; n < cfg.nodos; n *= 10)
+			tamanyos.push_back(n);
+	tamanyos.push_back(cfg.nodos);
+
+	bool encontrado = false;
+	for (const auto& [nombre, ejecutar] : escenarios)
+	{
+		if (!cfg.escenario.empty() && cfg.escenario != nombre)
+			continue;
+		encontrado = true;
+		// Cada escenario y tamaño en su propio proceso, para medir la memoria que ocupa por separado
+		for (size_t n : tamanyos)
+		{
+			if (!enHijo([&] { ejecutar(cfg, n); }, cout))
+			{
+				cerr << "El escenario " << nombre << " con " << n << " nodos ha fallado" << endl;
+				return 1;
+			}
+		}
+	}
+	if (!encontrado)
+	{
+		cerr << "Escenario desconocido: " << cfg.escenario << endl;
+		return 1;
+	}
+	return 0;
+}
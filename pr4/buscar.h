@@ -0,0 +1,185 @@
+//------------------------------------------------------------------------------
+// File:   buscar.h
+// Author: Daniel Herce (NIP 848884), Alain Villagrasa (NIP 816787)
+// Date:   Marzo 2023
+// Coms:   Fichero que implementa la búsqueda de nodos por nombre (con
+//         comodines) y tamaño a partir del índice de nombres del árbol
+//------------------------------------------------------------------------------
+
+#pragma once
+
+#include <algorithm>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "nombres.h"
+#include "indice_nombres.h"
+#include "directorio.h"
+
+// Condición sobre el tamaño de un nodo: mayor (+N), menor (-N) o igual (N) que un valor
+struct FiltroTamanyo {
+    char op = 0;    // '+', '-', '=' o 0 si no hay condición
+    Tamanyo size = 0;
+
+    bool cumple(const Tamanyo sz) const {
+        switch (op) {
+            case '+': return sz > size;
+            case '-': return sz < size;
+            case '=': return sz == size;
+            default: return true;
+        }
+    }
+};
+
+// Devuelve true si <name> encaja con el patrón <pattern>, que puede contener los comodines '*' (cualquier
+// secuencia), '?' (cualquier carácter) y '[...]' (un carácter del conjunto, con rangos a-z, o fuera de él
+// si empieza por '!')
+inline bool encaja(std::string_view pattern, std::string_view name) {
+    // Posiciones a las que volver si falla el resto tras el último '*'
+    std::size_t p = 0, n = 0, pEstrella = std::string_view::npos, nEstrella = 0;
+    while (n < name.size()) {
+        if (p < pattern.size() && pattern[p] == '*') {
+            pEstrella = ++p;
+            nEstrella = n;
+            continue;
+        }
+        bool ok = false;
+        std::size_t siguiente = p + 1;
+        if (p < pattern.size() && pattern[p] == '[') {
+            std::size_t i = p + 1;
+            bool negado = i < pattern.size() && pattern[i] == '!';
+            if (negado)
+                i++;
+            bool dentro = false;
+            std::size_t ini = i;
+            while (i < pattern.size() && (pattern[i] != ']' || i == ini)) {
+                if (i + 2 < pattern.size() && pattern[i + 1] == '-' && pattern[i + 2] != ']') {
+                    dentro |= pattern[i] <= name[n] && name[n] <= pattern[i + 2];
+                    i += 3;
+                } else {
+                    dentro |= pattern[i] == name[n];
+                    i++;
+                }
+            }
+            if (i < pattern.size()) {
+                ok = dentro != negado;
+                siguiente = i + 1;
+            } else {
+                ok = name[n] == '['; // Corchete sin cerrar: se trata literalmente
+            }
+        } else if (p < pattern.size()) {
+            ok = pattern[p] == '?' || pattern[p] == name[n];
+        }
+        if (ok) {
+            p = siguiente;
+            n++;
+        } else if (pEstrella != std::string_view::npos) {
+            p = pEstrella;
+            n = ++nEstrella;
+        } else {
+            return false;
+        }
+    }
+    while (p < pattern.size() && pattern[p] == '*')
+        p++;
+    return p == pattern.size();
+}
+
+// Devuelve true si <pattern> contiene algún comodín
+inline bool tieneComodines(std::string_view pattern) {
+    return pattern.find_first_of("*?[") != std::string_view::npos;
+}
+
+// Devuelve, ordenadas, las rutas (relativas a <dir>) de los nodos del subárbol de <dir> cuyo nombre encaja
+// con <pattern> y cuyo tamaño cumple <filtro>. Los candidatos se obtienen del índice de nombres del árbol de
+// <dir> (que debe usar alguno), no recorriendo el subárbol: si el patrón no tiene comodines, sólo los de ese
+// nombre, y si los tiene, los de cada nombre distinto del índice que encaje. El coste depende del número de
+// candidatos y de su profundidad, no del tamaño del subárbol. No se descienden enlaces, como en du -r
+inline std::vector<std::string> buscar(const Directorio& dir, std::string_view pattern, const FiltroTamanyo& filtro) {
+    TablaNombres& nombres = TablaNombres::global();
+    IndiceNombres& indice = *dir.indice();
+    std::vector<NombreId> ids;
+    if (!tieneComodines(pattern)) {
+        NombreId id = nombres.find(pattern);
+        if (id != TablaNombres::NINGUNO)
+            ids.push_back(id);
+    } else {
+        indice.forEachNombre([&](const NombreId id) {
+            if (encaja(pattern, nombres.name(id)))
+                ids.push_back(id);
+        });
+    }
+
+    std::vector<std::string> rutas;
+    std::vector<const Nodo*> camino;
+    for (NombreId id : ids) {
+        indice.forEach(id, [&](const Nodo* node) {
+            // Se sube hasta <dir>; si se llega a un nodo sin padre, el candidato no está en su subárbol
+            camino.clear();
+            const Nodo* actual = node;
+            while (actual != nullptr && actual != &dir) {
+                camino.push_back(actual);
+                actual = actual->getParent();
+            }
+            if (actual == nullptr || camino.empty() || !filtro.cumple(node->getSize()))
+                return;
+            std::string ruta;
+            for (auto it = camino.rbegin(); it != camino.rend(); ++it) {
+                if (!ruta.empty())
+                    ruta += '/';
+                ruta += (*it)->getName();
+            }
+            rutas.push_back(std::move(ruta));
+        });
+    }
+    std::sort(rutas.begin(), rutas.end());
+    return rutas;
+}
+
+// Devuelve lo mismo que buscar(), pero recorriendo el subárbol de <dir> en vez de usar el índice de nombres, que
+// no contiene lo que aún no se ha cargado de un árbol montado. El contenido de los directorios perezosos sin
+// cargar se consulta a su respaldo sin cargarlo, así que la memoria que se usa no depende del tamaño del
+// subárbol, aunque el coste sí
+inline std::vector<std::string> buscarRecorriendo(const Directorio& dir, std::string_view pattern,
+                                                  const FiltroTamanyo& filtro) {
+    // Directorio pendiente de recorrer: un nodo cargado o, si <dir> es nullptr, la clave de uno sin cargar
+    struct Pendiente {
+        const Directorio* dir;
+        const Respaldo* respaldo;
+        std::uint64_t clave;
+        std::string ruta;
+    };
+    const bool comodines = tieneComodines(pattern);
+    std::vector<std::string> rutas;
+    std::vector<EntradaRespaldo> entradas;
+    std::vector<Pendiente> pendientes = {{&dir, nullptr, 0, std::string()}};
+    while (!pendientes.empty()) {
+        Pendiente p = std::move(pendientes.back());
+        pendientes.pop_back();
+        // Anota el nodo <name> del directorio si cumple la búsqueda, y lo deja pendiente si es un directorio
+        auto visitar = [&](std::string_view name, const Tamanyo size, const Directorio* sub, const std::uint64_t clave,
+                           const bool esDir) {
+            std::string ruta = p.ruta.empty() ? std::string(name) : p.ruta + '/' + std::string(name);
+            if ((comodines ? encaja(pattern, name) : name == pattern) && filtro.cumple(size))
+                rutas.push_back(ruta);
+            if (esDir)
+                pendientes.push_back({sub, p.respaldo, clave, std::move(ruta)});
+        };
+        if (p.dir != nullptr && p.dir->cargado()) {
+            p.dir->forEachChild([&](const std::shared_ptr<Nodo>& child) {
+                bool esDir = child->kind() == TipoNodo::DIRECTORIO;
+                visitar(child->getName(), child->getSize(), esDir ? static_cast<const Directorio*>(child.get()) : nullptr,
+                        0, esDir);
+            });
+        } else {
+            const Respaldo* respaldo = p.dir != nullptr ? p.dir->respaldo().get() : p.respaldo;
+            entradas.clear();
+            respaldo->contenido(p.dir != nullptr ? p.dir->clave() : p.clave, entradas);
+            p.respaldo = respaldo;
+            for (const EntradaRespaldo& e : entradas)
+                visitar(e.name, e.size, nullptr, e.clave, e.kind == TipoNodo::DIRECTORIO);
+        }
+    }
+    std::sort(rutas.begin(), rutas.end());
+    return rutas;
+}
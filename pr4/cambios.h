@@ -0,0 +1,177 @@
+//------------------------------------------------------------------------------
+// File:   cambios.h
+// Author: Daniel Herce (NIP 848884), Alain Villagrasa (NIP 816787)
+// Date:   Marzo 2023
+// Coms:   Fichero que implementa el registro de cambios del árbol de ficheros
+//         que permite volver a un estado anterior marcado con un nombre
+//------------------------------------------------------------------------------
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include "fichero.h"
+#include "directorio.h"
+
+// Modificación del árbol que puede deshacerse: en <dir> se quitó el nodo <quitado> y/o se puso el nodo
+// <puesto> (p.ej. un enlace que sustituye a un nodo con su mismo nombre), o, si <dir> es nullptr, el
+// fichero <puesto> tenía antes el tamaño <size>. Si <origen> no es nullptr, <puesto> se movió desde ese
+// directorio, en el que se llamaba <nombre>
+struct Cambio {
+    std::shared_ptr<Directorio> dir;
+    std::shared_ptr<Nodo> quitado;
+    std::shared_ptr<Nodo> puesto;
+    Tamanyo size = 0;
+    std::shared_ptr<Directorio> origen;
+    RefNombre nombre;
+};
+
+// Deshace <cambio>, el último aplicado al árbol, pasando a <retirar> el nodo que deja de estar en él (si lo hay)
+template <typename F>
+void deshacer(Cambio& cambio, F&& retirar) {
+    if (cambio.dir == nullptr) {
+        static_cast<Fichero&>(*cambio.puesto).updateSize(cambio.size);
+    } else {
+        if (cambio.puesto != nullptr) {
+            cambio.dir->delNode(cambio.puesto);
+            if (cambio.origen != nullptr) {
+                cambio.puesto->rename(std::move(cambio.nombre));
+                cambio.origen->addNode(std::move(cambio.puesto));
+            } else {
+                retirar(std::move(cambio.puesto));
+            }
+        }
+        if (cambio.quitado != nullptr)
+            cambio.dir->addNode(std::move(cambio.quitado));
+    }
+}
+
+// Registro de los cambios hechos en un árbol desde que se marcó el primero de sus estados con nombre (las
+// marcas). Marcar un estado cuesta O(1) y volver a él cuesta, por cada cambio posterior, lo mismo que el
+// cambio (O(profundidad)), en vez de copiar o reconstruir el árbol. Los cambios guardan los nodos que se
+// eliminaron, que siguen vivos mientras se pueda volver a un estado en el que estaban.
+//
+// Mientras no haya ninguna marca no se registra nada.
+//
+// No es un árbol persistente con copia de caminos: los nodos se comparten por identidad (punteros al padre,
+// enlaces que los referencian, índice de nombres, tamaños acumulados), así que no pueden copiarse sólo los de un
+// camino. Por eso volver a una marca cuesta O(cambios posteriores · profundidad), no O(profundidad), y los
+// estados marcados no existen como árboles: se consultan, sin modificarlos, con VistaMarca (vista_marca.h), que
+// reconstruye a partir de estos cambios sólo los directorios que han cambiado desde la marca.
+class RegistroCambios {
+    private:
+        std::vector<Cambio> _cambios;                   // Cambios, del más antiguo al más reciente
+        std::map<std::string, std::size_t> _marcas;     // Nombre de cada marca -> cambios anteriores a ella
+    public:
+        // Devuelve true si hay alguna marca (y por tanto se registran los cambios)
+        bool activo() const {
+            return !_marcas.empty();
+        }
+
+        // Registra <cambio>, si hay alguna marca
+        void anotar(Cambio cambio) {
+            if (activo())
+                _cambios.push_back(std::move(cambio));
+        }
+
+        // Marca con el nombre <name> el estado actual (sustituyendo a la marca de ese nombre, si la había)
+        void marcar(const std::string& name) {
+            _marcas[name] = _cambios.size();
+        }
+
+        // Elimina la marca <name>, y con ella los cambios anteriores a la marca más antigua que quede.
+        // Devuelve false si no existía
+        bool desmarcar(const std::string& name) {
+            if (_marcas.erase(name) == 0)
+                return false;
+            std::size_t primera = _cambios.size();
+            for (const auto& [nombre, pos] : _marcas)
+                primera = std::min(primera, pos);
+            _cambios.erase(_cambios.begin(), _cambios.begin() + primera);
+            for (auto& [nombre, pos] : _marcas)
+                pos -= primera;
+            return true;
+        }
+
+        // Devuelve los nombres de las marcas, ordenados
+        std::vector<std::string> marcas() const {
+            std::vector<std::string> nombres;
+            for (const auto& [name, pos] : _marcas)
+                nombres.push_back(name);
+            return nombres;
+        }
+
+        // Aplica <f>, del más reciente al más antiguo, a los cambios posteriores a la marca <name>. Devuelve false
+        // si la marca no existe
+        template <typename F>
+        bool forEachPosterior(const std::string& name, F&& f) const {
+            auto it = _marcas.find(name);
+            if (it == _marcas.end())
+                return false;
+            for (std::size_t i = _cambios.size(); i > it->second; i--)
+                f(_cambios[i - 1]);
+            return true;
+        }
+
+        // Aplica <f> a cada uno de los nodos que guardan los cambios registrados
+        template <typename F>
+        void forEachNodo(F&& f) const {
+            for (const Cambio& cambio : _cambios) {
+                if (cambio.dir != nullptr)
+                    f(cambio.dir);
+                if (cambio.quitado != nullptr)
+                    f(cambio.quitado);
+                if (cambio.puesto != nullptr)
+                    f(cambio.puesto);
+                if (cambio.origen != nullptr)
+                    f(cambio.origen);
+            }
+        }
+
+        // Sustituye cada uno de los nodos que guardan los cambios registrados por el que devuelve <f> para él,
+        // que debe ser del mismo tipo
+        template <typename F>
+        void sustituirNodos(F&& f) {
+            auto sustituir = [&f](auto& node) {
+                using T = typename std::remove_reference_t<decltype(node)>::element_type;
+                if (node != nullptr)
+                    node = std::static_pointer_cast<T>(f(node));
+            };
+            for (Cambio& cambio : _cambios) {
+                sustituir(cambio.dir);
+                sustituir(cambio.quitado);
+                sustituir(cambio.puesto);
+                sustituir(cambio.origen);
+            }
+        }
+
+        // Elimina todas las marcas y los cambios registrados
+        void clear() {
+            _marcas.clear();
+            _cambios.clear();
+        }
+
+        // Deshace, del más reciente al más antiguo, los cambios posteriores a la marca <name>, pasando a <retirar>
+        // los nodos que dejan de estar en el árbol. Se eliminan las marcas posteriores a <name>, pero ésta se
+        // conserva. Devuelve false (sin deshacer nada) si la marca no existe
+        template <typename F>
+        bool volver(const std::string& name, F&& retirar) {
+            auto it = _marcas.find(name);
+            if (it == _marcas.end())
+                return false;
+            std::size_t pos = it->second;
+            while (_cambios.size() > pos) {
+                deshacer(_cambios.back(), retirar);
+                _cambios.pop_back();
+            }
+            for (auto m = _marcas.begin(); m != _marcas.end(); )
+                m = m->second > pos ? _marcas.erase(m) : std::next(m);
+            return true;
+        }
+};
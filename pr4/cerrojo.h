@@ -0,0 +1,90 @@
+//------------------------------------------------------------------------------
+// File:   cerrojo.h
+// Author: Daniel Herce (NIP 848884), Alain Villagrasa (NIP 816787)
+// Date:   Marzo 2023
+// Coms:   Fichero que implementa un cerrojo lectores/escritor distribuido,
+//         optimizado para lecturas concurrentes desde muchos hilos
+//------------------------------------------------------------------------------
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+// Cerrojo lectores/escritor en el que cada lector sólo modifica el contador de su ranura (una por línea
+// de caché), de modo que los lectores de distintos hilos no compiten entre sí. El escritor anuncia su
+// llegada y espera a que se vacíen todas las ranuras. Cumple los requisitos de SharedMutex necesarios
+// para std::shared_lock y std::unique_lock
+class CerrojoLectores {
+    private:
+        static constexpr std::size_t RANURAS = 64;
+
+        struct alignas(64) Ranura {
+            std::atomic<long> lectores{0};  // Lectores activos asignados a la ranura
+        };
+
+        Ranura _ranuras[RANURAS];           // Contadores de lectores
+        alignas(64) std::atomic<bool> _escritor{false}; // Hay un escritor activo o esperando
+        std::mutex _escritores;             // Serializa a los escritores
+
+        // Devuelve la ranura asignada al hilo actual
+        Ranura& ranura() {
+            thread_local const std::size_t r = std::hash<std::thread::id>()(std::this_thread::get_id()) % RANURAS;
+            return _ranuras[r];
+        }
+    public:
+        void lock_shared() {
+            Ranura& r = ranura();
+            for (;;) {
+                r.lectores.fetch_add(1, std::memory_order_seq_cst);
+                if (!_escritor.load(std::memory_order_seq_cst))
+                    return;
+                // Hay un escritor: nos retiramos hasta que termine
+                r.lectores.fetch_sub(1, std::memory_order_release);
+                while (_escritor.load(std::memory_order_acquire))
+                    std::this_thread::yield();
+            }
+        }
+
+        bool try_lock_shared() {
+            Ranura& r = ranura();
+            r.lectores.fetch_add(1, std::memory_order_seq_cst);
+            if (!_escritor.load(std::memory_order_seq_cst))
+                return true;
+            r.lectores.fetch_sub(1, std::memory_order_release);
+            return false;
+        }
+
+        void unlock_shared() {
+            ranura().lectores.fetch_sub(1, std::memory_order_release);
+        }
+
+        void lock() {
+            _escritores.lock();
+            _escritor.store(true, std::memory_order_seq_cst);
+            for (Ranura& r : _ranuras)
+                while (r.lectores.load(std::memory_order_acquire) != 0)
+                    std::this_thread::yield();
+        }
+
+        bool try_lock() {
+            if (!_escritores.try_lock())
+                return false;
+            _escritor.store(true, std::memory_order_seq_cst);
+            for (Ranura& r : _ranuras) {
+                if (r.lectores.load(std::memory_order_acquire) != 0) {
+                    unlock();
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        void unlock() {
+            _escritor.store(false, std::memory_order_release);
+            _escritores.unlock();
+        }
+};
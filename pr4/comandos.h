@@ -0,0 +1,388 @@
+//------------------------------------------------------------------------------
+// File:   comandos.h
+// Author: Daniel Herce (NIP 848884), Alain Villagrasa (NIP 816787)
+// Date:   Marzo 2023
+// Coms:   Fichero que implementa la interpretación de los comandos de texto
+//         sobre una Shell, común a todos los modos de ejecución
+//------------------------------------------------------------------------------
+
+#pragma once
+
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <stdexcept>
+#include <string_view>
+#include <vector>
+#include <sys/stat.h>
+#include "shell.h"
+#include "estadisticas.h"
+#include "arbol_ficheros_error.h"
+
+// Separa <line> en palabras delimitadas por espacios en blanco, que se dejan en <cmd> como vistas
+// sobre la propia línea
+inline void tokenize(std::string_view line, std::vector<std::string_view>& cmd) {
+    cmd.clear();
+    constexpr std::string_view BLANCOS = " \t\r\n\v\f";
+    std::size_t pos = line.find_first_not_of(BLANCOS);
+    while (pos != std::string_view::npos) {
+        std::size_t fin = line.find_first_of(BLANCOS, pos);
+        cmd.push_back(line.substr(pos, fin - pos));
+        pos = fin == std::string_view::npos ? fin : line.find_first_not_of(BLANCOS, fin);
+    }
+}
+
+// Acceso de los comandos a ficheros del sistema real (save, load, import, mount de una imagen y stats dump).
+// Por defecto es libre, pero en modo servidor los clientes no deben poder leer ni escribir cualquier fichero
+// del anfitrión, así que se prohíbe o se confina a un directorio: las rutas deben ser relativas a él y no
+// pueden salir de él, ni con ".." ni a través de enlaces simbólicos
+class AccesoHost {
+    private:
+        bool _permitido = true;
+        std::string _raiz;      // Ruta canónica del directorio al que se confina, terminada en '/' ("" si no se confina)
+
+        // Devuelve true si la ruta real de <path> existe y queda fuera de _raiz
+        bool fuera(const std::string& path) const {
+            std::unique_ptr<char, decltype(&std::free)> real(::realpath(path.c_str(), nullptr), &std::free);
+            if (real == nullptr)
+                return false;
+            std::string r = std::string(real.get()) + '/';
+            return r.compare(0, _raiz.size(), _raiz) != 0;
+        }
+    public:
+        // Constructor de un acceso libre
+        AccesoHost() = default;
+
+        // Devuelve un acceso que no permite usar ningún fichero
+        static AccesoHost prohibido() {
+            AccesoHost acceso;
+            acceso._permitido = false;
+            return acceso;
+        }
+
+        // Devuelve un acceso confinado al directorio <dir>. Si no es un directorio accesible, lanza host_access_denied
+        static AccesoHost confinado(const std::string& dir) {
+            std::unique_ptr<char, decltype(&std::free)> real(::realpath(dir.c_str(), nullptr), &std::free);
+            struct stat st;
+            if (real == nullptr || ::stat(real.get(), &st) != 0 || !S_ISDIR(st.st_mode))
+                throw host_access_denied(dir, real == nullptr ? std::strerror(errno) : "not a directory");
+            AccesoHost acceso;
+            acceso._raiz = real.get();
+            if (acceso._raiz.back() != '/')
+                acceso._raiz += '/';
+            return acceso;
+        }
+
+        // Devuelve la ruta con la que se accede al fichero <path>. Si el acceso no lo permite, lanza
+        // host_access_denied
+        std::string ruta(std::string_view path) const {
+            if (!_permitido)
+                throw host_access_denied(std::string(path), "host files are disabled");
+            if (_raiz.empty())
+                return std::string(path);
+            if (path.empty() || path.front() == '/')
+                throw host_access_denied(std::string(path), "the path must be relative to " + _raiz);
+            for (std::string_view resto = path; !resto.empty(); ) {
+                std::size_t sep = resto.find('/');
+                if (resto.substr(0, sep) == "..")
+                    throw host_access_denied(std::string(path), "the path must stay inside " + _raiz);
+                resto.remove_prefix(sep == std::string_view::npos ? resto.size() : sep + 1);
+            }
+            // Los enlaces simbólicos del camino (o el propio fichero, si existe) no pueden llevar fuera
+            std::string completa = _raiz + std::string(path);
+            std::size_t sep = completa.find_last_of('/');
+            if (fuera(completa.substr(0, sep)) || fuera(completa))
+                throw host_access_denied(std::string(path), "the path must stay inside " + _raiz);
+            return completa;
+        }
+};
+
+// Devuelve el valor entero de <s>. Si no es un entero, lanza std::invalid_argument
+inline std::int64_t toInt(std::string_view s) {
+    std::int64_t value = 0;
+    auto [fin, ec] = std::from_chars(s.data(), s.data() + s.size(), value);
+    if (ec != std::errc() || fin != s.data() + s.size())
+        throw std::invalid_argument("Error sintactico: " + std::string(s) + " no es un entero valido");
+    return value;
+}
+
+// Devuelve la condición sobre el tamaño expresada por <s>: +N (mayor que N), -N (menor que N) o N (igual a
+// N). Si no es válida, lanza std::invalid_argument
+inline FiltroTamanyo toFiltro(std::string_view s) {
+    FiltroTamanyo filtro;
+    filtro.op = '=';
+    if (!s.empty() && (s.front() == '+' || s.front() == '-')) {
+        filtro.op = s.front();
+        s.remove_prefix(1);
+    }
+    filtro.size = toInt(s);
+    return filtro;
+}
+
+// Devuelve el tramo de listado que indican las opciones --offset N y --limit N de <cmd>, a partir de la
+// palabra <desde>. Si <recursive> no es nullptr, acepta también la opción -r y la indica en él. Si alguna
+// opción no es válida, lanza std::invalid_argument
+inline Pagina toPagina(const std::vector<std::string_view>& cmd, const std::size_t desde, bool* recursive = nullptr) {
+    Pagina pagina;
+    for (std::size_t i = desde; i < cmd.size(); i++) {
+        if (recursive != nullptr && cmd[i] == "-r") {
+            *recursive = true;
+        } else if ((cmd[i] == "--offset" || cmd[i] == "--limit") && i + 1 < cmd.size()) {
+            std::int64_t n = toInt(cmd[i + 1]);
+            if (n < 0)
+                throw std::invalid_argument("Error sintactico: " + std::string(cmd[i + 1]) + " no es un entero valido");
+            (cmd[i] == "--offset" ? pagina.offset : pagina.limit) = std::size_t(n);
+            i++;
+        } else {
+            throw std::invalid_argument("Error sintactico: opcion desconocida " + std::string(cmd[i]));
+        }
+    }
+    return pagina;
+}
+
+// Devuelve las modificaciones del comando batch <cmd>, cuyas palabras a partir de la segunda deben formar un
+// bloque "{ orden; orden; ... }" de órdenes mkdir, vi, ln, rm, mv y cd separadas por ';'. Como las palabras son
+// vistas sobre la línea, el bloque es el texto que va de la segunda a la última. Si no es válido, lanza
+// std::invalid_argument
+inline std::vector<OpLote> toLote(const std::vector<std::string_view>& cmd) {
+    std::string_view bloque(cmd.at(1).data(), cmd.back().data() + cmd.back().size() - cmd[1].data());
+    if (bloque.front() != '{' || bloque.back() != '}')
+        throw std::invalid_argument("Error sintactico: el bloque de batch debe ir entre llaves");
+    bloque = bloque.substr(1, bloque.size() - 2);
+    std::vector<OpLote> ops;
+    std::vector<std::string_view> palabras;
+    while (true) {
+        std::size_t fin = bloque.find(';');
+        tokenize(bloque.substr(0, fin), palabras);
+        if (!palabras.empty()) {
+            std::string_view orden = palabras[0];
+            if (orden == "mkdir" && palabras.size() == 2)
+                ops.push_back({OrdenLote::MKDIR, palabras[1]});
+            else if (orden == "vi" && palabras.size() == 3)
+                ops.push_back({OrdenLote::VI, palabras[1], {}, toInt(palabras[2])});
+            else if (orden == "ln" && palabras.size() == 3)
+                ops.push_back({OrdenLote::LN, palabras[1], palabras[2]});
+            else if (orden == "rm" && palabras.size() == 2)
+                ops.push_back({OrdenLote::RM, palabras[1]});
+            else if (orden == "mv" && palabras.size() == 3)
+                ops.push_back({OrdenLote::MV, palabras[1], palabras[2]});
+            else if (orden == "cd" && palabras.size() == 2)
+                ops.push_back({OrdenLote::CD, palabras[1]});
+            else
+                throw std::invalid_argument("Error sintactico: orden no valida en batch: " + std::string(orden));
+        }
+        if (fin == std::string_view::npos)
+            return ops;
+        bloque.remove_prefix(fin + 1);
+    }
+}
+
+// Bloque batch escrito en varias líneas: tras una línea "batch {", las siguientes se acumulan separadas por
+// ';' hasta una que empiece por '}', y entonces todo el bloque se ejecuta como un único comando batch
+class BloqueLote {
+    private:
+        std::string _texto;     // Comando batch acumulado
+        bool _abierto = false;  // Hay un bloque abierto
+    public:
+        // Devuelve true si hay un bloque abierto
+        bool abierto() const {
+            return _abierto;
+        }
+
+        // Procesa la línea <line>. Si abre un bloque o forma parte de uno abierto, la acumula y devuelve true.
+        // Si no, devuelve false y <line> debe ejecutarse; si cierra un bloque, pasa a ser el comando batch
+        // completo (válido hasta la siguiente llamada)
+        bool acumular(std::string_view& line) {
+            if (!_abierto && line.find('{') == std::string_view::npos)
+                return false;
+            constexpr std::string_view BLANCOS = " \t\r\n\v\f";
+            std::size_t ini = line.find_first_not_of(BLANCOS);
+            std::size_t fin = line.find_last_not_of(BLANCOS);
+            std::string_view resto = ini == std::string_view::npos ? std::string_view() : line.substr(ini, fin + 1 - ini);
+            if (!_abierto) {
+                if (resto.substr(0, 5) != "batch" || resto.back() != '{' || resto.find('}') != std::string_view::npos
+                    || resto.substr(5, resto.size() - 6).find_first_not_of(BLANCOS) != std::string_view::npos)
+                    return false;
+                _abierto = true;
+                _texto = "batch {";
+                return true;
+            }
+            if (!resto.empty() && resto.front() == '}') {
+                _abierto = false;
+                _texto += " }";
+                line = _texto;
+                return false;
+            }
+            _texto += ' ';
+            _texto += resto;
+            _texto += ';';
+            return true;
+        }
+};
+
+// Ejecuta el comando stats: sin argumentos muestra las estadísticas en <out>; "on" y "off" las activan y
+// desactivan, "reset" las pone a cero y "dump <fichero>" las escribe en un fichero (según <host>)
+inline void ejecutarStats(const std::vector<std::string_view>& cmd, std::ostream& out, const AccesoHost& host) {
+    Estadisticas& est = Estadisticas::global();
+    if (cmd.size() == 1) {
+        est.informe(out);
+    } else if (cmd[1] == "on" || cmd[1] == "off") {
+        est.activar(cmd[1] == "on");
+    } else if (cmd[1] == "reset") {
+        est.reset();
+    } else if (cmd[1] == "dump") {
+        std::string path = host.ruta(cmd.at(2));
+        std::ofstream f(path);
+        est.informe(f);
+        if (!f.flush())
+            throw std::invalid_argument("Error: no se pueden escribir las estadisticas en " + path);
+    } else {
+        throw std::invalid_argument("Error sintactico: opcion desconocida " + std::string(cmd[1]));
+    }
+}
+
+// Ejecuta el comando mount: "mount <imagen> [presupuesto]" monta la imagen <imagen> y "mount -g <ramas>
+// <ficheros> <niveles> <tamaño> [presupuesto]" un árbol generado, cargando los directorios al usarlos y
+// descargándolos cuando los cargados ocupan más de <presupuesto> bytes. La imagen se abre según <host>
+inline void ejecutarMount(Shell& sh, const std::vector<std::string_view>& cmd, const AccesoHost& host) {
+    const bool generado = cmd.at(1) == "-g";
+    const std::size_t args = generado ? 6 : 2;
+    std::size_t presupuesto = Montaje::PRESUPUESTO;
+    if (cmd.size() > args) {
+        std::int64_t n = toInt(cmd[args]);
+        if (n < 0)
+            throw std::invalid_argument("Error sintactico: " + std::string(cmd[args]) + " no es un entero valido");
+        presupuesto = std::size_t(n);
+    }
+    if (generado)
+        sh.mount(std::make_unique<FuenteGenerada>(toInt(cmd.at(2)), toInt(cmd.at(3)), toInt(cmd.at(4)), toInt(cmd.at(5))),
+                 presupuesto);
+    else
+        sh.mount(std::make_unique<FuenteImagen>(host.ruta(cmd[1])), presupuesto);
+}
+
+// Escribe en <out> el informe de memoria <inf> del comando memstat, un grupo de nodos o de bytes por línea:
+// los nodos del árbol por tipo, los eliminados que siguen vivos (huérfanos, con el número de subárboles a los
+// que pertenecen, y retenidos), los nombres internados, los bytes de las arenas y, si el árbol está montado,
+// los directorios perezosos cargados
+inline void escribirMemoria(const InformeMemoria& inf, std::ostream& out) {
+    constexpr const char* TIPOS[] = {"fichero", "directorio", "enlace"};
+    out << "tipo nodos bytes\n";
+    for (std::size_t t = 0; t < std::size(TIPOS); t++)
+        out << TIPOS[t] << ' ' << inf.tipos[t].nodos << ' ' << inf.tipos[t].bytes << '\n';
+    out << "huerfanos " << inf.huerfanos.nodos << ' ' << inf.huerfanos.bytes << " subarboles " << inf.subarboles << '\n';
+    out << "retenidos " << inf.retenidos.nodos << ' ' << inf.retenidos.bytes << '\n';
+    out << "nombres " << inf.nombres << " usados " << inf.nombresUsados << " bytes " << inf.bytesNombres
+        << " indice " << inf.bytesIndice << '\n';
+    out << "arenas reservados " << inf.reservados << " en_uso " << inf.enUso << '\n';
+    if (inf.montado)
+        out << "perezosos directorios " << inf.perezosos.directorios << " bytes " << inf.perezosos.bytes
+            << " presupuesto " << inf.perezosos.presupuesto << '\n';
+}
+
+// Ejecuta sobre <sh> el comando <cmd>, ya separado en palabras, escribiendo su salida en <out>. Los ficheros
+// del sistema real se usan según <host>. Si el comando falla (con cualquier excepción), escribe el error en
+// <err> precedido de <prefijo>. Devuelve false si el comando indica el fin de la sesión. Si las estadísticas
+// están activadas, registra su latencia y sus errores
+inline bool ejecutar(Shell& sh, const std::vector<std::string_view>& cmd, std::ostream& out,
+                     std::ostream& err, std::string_view prefijo = "", const AccesoHost& host = AccesoHost()) {
+    Estadisticas& est = Estadisticas::global();
+    const bool medir = est.activas();
+    std::size_t c = 0;
+    std::chrono::steady_clock::time_point t0;
+    if (medir) {
+        c = Estadisticas::comando(cmd[0]);
+        t0 = std::chrono::steady_clock::now();
+    }
+    try {
+        if ((cmd[0] == "exit") || (cmd[0] == "by")) {
+            return false;
+        } else if (cmd[0] == "pwd") {
+            out << sh.pwd() << '\n';
+        } else if (cmd[0] == "ls") {
+            sh.ls(out, toPagina(cmd, 1));
+        } else if (cmd[0] == "du") {
+            bool recursive = false;
+            Pagina pagina = toPagina(cmd, 1, &recursive);
+            sh.du(out, recursive, pagina);
+        } else if (cmd[0] == "mkdir") {
+            sh.mkdir(cmd.at(1));
+        } else if (cmd[0] == "vi") {
+            sh.vi(cmd.at(1), toInt(cmd.at(2)));
+        } else if (cmd[0] == "stat") {
+            out << sh.stat(cmd.at(1)) << '\n';
+        } else if (cmd[0] == "cd") {
+            sh.cd(cmd.at(1));
+        } else if (cmd[0] == "ln") {
+            sh.ln(cmd.at(1), cmd.at(2));
+        } else if (cmd[0] == "rm") {
+            sh.rm(cmd.at(1));
+        } else if (cmd[0] == "mv") {
+            sh.mv(cmd.at(1), cmd.at(2));
+        } else if (cmd[0] == "save") {
+            sh.save(host.ruta(cmd.at(1)));
+        } else if (cmd[0] == "load") {
+            sh.load(host.ruta(cmd.at(1)));
+        } else if (cmd[0] == "find") {
+            out << sh.find(cmd.at(1), cmd.size() > 2 ? toFiltro(cmd[2]) : FiltroTamanyo());
+        } else if (cmd[0] == "snapshot") {
+            if (cmd.size() == 1)
+                out << sh.snapshots();
+            else if (cmd[1] == "-d")
+                sh.dropSnapshot(cmd.at(2));
+            else
+                sh.snapshot(cmd[1]);
+        } else if (cmd[0] == "rollback") {
+            sh.rollback(cmd.at(1));
+        } else if (cmd[0] == "batch") {
+            sh.batch(toLote(cmd));
+        } else if (cmd[0] == "import") {
+            Importacion res = cmd.at(1) == "-d" ? sh.import(host.ruta(cmd.at(2)), true) : sh.import(host.ruta(cmd[1]));
+            out << "ficheros " << res.ficheros << " directorios " << res.directorios << " enlaces " << res.enlaces
+                << " omitidos " << res.omitidos << '\n';
+        } else if (cmd[0] == "memstat") {
+            escribirMemoria(sh.memstat(), out);
+        } else if (cmd[0] == "compact") {
+            Compactacion res = sh.compact();
+            out << "nodos " << res.nodos << " reservados_antes " << res.antes << " reservados_despues " << res.despues
+                << " nombres_purgados " << res.nombres << '\n';
+        } else if (cmd[0] == "mount") {
+            ejecutarMount(sh, cmd, host);
+        } else if (cmd[0] == "stats") {
+            ejecutarStats(cmd, out, host);
+        } else {
+            if (medir)
+                est.error(c, "sintaxis");
+            err << prefijo << "Error sintactico: comando desconocido" << '\n';
+        }
+    } catch (const arbol_ficheros_error& e) {
+        if (medir)
+            est.error(c, e.name());
+        err << prefijo << e.what() << '\n';
+    } catch (const std::out_of_range& e) {
+        if (medir)
+            est.error(c, "sintaxis");
+        err << prefijo << "Error sintactico: parametros insuficientes" << '\n';
+        err << prefijo << e.what() << '\n';
+    } catch (const std::invalid_argument& e) {
+        if (medir)
+            est.error(c, "sintaxis");
+        err << prefijo << e.what() << '\n';
+    } catch (const std::exception& e) {
+        // Cualquier otro fallo (p.ej. falta de memoria) sólo afecta a este comando
+        if (medir)
+            est.error(c, "interno");
+        err << prefijo << "Error: " << e.what() << '\n';
+    }
+    if (medir)
+        est.registrar(c, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - t0).count());
+    return true;
+}
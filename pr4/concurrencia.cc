@@ -0,0 +1,235 @@
+//------------------------------------------------------------------------------
+// File:   concurrencia.cc
+// Author: Daniel Herce (NIP 848884), Alain Villagrasa (NIP 816787)
+// Date:   Marzo 2023
+// Coms:   Prueba de estres de varias sesiones concurrentes (lectores y
+//         escritores) sobre un mismo arbol, que comprueba que los tamaños
+//         acumulados que ven los lectores son siempre coherentes, y de que
+//         compactar con estados marcados no hace crecer la memoria reservada
+//------------------------------------------------------------------------------
+
+#include <atomic>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "shell.h"
+
+using namespace std;
+
+mutex salida;
+atomic<size_t> fallos{0};
+
+// Anota un fallo de la prueba
+void fallo(const string& msg)
+{
+	lock_guard<mutex> lock(salida);
+	if (fallos++ < 10)
+		cerr << "FALLO: " << msg << endl;
+}
+
+// Comprueba que en el listado de du -r <listado>, obtenido en una sola seccion compartida, el tamaño de
+// cada directorio es la suma de los de los nodos que contiene
+void comprobarListado(const string& listado, const string& origen)
+{
+	map<string, Tamanyo> tamanyos, sumas;
+	istringstream in(listado);
+	string linea;
+	while (getline(in, linea))
+	{
+		size_t coma = linea.rfind(", ");
+		string ruta = linea.substr(0, coma);
+		Tamanyo t = stoll(linea.substr(coma + 2));
+		tamanyos[ruta] = t;
+		size_t barra = ruta.rfind('/');
+		if (barra != string::npos)
+			sumas[ruta.substr(0, barra)] += t;
+	}
+	for (const auto& [dir, suma] : sumas)
+		if (tamanyos[dir] != suma)
+			fallo(origen + "/" + dir + ": tamaño " + to_string(tamanyos[dir]) + ", contenido " + to_string(suma));
+}
+
+// Escritor <w>: modifica su propio subarbol /w<w>, llevando aparte la cuenta de sus ficheros, y el
+// subarbol /comun, compartido con el resto de escritores
+void escribir(Shell sh, int w, size_t ops, map<string, Tamanyo>& modelo)
+{
+	mt19937_64 rnd(w);
+	const string raiz = "/w" + to_string(w);
+	const vector<string> dirs = {raiz, raiz + "/d0", raiz + "/d1", raiz + "/d1/e"};
+	for (size_t i = 0; i < ops; i++)
+	{
+		const string& dir = dirs[rnd() % dirs.size()];
+		const string name = "f" + to_string(rnd() % 8);
+		const string ruta = dir + "/" + name;
+		int op = rnd() % 10;
+		try
+		{
+			if (op < 4)
+			{
+				Tamanyo size = rnd() % 4096;
+				sh.cd(dir);
+				sh.vi(name, size);
+				modelo[ruta] = size;
+			}
+			else if (op < 6)
+			{
+				if (!modelo.count(ruta))
+					continue;
+				if (op == 4)
+				{
+					sh.rm(ruta);
+				}
+				else
+				{
+					const string destino = dirs[rnd() % dirs.size()] + "/m" + to_string(i);
+					sh.mv(ruta, destino);
+					modelo[destino] = modelo[ruta];
+				}
+				modelo.erase(ruta);
+			}
+			else if (op < 7)
+			{
+				// Directorio temporal con algunos ficheros, que despues se borra entero
+				const string tmp = raiz + "/t";
+				sh.cd(raiz);
+				sh.mkdir("t");
+				sh.cd(tmp);
+				for (int f = 0; f < 4; f++)
+					sh.vi("f" + to_string(f), rnd() % 4096);
+				sh.rm(tmp);
+			}
+			else
+			{
+				// Subarbol compartido: los errores (nombres ocupados o inexistentes) son esperables
+				const string c = "c" + to_string(rnd() % 16);
+				sh.cd("/comun");
+				switch (op)
+				{
+					case 7: sh.vi(c, rnd() % 4096); break;
+					case 8: sh.ln("/comun/c" + to_string(rnd() % 16), "l" + to_string(rnd() % 16)); break;
+					default: sh.rm(rnd() % 2 ? c : "l" + to_string(rnd() % 16)); break;
+				}
+			}
+		}
+		catch (const arbol_ficheros_error&)
+		{
+		}
+	}
+}
+
+// Lector <r>: lista recursivamente subarboles mientras los escritores los modifican
+void leer(Shell sh, int r, int escritores, const atomic<bool>& fin)
+{
+	mt19937_64 rnd(1000 + r);
+	size_t listados = 0;
+	while (!fin.load(memory_order_relaxed) || listados == 0)
+	{
+		size_t k = rnd() % (escritores + 2);
+		string ruta = k == 0 ? "/" : k == 1 ? "/comun" : "/w" + to_string(k - 2);
+		sh.cd(ruta);
+		comprobarListado(sh.du(true), ruta);
+		listados++;
+	}
+}
+
+// Compacta dos veces el arbol de <sh> con un estado marcado que conserva nodos eliminados: la memoria
+// reservada no debe crecer, ya que las arenas anteriores deben liberarse aunque haya marcas
+void comprobarCompactacion(Shell& sh, const string& origen)
+{
+	for (int i = 0; i < 2; i++)
+	{
+		Compactacion res = sh.compact();
+		if (res.despues > res.antes)
+			fallo(origen + ": compact reserva " + to_string(res.despues) + " bytes, antes " + to_string(res.antes));
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	int escritores = 4, lectores = 4;
+	size_t ops = argc > 1 ? strtoull(argv[1], nullptr, 10) : 20000;
+
+	Shell sh;
+	sh.mkdir("comun");
+	for (int w = 0; w < escritores; w++)
+	{
+		string raiz = "w" + to_string(w);
+		sh.mkdir(raiz);
+		sh.cd(raiz);
+		sh.mkdir("d0");
+		sh.mkdir("d1");
+		sh.cd("d1");
+		sh.mkdir("e");
+		sh.cd("/");
+	}
+
+	vector<map<string, Tamanyo>> modelos(escritores);
+	atomic<bool> fin{false};
+	vector<thread> hilos;
+	for (int r = 0; r < lectores; r++)
+		hilos.emplace_back(leer, Shell(sh.fs()), r, escritores, cref(fin));
+	vector<thread> escrituras;
+	for (int w = 0; w < escritores; w++)
+		escrituras.emplace_back(escribir, Shell(sh.fs()), w, ops, ref(modelos[w]));
+	for (thread& t : escrituras)
+		t.join();
+	fin = true;
+	for (thread& t : hilos)
+		t.join();
+
+	// Cada subarbol propio debe medir lo que suman los ficheros que su escritor cree haber dejado
+	for (int w = 0; w < escritores; w++)
+	{
+		Tamanyo esperado = 0;
+		for (const auto& [ruta, size] : modelos[w])
+			esperado += size;
+		Tamanyo obtenido = sh.stat("/w" + to_string(w));
+		if (obtenido != esperado)
+			fallo("/w" + to_string(w) + ": tamaño " + to_string(obtenido) + ", esperado " + to_string(esperado));
+	}
+	comprobarListado(sh.du(true), "/");
+
+	// Los tamaños mantenidos incrementalmente deben coincidir con los recalculados desde cero
+	Tamanyo total = sh.stat("/");
+	{
+		auto lock = sh.fs()->escribir();
+		Tamanyo recalculado = sh.fs()->recalcularTamanyos();
+		if (recalculado != total)
+			fallo("/: tamaño " + to_string(total) + ", recalculado " + to_string(recalculado));
+	}
+
+	// Compactar con marcas no debe retener las arenas anteriores
+	{
+		Shell marcado;
+		marcado.mkdir("a");
+		marcado.cd("a");
+		marcado.vi("f", 10);
+		marcado.cd("..");
+		marcado.snapshot("s");
+		marcado.rm("a");
+		comprobarCompactacion(marcado, "marca");
+		marcado.rollback("s");
+		if (marcado.stat("/a/f") != 10)
+			fallo("marca: rollback tras compact");
+	}
+	sh.snapshot("fin");
+	sh.rm("/comun");
+	comprobarCompactacion(sh, "/");
+	comprobarListado(sh.du(true), "/");
+
+	if (fallos > 0)
+	{
+		cerr << fallos << " fallos" << endl;
+		return 1;
+	}
+	cout << "concurrencia: " << escritores << " escritores, " << lectores << " lectores, "
+		 << ops << " operaciones por escritor: ok" << endl;
+	return 0;
+}
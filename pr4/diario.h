@@ -0,0 +1,402 @@
+//------------------------------------------------------------------------------
+// File:   diario.h
+// Author: Daniel Herce (NIP 848884), Alain Villagrasa (NIP 816787)
+// Date:   Marzo 2023
+// Coms:   Fichero que implementa el diario de operaciones del árbol de
+//         ficheros, que permite recuperarlo tras una caída
+//------------------------------------------------------------------------------
+
+#pragma once
+
+#include <array>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "arbol_ficheros_error.h"
+#include "imagen.h"
+
+// Operaciones que modifican el árbol y se registran en el diario
+enum class Operacion : std::uint8_t {
+    VI,
+    MKDIR,
+    LN,
+    RM,
+    MV,
+    MOUNT
+};
+
+// Formato del diario (en el orden de bytes de la máquina): una cabecera de 16 bytes seguida de registros
+//
+//   uint32_t longitud                longitud del contenido
+//   uint32_t crc                     CRC-32 del contenido
+//   contenido:
+//     uint64_t secuencia             número de la operación, estrictamente creciente
+//     uint8_t op                     Operacion
+//     int64_t size                   tamaño (vi) o presupuesto (mount)
+//     3 x (uint32_t n, char[n])      ruta activa y argumentos de la operación (mount: origen de la fuente)
+//
+// Un registro incompleto o con un CRC incorrecto (escrito a medias durante una caída) marca el final del
+// diario: él y todo lo que le sigue se descartan al recuperarlo.
+namespace diario {
+    constexpr char MAGICO[8] = {'A', 'R', 'B', 'O', 'L', 'W', 'A', 'L'};
+    constexpr std::uint32_t VERSION = 1;
+    constexpr std::size_t CABECERA = 16;
+
+    // Registro leído del diario. Las vistas apuntan al fichero proyectado en memoria
+    struct Registro {
+        std::uint64_t secuencia;
+        Operacion op;
+        std::int64_t size;
+        std::string_view ruta;      // Ruta activa (absoluta) de la sesión que realizó la operación
+        std::string_view a, b;      // Argumentos de la operación
+    };
+
+    // Devuelve el CRC-32 (polinomio 0xEDB88320) de los <n> bytes de <datos>
+    inline std::uint32_t crc32(const char* datos, const std::size_t n) {
+        static const std::array<std::uint32_t, 256> tabla = [] {
+            std::array<std::uint32_t, 256> t = {};
+            for (std::uint32_t i = 0; i < 256; i++) {
+                std::uint32_t c = i;
+                for (int k = 0; k < 8; k++)
+                    c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+                t[i] = c;
+            }
+            return t;
+        }();
+        std::uint32_t c = 0xFFFFFFFF;
+        for (std::size_t i = 0; i < n; i++)
+            c = tabla[(c ^ std::uint8_t(datos[i])) & 0xFF] ^ (c >> 8);
+        return ~c;
+    }
+
+    // Añade al final de <buf> la representación binaria de <x>
+    template <typename T>
+    void poner(std::string& buf, const T x) {
+        buf.append(reinterpret_cast<const char*>(&x), sizeof(x));
+    }
+    inline void poner(std::string& buf, std::string_view s) {
+        poner(buf, std::uint32_t(s.size()));
+        buf.append(s);
+    }
+
+    // Extrae de <datos> la representación binaria de <x>. Devuelve false si no hay bytes suficientes
+    template <typename T>
+    bool tomar(std::string_view& datos, T& x) {
+        if (datos.size() < sizeof(x))
+            return false;
+        std::memcpy(&x, datos.data(), sizeof(x));
+        datos.remove_prefix(sizeof(x));
+        return true;
+    }
+    inline bool tomar(std::string_view& datos, std::string_view& s) {
+        std::uint32_t n;
+        if (!tomar(datos, n) || datos.size() < n)
+            return false;
+        s = datos.substr(0, n);
+        datos.remove_prefix(n);
+        return true;
+    }
+
+    // Escribe la cabecera de un diario vacío en <fd>
+    inline bool escribirCabecera(const int fd) {
+        char cab[CABECERA] = {};
+        std::memcpy(cab, MAGICO, sizeof(MAGICO));
+        std::memcpy(cab + sizeof(MAGICO), &VERSION, sizeof(VERSION));
+        return ::write(fd, cab, CABECERA) == ssize_t(CABECERA);
+    }
+}
+
+// Aplica <f> a cada uno de los registros válidos del diario <path>, en orden. Devuelve el número de bytes
+// que ocupan la cabecera y los registros válidos (0 si el diario no existe o está vacío). Si el fichero no
+// es un diario, lanza journal_error
+template <typename F>
+std::uint64_t leerDiario(const std::string& path, F&& f) {
+    using namespace diario;
+
+    imagen::Descriptor fd(::open(path.c_str(), O_RDONLY | O_CLOEXEC));
+    if (fd.get() < 0) {
+        if (errno == ENOENT)
+            return 0;
+        throw journal_error(path, std::strerror(errno));
+    }
+    struct stat st;
+    if (::fstat(fd.get(), &st) != 0)
+        throw journal_error(path, std::strerror(errno));
+    if (std::uint64_t(st.st_size) < CABECERA)
+        return 0;
+    void* mem = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd.get(), 0);
+    if (mem == MAP_FAILED)
+        throw journal_error(path, std::strerror(errno));
+    std::unique_ptr<void, std::function<void(void*)>> proyeccion(mem, [&st](void* p) {
+        ::munmap(p, st.st_size);
+    });
+    ::madvise(mem, st.st_size, MADV_SEQUENTIAL);
+
+    std::string_view datos(static_cast<const char*>(mem), st.st_size);
+    std::uint32_t version;
+    std::memcpy(&version, datos.data() + sizeof(MAGICO), sizeof(version));
+    if (datos.substr(0, sizeof(MAGICO)) != std::string_view(MAGICO, sizeof(MAGICO)) || version != VERSION)
+        throw journal_error(path, "not a journal file");
+    datos.remove_prefix(CABECERA);
+
+    std::uint64_t validos = CABECERA;
+    std::uint64_t anterior = 0;
+    for (;;) {
+        std::uint32_t longitud, crc;
+        std::string_view resto = datos;
+        if (!tomar(resto, longitud) || !tomar(resto, crc) || resto.size() < longitud)
+            break;
+        std::string_view contenido = resto.substr(0, longitud);
+        if (crc32(contenido.data(), contenido.size()) != crc)
+            break;
+        Registro r;
+        std::uint8_t op;
+        if (!tomar(contenido, r.secuencia) || !tomar(contenido, op) || !tomar(contenido, r.size)
+            || !tomar(contenido, r.ruta) || !tomar(contenido, r.a) || !tomar(contenido, r.b)
+            || op > std::uint8_t(Operacion::MOUNT) || r.secuencia <= anterior)
+            break;
+        r.op = Operacion(op);
+        f(r);
+        anterior = r.secuencia;
+        datos.remove_prefix(2 * sizeof(std::uint32_t) + longitud);
+        validos += 2 * sizeof(std::uint32_t) + longitud;
+    }
+    return validos;
+}
+
+// Diario en el que se registran, en el orden en que se aplican, las operaciones que modifican el árbol.
+//
+// Los registros se acumulan en memoria y un hilo propio los escribe y sincroniza con el disco en grupo
+// (todos los acumulados en una sola escritura). Con un intervalo de sincronización nulo, cada operación
+// espera a que su registro esté en disco antes de terminar, pero las operaciones de varias sesiones que
+// llegan mientras se sincroniza un grupo se escriben juntas en el siguiente. Con un intervalo positivo,
+// las operaciones no esperan y el hilo escribe lo acumulado cada intervalo, de modo que una caída puede
+// perder como mucho las operaciones de ese último intervalo.
+//
+// Cuando el diario supera cierto tamaño, el árbol se guarda en una imagen (junto al diario, con extensión
+// .img) y el diario se vacía, de modo que el tiempo de recuperación no crece indefinidamente.
+class Diario {
+    private:
+        static constexpr std::size_t MAX_BUFFER = 1 << 20;  // Registros acumulados que fuerzan una escritura
+
+        std::string _path;                      // Fichero del diario
+        int _fd;                                // Descriptor abierto para añadir al final
+        std::chrono::milliseconds _intervalo;   // Intervalo de sincronización (0: cada operación)
+        std::uint64_t _limite;                  // Tamaño a partir del cual conviene compactar el diario
+        std::mutex _mutex;
+        std::condition_variable _pendientes;    // Avisa al hilo de escritura de que hay registros
+        std::condition_variable _escritos;      // Avisa del fin de cada escritura
+        std::string _buffer;                    // Registros todavía no escritos
+        std::uint64_t _secuencia;               // Última operación registrada
+        std::uint64_t _duradera;                // Última operación escrita y sincronizada
+        std::uint64_t _bytes;                   // Tamaño del diario, incluidos los registros pendientes
+        bool _escribiendo;                      // El hilo está escribiendo un grupo
+        bool _fin;                              // El hilo debe terminar
+        int _error;                             // errno del último fallo de escritura (0 si no ha habido)
+        std::thread _hilo;                      // Hilo de escritura
+
+        // Escribe <datos> al final del diario y los sincroniza. Devuelve 0 o el errno del fallo
+        static int volcar(const int fd, const std::string& datos) {
+            const char* p = datos.data();
+            std::size_t n = datos.size();
+            while (n > 0) {
+                ssize_t w = ::write(fd, p, n);
+                if (w < 0 && errno == EINTR)
+                    continue;
+                if (w < 0)
+                    return errno;
+                p += w;
+                n -= w;
+            }
+            return ::fdatasync(fd) == 0 ? 0 : errno;
+        }
+
+        // Bucle del hilo de escritura
+        void escribir() {
+            std::unique_lock<std::mutex> lock(_mutex);
+            for (;;) {
+                auto hayGrupo = [this] {
+                    return _fin || _buffer.size() >= MAX_BUFFER || (_intervalo.count() == 0 && !_buffer.empty());
+                };
+                if (_intervalo.count() == 0)
+                    _pendientes.wait(lock, hayGrupo);
+                else
+                    _pendientes.wait_for(lock, _intervalo, hayGrupo);
+                if (_buffer.empty()) {
+                    if (_fin)
+                        return;
+                    continue;
+                }
+                std::string grupo;
+                grupo.swap(_buffer);
+                std::uint64_t hasta = _secuencia;
+                int fd = _fd;
+                _escribiendo = true;
+                lock.unlock();
+                int error = volcar(fd, grupo);
+                lock.lock();
+                _escribiendo = false;
+                if (error != 0)
+                    _error = error;
+                else
+                    _duradera = hasta;
+                _escritos.notify_all();
+            }
+        }
+
+        // Abre el diario para añadir registros, escribiendo la cabecera si está vacío
+        static int abrir(const std::string& path, std::uint64_t& bytes) {
+            int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+            struct stat st;
+            if (fd < 0 || ::fstat(fd, &st) != 0)
+                throw journal_error(path, std::strerror(errno));
+            bytes = st.st_size;
+            if (bytes == 0) {
+                if (!diario::escribirCabecera(fd) || ::fsync(fd) != 0) {
+                    int error = errno;
+                    ::close(fd);
+                    throw journal_error(path, std::strerror(error));
+                }
+                imagen::sincronizarDirectorio(path);
+                bytes = diario::CABECERA;
+            }
+            return fd;
+        }
+    public:
+        // Constructor. Abre el diario <path> (ya recuperado: sin registros incompletos al final), cuya última
+        // operación es <secuencia>, sincronizándolo con el disco cada <intervalo> y aconsejando compactarlo
+        // cuando supere <limite> bytes
+        Diario(const std::string& path, const std::uint64_t secuencia, const std::chrono::milliseconds intervalo,
+               const std::uint64_t limite = 64 << 20)
+            : _path(path), _fd(abrir(path, _bytes)), _intervalo(intervalo), _limite(limite), _secuencia(secuencia),
+              _duradera(secuencia), _escribiendo(false), _fin(false), _error(0) {
+            _hilo = std::thread(&Diario::escribir, this);
+        }
+
+        Diario(const Diario&) = delete;
+        Diario& operator=(const Diario&) = delete;
+
+        // Destructor. Escribe los registros pendientes antes de cerrar el diario
+        ~Diario() {
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _fin = true;
+            }
+            _pendientes.notify_one();
+            _hilo.join();
+            ::close(_fd);
+        }
+
+        // Devuelve el fichero del diario
+        const std::string& path() const {
+            return _path;
+        }
+
+        // Devuelve el fichero de la imagen en la que se compacta el diario
+        std::string imagen() const {
+            return _path + ".img";
+        }
+
+        // Devuelve el número de la última operación registrada
+        std::uint64_t secuencia() {
+            std::lock_guard<std::mutex> lock(_mutex);
+            return _secuencia;
+        }
+
+        // Devuelve true si el diario ha superado el tamaño a partir del cual conviene compactarlo
+        bool lleno() {
+            std::lock_guard<std::mutex> lock(_mutex);
+            return _bytes > _limite;
+        }
+
+        // Registra la operación <op> realizada desde la ruta activa <ruta> con argumentos <a>, <b> y <size>, y
+        // devuelve su número de secuencia. Debe llamarse dentro de la sección exclusiva en que se aplica, para
+        // que el orden del diario sea el de aplicación. Si una escritura anterior ha fallado, lanza journal_error
+        // (y la operación no debe aplicarse, o debe deshacerse)
+        std::uint64_t registrar(const Operacion op, std::string_view ruta, std::string_view a,
+                                std::string_view b = {}, const std::int64_t size = 0) {
+            return registrar({{0, op, size, ruta, a, b}});
+        }
+
+        // Registra, como registrar(), las operaciones <registros> (sus números de secuencia se ignoran) y
+        // devuelve el número de secuencia de la última: o se registran todas o, si una escritura anterior ha
+        // fallado, ninguna
+        std::uint64_t registrar(const std::vector<diario::Registro>& registros) {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (_error != 0)
+                throw journal_error(_path, std::strerror(_error));
+            std::string& buf = _buffer;
+            std::size_t previo = buf.size();
+            for (const diario::Registro& r : registros) {
+                std::size_t inicio = buf.size();
+                diario::poner(buf, std::uint32_t(0));
+                diario::poner(buf, std::uint32_t(0));
+                diario::poner(buf, ++_secuencia);
+                diario::poner(buf, std::uint8_t(r.op));
+                diario::poner(buf, r.size);
+                diario::poner(buf, r.ruta);
+                diario::poner(buf, r.a);
+                diario::poner(buf, r.b);
+                std::uint32_t longitud = buf.size() - inicio - 2 * sizeof(std::uint32_t);
+                std::uint32_t crc = diario::crc32(buf.data() + inicio + 2 * sizeof(std::uint32_t), longitud);
+                std::memcpy(&buf[inicio], &longitud, sizeof(longitud));
+                std::memcpy(&buf[inicio + sizeof(longitud)], &crc, sizeof(crc));
+            }
+            _bytes += buf.size() - previo;
+            if (_intervalo.count() == 0 || buf.size() >= MAX_BUFFER)
+                _pendientes.notify_one();
+            return _secuencia;
+        }
+
+        // Espera, si el intervalo de sincronización es nulo, a que la operación <secuencia> esté en disco.
+        // Debe llamarse fuera de la sección exclusiva. Si la escritura falla, lanza journal_error
+        void confirmar(const std::uint64_t secuencia) {
+            if (_intervalo.count() != 0)
+                return;
+            std::unique_lock<std::mutex> lock(_mutex);
+            _escritos.wait(lock, [&] {
+                return _duradera >= secuencia || _error != 0;
+            });
+            if (_duradera < secuencia)
+                throw journal_error(_path, std::strerror(_error));
+        }
+
+        // Vacía el diario, una vez guardadas en una imagen todas las operaciones registradas (sin ninguna
+        // operación en curso). El diario vacío se crea aparte y sustituye al actual sólo al completarse
+        void reiniciar() {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _escritos.wait(lock, [this] {
+                return !_escribiendo;
+            });
+            std::string temporal = _path + ".tmp";
+            int fd = ::open(temporal.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+            if (fd < 0)
+                throw journal_error(_path, std::strerror(errno));
+            if (!diario::escribirCabecera(fd) || ::fsync(fd) != 0 || ::rename(temporal.c_str(), _path.c_str()) != 0) {
+                int error = errno;
+                ::close(fd);
+                ::unlink(temporal.c_str());
+                throw journal_error(_path, std::strerror(error));
+            }
+            imagen::sincronizarDirectorio(_path);
+            ::close(_fd);
+            _fd = fd;
+            _buffer.clear();
+            _bytes = diario::CABECERA;
+            _duradera = _secuencia;
+            _error = 0;
+            _escritos.notify_all();
+        }
+};
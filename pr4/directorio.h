@@ -7,57 +7,405 @@
 
 #pragma once
 
-#include <sstream>
+#include <cstdint>
+#include <ostream>
 #include <memory>
-#include <map>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <utility>
 #include "nodo.h"
+#include "indice_hijos.h"
+#include "indice_nombres.h"
+
+// Tramo de un listado: se omiten las <offset> primeras líneas y se escriben como mucho <limit>
+struct Pagina {
+    std::size_t offset = 0;
+    std::size_t limit = SIZE_MAX;
+};
+
+class Directorio;
+
+// Nodo del contenido de un directorio perezoso, tal y como lo describe su respaldo
+struct EntradaRespaldo {
+    TipoNodo kind;
+    std::string_view name;
+    Tamanyo size;           // Fichero: tamaño. Directorio: tamaño acumulado, ya calculado
+    std::uint64_t clave;    // Directorio: clave con la que se pide su contenido al respaldo
+};
+
+// Respaldo del que se carga el contenido de un directorio perezoso la primera vez que se consulta, y que
+// permite volver a descargarlo mientras no se modifique (ver respaldo.h)
+class Respaldo {
+    public:
+        // Destructor
+        virtual ~Respaldo() = default;
+
+        // Deja en <entradas> el contenido guardado del directorio de clave <clave>, sin cargarlo
+        virtual void contenido(std::uint64_t clave, std::vector<EntradaRespaldo>& entradas) const = 0;
+
+        // Carga el contenido de <dir>, si aún no está cargado (con el árbol bloqueado, al menos para lectura)
+        virtual void cargar(Directorio& dir) = 0;
+
+        // Deja de contar con <dir>, cargado, que se destruye o deja de ser perezoso (sólo en una sección
+        // exclusiva)
+        virtual void olvidar(Directorio& dir) = 0;
+};
 
 class Directorio : public Nodo {
     private:
-        std::map<std::string, std::shared_ptr<Nodo>> _children; // Contenido del directorio
+        IndiceHijos _children;                  // Contenido del directorio, indexado por nombre
+        Tamanyo _size;                          // Tamaño acumulado del contenido
+        mutable std::vector<Nodo*> _sorted;     // Contenido ordenado por nombre (se construye al listar)
+        mutable std::atomic<bool> _sortedValid; // _sorted refleja el contenido actual
+        mutable std::mutex _sortedMutex;        // Serializa la reconstrucción de _sorted entre lectores
+        std::shared_ptr<Respaldo> _respaldo;    // Respaldo del contenido, si el directorio es perezoso
+        std::uint64_t _clave;                   // Clave del directorio en su respaldo
+        std::uint32_t _posCargado;              // Posición entre los directorios cargados de su respaldo
+        bool _modificado;                       // El contenido ya no es el guardado en el respaldo
+        mutable std::atomic<bool> _cargado;     // El contenido está en memoria (siempre, si no es perezoso)
+        mutable std::atomic<bool> _usado;       // Se ha consultado desde que el respaldo lo revisó por última vez
+        IndiceNombres* _indice;                 // Índice de nombres del árbol al que pertenece (nullptr si ninguno)
+
+        friend class Montaje;
+
+        // Carga el contenido del directorio si es perezoso y aún no lo está, y anota que se ha consultado
+        void asegurar() const {
+            if (!_cargado.load(std::memory_order_acquire))
+                _respaldo->cargar(const_cast<Directorio&>(*this));
+            if (_respaldo != nullptr && !_usado.load(std::memory_order_relaxed))
+                _usado.store(true, std::memory_order_relaxed);
+        }
+
+        // Pone en el directorio perezoso, aún sin cargar, los nodos <nodes> cargados de su respaldo, cuyos
+        // tamaños ya están incluidos en el acumulado, y lo marca como cargado
+        void completarCarga(const std::vector<std::shared_ptr<Nodo>>& nodes) {
+            _children.reserve(nodes.size());
+            for (const std::shared_ptr<Nodo>& node : nodes) {
+                node->restoreParent(this);
+                indexar(node.get());
+                _children.insert(node->getNameId(), node);
+            }
+            _sortedValid = false;
+            _cargado.store(true, std::memory_order_release);
+        }
+
+        // Devuelve true si el contenido del directorio perezoso puede descargarse sin perder nada: no se ha
+        // modificado, no contiene enlaces ni directorios cargados y ningún otro lugar referencia sus nodos
+        bool descargable() const {
+            if (_modificado)
+                return false;
+            bool ok = true;
+            _children.forEach([&ok](const std::shared_ptr<Nodo>& node) {
+                const Directorio* dir = node->kind() == KIND ? static_cast<const Directorio*>(node.get()) : nullptr;
+                ok &= node.use_count() == 1 && node->kind() != TipoNodo::ENLACE && (dir == nullptr || !dir->cargado());
+            });
+            return ok;
+        }
+
+        // Descarta el contenido del directorio perezoso, que podrá volver a cargarse de su respaldo (sólo en una
+        // sección exclusiva, y si es descargable())
+        void descargar() {
+            soltarHijos();
+            _children = IndiceHijos();
+            std::vector<Nodo*>().swap(_sorted);
+            _sortedValid = true;
+            _usado.store(false, std::memory_order_relaxed);
+            _cargado.store(false, std::memory_order_release);
+        }
+
+        // Da de baja del índice de nombres a los nodos del directorio que lo tienen como padre, y deja de serlo
+        void soltarHijos() {
+            _children.forEach([this](const std::shared_ptr<Nodo>& node) {
+                if (node->getParent() == this) {
+                    if (_indice != nullptr)
+                        _indice->baja(node.get());
+                    node->setParent(nullptr);
+                }
+            });
+        }
+
+        // Da de alta en el índice de nombres del directorio (si usa alguno) a <node>, recién añadido a él. Si es un
+        // directorio de otro árbol (o de ninguno), pasa a usar el mismo índice con todo su subárbol
+        void indexar(Nodo* node) {
+            if (_indice == nullptr)
+                return;
+            _indice->alta(node);
+            if (node->kind() == KIND)
+                static_cast<Directorio*>(node)->usarIndice(_indice);
+        }
+
+        // Devuelve el contenido del directorio ordenado por nombre, reconstruyéndolo si ha cambiado
+        const std::vector<Nodo*>& sorted() const {
+            asegurar();
+            if (_sortedValid.load(std::memory_order_acquire))
+                return _sorted;
+            std::lock_guard<std::mutex> lock(_sortedMutex);
+            if (!_sortedValid.load(std::memory_order_relaxed)) {
+                _sorted.clear();
+                _sorted.reserve(_children.size());
+                _children.forEach([this](const std::shared_ptr<Nodo>& node) {
+                    _sorted.push_back(node.get());
+                });
+                std::sort(_sorted.begin(), _sorted.end(), [](const Nodo* a, const Nodo* b) {
+                    return a->getName() < b->getName();
+                });
+                _sortedValid.store(true, std::memory_order_release);
+            }
+            return _sorted;
+        }
     public:
+        static constexpr TipoNodo KIND = TipoNodo::DIRECTORIO;
+
         // Constructor
-        Directorio(const std::string& name) : Nodo(name) {}
+        Directorio(std::string_view name)
+            : Nodo(name, KIND), _size(0), _sortedValid(true), _clave(0), _posCargado(0), _modificado(false),
+              _cargado(true), _usado(false), _indice(nullptr) {}
 
-        // Devuelve el tamaño del directorio, resultado de la suma de todos sus ficheros
-        int getSize() const override {
-            int sz = 0;
-            for (auto i : _children) 
-                sz += i.second->getSize();
-            return sz;
+        // Destructor. Los nodos que sigan vivos (a través de enlaces) dejan de tenerlo como padre
+        ~Directorio() {
+            if (_respaldo != nullptr && cargado())
+                _respaldo->olvidar(*this);
+            soltarHijos();
+        }
+
+        // Suelta todo el contenido del directorio, como al destruirlo, sin actualizar ningún tamaño (para
+        // desechar un directorio que ya no forma parte del árbol sin que retenga a sus nodos). Si era perezoso,
+        // deja de serlo
+        void soltarContenido() {
+            if (_respaldo != nullptr && cargado())
+                _respaldo->olvidar(*this);
+            _respaldo.reset();
+            _cargado = true;
+            soltarHijos();
+            _children = IndiceHijos();
+            std::vector<Nodo*>().swap(_sorted);
+            _sortedValid = true;
+        }
+
+        // Convierte el directorio, vacío, en perezoso: su contenido es el del directorio de clave <clave> en
+        // <respaldo>, y no se carga hasta que se consulte. Su tamaño acumulado debe fijarse con resetSize()
+        void hacerPerezoso(std::shared_ptr<Respaldo> respaldo, const std::uint64_t clave) {
+            _respaldo = std::move(respaldo);
+            _clave = clave;
+            _modificado = false;
+            _cargado = false;
+        }
+
+        // Hace que el directorio y su subárbol (lo que esté cargado) usen el índice de nombres <indice>, dando de
+        // baja a sus nodos del que usaran antes y de alta en él (sólo en una sección exclusiva). Sólo recorre los
+        // directorios que usaban otro índice, así que no cuesta nada si ya usaban <indice>
+        void usarIndice(IndiceNombres* indice) {
+            std::vector<Directorio*> pendientes = {this};
+            while (!pendientes.empty()) {
+                Directorio* dir = pendientes.back();
+                pendientes.pop_back();
+                if (dir->_indice == indice)
+                    continue;
+                IndiceNombres* anterior = dir->_indice;
+                dir->_indice = indice;
+                if (!dir->cargado())
+                    continue;
+                dir->_children.forEach([&](const std::shared_ptr<Nodo>& node) {
+                    if (node->getParent() != dir)
+                        return;
+                    if (anterior != nullptr)
+                        anterior->baja(node.get());
+                    if (indice != nullptr)
+                        indice->alta(node.get());
+                    if (node->kind() == KIND)
+                        pendientes.push_back(static_cast<Directorio*>(node.get()));
+                });
+            }
         }
 
-        // Añade un nodo al directorio
+        // Deja de usar su índice de nombres, sin dar de baja nada (porque el índice va a destruirse con su árbol)
+        void soltarIndice() {
+            _indice = nullptr;
+        }
+
+        // Devuelve el índice de nombres del árbol al que pertenece el directorio (nullptr si no usa ninguno)
+        IndiceNombres* indice() const {
+            return _indice;
+        }
+
+        // Devuelve el respaldo del directorio (nullptr si no es perezoso)
+        const std::shared_ptr<Respaldo>& respaldo() const {
+            return _respaldo;
+        }
+
+        // Devuelve la clave del directorio en su respaldo
+        std::uint64_t clave() const {
+            return _clave;
+        }
+
+        // Devuelve true si el contenido del directorio está en memoria (siempre, si no es perezoso)
+        bool cargado() const {
+            return _cargado.load(std::memory_order_acquire);
+        }
+
+        // Anota que el contenido ha cambiado, para no descargarlo
+        void marcarModificado() override {
+            _modificado = true;
+        }
+
+        // Devuelve el tamaño del directorio, resultado de la suma de todos sus ficheros. El valor se
+        // mantiene actualizado de forma incremental, por lo que no es necesario recorrer el subárbol
+        Tamanyo getSize() const override {
+            return _size;
+        }
+
+        // Fija el tamaño acumulado a <size> sin propagarlo (para reconstruir los tamaños tras recalcularlos)
+        void resetSize(const Tamanyo size) {
+            _size = size;
+        }
+
+        // Suma <delta> al tamaño acumulado, sin propagarlo. Devuelve false si se desborda (el tamaño queda
+        // entonces con el resultado en aritmética modular, para poder deshacer la suma)
+        bool addToSize(const Tamanyo delta) override {
+            return sumarTamanyo(_size, delta) && _size >= 0;
+        }
+
+        // La memoria auxiliar de un directorio incluye su tabla de contenido y su listado ordenado
+        std::size_t memoriaAuxiliar() const override {
+            return Nodo::memoriaAuxiliar() + _children.memoria() + _sorted.capacity() * sizeof(Nodo*);
+        }
+
+        // Añade al directorio los nodos <nodes>, que no deben compartir nombre entre sí ni con ninguno de los
+        // que ya contiene, propagando una sola vez la suma de sus tamaños. Si el tamaño acumulado de algún
+        // directorio se desbordase, el directorio queda como estaba y se lanza size_overflow
+        void addNodes(const std::vector<std::shared_ptr<Nodo>>& nodes) {
+            if (nodes.empty())
+                return;
+            asegurar();
+            _modificado = true;
+            Tamanyo sz = 0;
+            bool ok = true;
+            for (const std::shared_ptr<Nodo>& node : nodes) {
+                node->setParent(this);
+                ok &= sumarTamanyo(sz, node->aggregateSize());
+            }
+            bool propio = ok && addToSize(sz);
+            if (propio && propagateSize(sz)) {
+                _children.reserve(_children.size() + nodes.size());
+                for (const std::shared_ptr<Nodo>& node : nodes) {
+                    indexar(node.get());
+                    _children.insert(node->getNameId(), node);
+                }
+                _sortedValid = false;
+                return;
+            }
+            if (propio)
+                propagateSize(-sz);
+            if (ok)
+                addToSize(-sz);
+            for (const std::shared_ptr<Nodo>& node : nodes)
+                node->setParent(nullptr);
+            throw size_overflow(nodes.front()->getName());
+        }
+
+        // Añade un nodo al directorio (sustituyendo al que tuviese su mismo nombre, si lo hay). Si el tamaño
+        // acumulado de algún directorio se desbordase, el directorio queda como estaba y se lanza size_overflow
         void addNode(std::shared_ptr<Nodo> node) {
-            _children[node->getName()] = node;
+            asegurar();
+            _modificado = true;
+            NombreId id = node->getNameId();
+            std::shared_ptr<Nodo> old;
+            if (const std::shared_ptr<Nodo>* found = _children.find(id)) {
+                old = *found;
+                delNode(old);
+            }
+            node->setParent(this);
+            indexar(node.get());
+            Tamanyo sz = node->aggregateSize();
+            _children.insert(id, node);
+            _sortedValid = false;
+            bool ok = addToSize(sz);
+            if (ok && propagateSize(sz))
+                return;
+            if (ok)
+                propagateSize(-sz);
+            addToSize(-sz);
+            _children.erase(id);
+            if (_indice != nullptr)
+                _indice->baja(node.get());
+            node->setParent(nullptr);
+            if (old != nullptr)
+                addNode(std::move(old));
+            throw size_overflow(node->getName());
+        }
+
+        // Añade un nodo cuyo tamaño ya está incluido en el acumulado del directorio, sin comprobar ciclos
+        // ni propagar nada (para reconstruir un árbol guardado)
+        void loadNode(std::shared_ptr<Nodo> node) {
+            asegurar();
+            node->restoreParent(this);
+            indexar(node.get());
+            NombreId id = node->getNameId();
+            _children.insert(id, std::move(node));
+            _sortedValid = false;
+        }
+
+        // Prepara el directorio para contener <n> nodos
+        void reserve(const std::size_t n) {
+            asegurar();
+            _children.reserve(n);
         }
 
         // Elimina un nodo del directorio
         void delNode(std::shared_ptr<Nodo> node) {
-            _children.erase(node->getName());
+            _modificado = true;
+            Tamanyo sz = node->aggregateSize();
+            _children.erase(node->getNameId());
+            _sortedValid = false;
+            if (_indice != nullptr)
+                _indice->baja(node.get());
+            node->setParent(nullptr);
+            _size -= sz;
+            propagateSize(-sz);
         }
 
         // Busca un nodo en el directorio con nombre <name>. Si lo encuentra devuelve un puntero
         // al nodo, sino devuelve nullptr
-        std::shared_ptr<Nodo> findNode(const std::string& name) {
-            auto it = _children.find(name);
-            if (it != _children.end())
-                return (*it).second;
-            else 
+        std::shared_ptr<Nodo> findNode(std::string_view name) const {
+            asegurar();
+            NombreId id = TablaNombres::global().find(name);
+            if (id == TablaNombres::NINGUNO)
                 return nullptr;
+            const std::shared_ptr<Nodo>* node = _children.find(id);
+            return node != nullptr ? *node : nullptr;
         }
     
-        // Imprime por pantalla, a uno por línea, los nombres de los nodos en el directorio
-        // (si <cmd> lo indica, se imprime también el tamaño del nodo)
-        std::string print(const std::string& cmd) const {
-            std::stringstream ss;
-
-            for (auto i : _children) {
-                ss << i.first; 
-                if (cmd == "du")
-                    ss << ", " << i.second->getSize();
-                ss << std::endl;
+        // Devuelve el número de nodos en el directorio
+        std::size_t numChildren() const {
+            asegurar();
+            return _children.size();
+        }
+
+        // Aplica <f> a cada uno de los nodos del directorio (en orden arbitrario)
+        template <typename F>
+        void forEachChild(F&& f) const {
+            asegurar();
+            _children.forEach(std::forward<F>(f));
+        }
+
+        // Devuelve los nodos del directorio ordenados por nombre
+        const std::vector<Nodo*>& sortedChildren() const {
+            return sorted();
+        }
+
+        // Escribe en <out>, a uno por línea y ordenados, los nombres de los nodos en el directorio que caen en
+        // <pagina> (si <sizes>, seguidos del tamaño de cada nodo, que sólo se consulta para los escritos). Los
+        // nodos se escriben directamente en <out>, sin componer antes el listado completo
+        void print(std::ostream& out, const bool sizes, const Pagina& pagina = {}) const {
+            const std::vector<Nodo*>& nodes = sorted();
+            std::size_t fin = pagina.offset + std::min(pagina.limit, nodes.size() - std::min(pagina.offset, nodes.size()));
+            for (std::size_t i = pagina.offset; i < fin; i++) {
+                out << nodes[i]->getName();
+                if (sizes)
+                    out << ", " << nodes[i]->getSize();
+                out << '\n';
             }
-            return ss.str();
         }
 };
@@ -7,24 +7,89 @@
 
 #pragma once
 
+#include <cstdint>
 #include <memory>
 #include "nodo.h"
 
+// El destino de un enlace no cambia nunca (volver a enlazar un nombre crea un enlace nuevo) y los nodos
+// apuntados no se liberan mientras haya enlaces a ellos, aunque se eliminen del árbol. Por eso las cadenas
+// de enlaces no pueden formar ciclos, y el nodo final de cada enlace se calcula una sola vez, al crearlo,
+// a partir del de su destino: seguir una cadena de cualquier longitud cuesta O(1).
 class Enlace : public Nodo {
     private:
-        std::shared_ptr<Nodo> _ref; // Nodo al que apunta el enlace
+        std::shared_ptr<Nodo> _ref;         // Nodo al que apunta el enlace
+        const std::shared_ptr<Nodo>* _end;  // Nodo final de la cadena (el _ref de su último enlace)
+        std::uint32_t _depth;               // Número de enlaces de la cadena, contando éste
+        bool _cyclic;                       // El enlace apunta a un nodo cuyo tamaño depende del propio enlace
     public:
-        // Constructor
-        Enlace(const std::string& name, std::shared_ptr<Nodo> target)
-            : Nodo(name), _ref(target) {}
+        static constexpr TipoNodo KIND = TipoNodo::ENLACE;
 
-        // Devuelve el tamaño del nodo apuntado por el enlace
-        int getSize() const override {
-            return _ref->getSize();
+        // Constructor. <cyclic> permite restaurar la marca de un enlace guardado, ya calculada
+        Enlace(std::string_view name, std::shared_ptr<Nodo> target, const bool cyclic = false)
+            : Nodo(name, KIND), _ref(target), _end(&_ref), _depth(1), _cyclic(cyclic) {
+            if (_ref->kind() == KIND) {
+                const Enlace& next = static_cast<const Enlace&>(*_ref);
+                _end = next._end;
+                _depth = next._depth + 1;
+            }
+            _ref->addRef(this);
         }
-        
+
+        // Destructor
+        ~Enlace() {
+            _ref->delRef(this);
+        }
+
+        // Devuelve el tamaño del nodo apuntado por el enlace (el del nodo final de la cadena)
+        Tamanyo getSize() const override {
+            return (*_end)->getSize();
+        }
+
+        // Un enlace contribuye al tamaño de su directorio con el del nodo apuntado, salvo que forme un ciclo
+        // (p.ej. un enlace a un directorio antecesor), en cuyo caso no se contabiliza
+        Tamanyo aggregateSize() const override {
+            return _cyclic ? 0 : getSize();
+        }
+
+        // Un enlace cíclico no propaga los cambios de tamaño a su directorio padre, sólo a los enlaces que
+        // lo apuntan
+        Nodo* sizeParent() const override {
+            return _cyclic ? nullptr : _parent;
+        }
+
+        // Al añadir el enlace a un directorio cuyo tamaño acabaría dependiendo del propio enlace, éste
+        // se marca como cíclico. Al sacarlo de su directorio se desmarca, ya que si vuelve a añadirse (p.ej.
+        // al moverlo) puede ser a otro directorio
+        void setParent(Nodo* parent) override {
+            if (parent == nullptr)
+                _cyclic = false;
+            else if (!_cyclic && parent->reaches(this))
+                _cyclic = true;
+            Nodo::setParent(parent);
+        }
+
+        // Devuelve true si el enlace forma un ciclo y no se contabiliza en el tamaño de su directorio
+        bool cyclic() const {
+            return _cyclic;
+        }
+
         // Devuelve un puntero al nodo apuntado por el enlace
-        std::shared_ptr<Nodo> link() {
+        const std::shared_ptr<Nodo>& link() const {
             return _ref;
         }
+
+        // Devuelve el nodo final al que lleva la cadena de enlaces que empieza en éste, que no es un enlace
+        const std::shared_ptr<Nodo>& target() const {
+            return *_end;
+        }
+
+        // Devuelve el número de enlaces que se atraviesan hasta el nodo final, contando éste
+        std::uint32_t depth() const {
+            return _depth;
+        }
+
+        // Devuelve el número de enlaces de la cadena que formaría un enlace nuevo a <target>
+        static std::uint32_t depthTo(const Nodo& target) {
+            return target.kind() == KIND ? static_cast<const Enlace&>(target)._depth + 1 : 1;
+        }
 };
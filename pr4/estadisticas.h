@@ -0,0 +1,196 @@
+//------------------------------------------------------------------------------
+// File:   estadisticas.h
+// Author: Daniel Herce (NIP 848884), Alain Villagrasa (NIP 816787)
+// Date:   Marzo 2023
+// Coms:   Fichero que implementa los contadores e histogramas de latencia de
+//         los comandos y de los eventos internos del árbol de ficheros
+//------------------------------------------------------------------------------
+
+#pragma once
+
+#include <atomic>
+#include <bit>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+
+// Estadísticas de uso de todo el programa: número de llamadas, errores (por clase de error) e histograma
+// de latencias de cada comando, y contadores de eventos internos. Mientras están desactivadas, registrar
+// algo sólo cuesta la consulta de un booleano.
+//
+// Los contadores están repartidos en particiones (una por línea de caché) que cada hilo elige según su
+// identificador, de modo que hilos distintos no compiten por los mismos contadores; las consultas suman
+// todas las particiones.
+//
+// Los histogramas son logarítmicos con 8 subdivisiones lineales por potencia de 2 (como los HDR), por lo
+// que cada percentil se obtiene con un error relativo menor del 12.5% para cualquier latencia.
+class Estadisticas {
+    public:
+        // Eventos internos que se cuentan
+        enum Evento {
+            COMPONENTES,        // Componentes de ruta resueltos
+            ENLACES,            // Enlaces resueltos hasta su nodo final
+            NODOS_RECORRIDOS,   // Nodos visitados al recalcular tamaños o al listar recursivamente
+            NODOS_ACTUALIZADOS, // Tamaños acumulados actualizados al propagar un cambio
+            CARGAS,             // Directorios perezosos cargados de su respaldo
+            DESCARGAS,          // Directorios perezosos descargados para no superar el presupuesto
+            NUM_EVENTOS
+        };
+
+        // Comandos de los que se guardan estadísticas (el último agrupa los desconocidos)
+        static constexpr std::string_view COMANDOS[] = {
+            "pwd", "ls", "du", "mkdir", "vi", "stat", "cd", "ln", "rm", "mv", "save", "load", "find", "snapshot", "rollback",
+            "import", "batch", "memstat", "compact", "mount", "stats", "?"
+        };
+        static constexpr std::size_t NUM_COMANDOS = std::size(COMANDOS);
+    private:
+        static constexpr std::size_t PARTICIONES = 16;
+        static constexpr unsigned SUB = 3;                      // 2^SUB subdivisiones por potencia de 2
+        static constexpr std::size_t CUBETAS = (64 - SUB + 1) << SUB;
+        static constexpr const char* EVENTOS[NUM_EVENTOS] = {
+            "componentes", "enlaces", "nodos_recorridos", "nodos_actualizados", "cargas", "descargas"
+        };
+
+        struct alignas(64) Particion {
+            std::atomic<std::uint64_t> eventos[NUM_EVENTOS] = {};
+            std::atomic<std::uint64_t> cubetas[NUM_COMANDOS][CUBETAS] = {};
+        };
+
+        std::atomic<bool> _activas{false};
+        Particion _particiones[PARTICIONES];
+        std::mutex _mutexErrores;
+        std::map<std::pair<std::size_t, std::string>, std::uint64_t> _errores; // (comando, clase) -> número
+
+        // Devuelve la partición del hilo actual
+        Particion& particion() {
+            thread_local std::size_t i = std::hash<std::thread::id>()(std::this_thread::get_id()) % PARTICIONES;
+            return _particiones[i];
+        }
+
+        // Devuelve la cubeta del histograma en la que cae <ns>
+        static std::size_t cubeta(const std::uint64_t ns) {
+            if (ns < (1u << SUB))
+                return ns;
+            unsigned p = std::bit_width(ns) - 1;
+            return ((p - SUB + 1) << SUB) + ((ns >> (p - SUB)) & ((1u << SUB) - 1));
+        }
+
+        // Devuelve el menor valor que cae en la cubeta <c>
+        static std::uint64_t limite(const std::size_t c) {
+            if (c < (1u << SUB))
+                return c;
+            unsigned p = (c >> SUB) + SUB - 1;
+            return (std::uint64_t(1) << p) + (std::uint64_t(c & ((1u << SUB) - 1)) << (p - SUB));
+        }
+    public:
+        // Devuelve las estadísticas de todo el programa
+        static Estadisticas& global() {
+            static Estadisticas est;
+            return est;
+        }
+
+        // Devuelve true si las estadísticas están activadas
+        bool activas() const {
+            return _activas.load(std::memory_order_relaxed);
+        }
+
+        // Activa o desactiva las estadísticas (las ya recogidas se conservan)
+        void activar(const bool activas) {
+            _activas.store(activas, std::memory_order_relaxed);
+        }
+
+        // Cuenta <n> apariciones del evento <e>, si las estadísticas están activadas
+        void contar(const Evento e, const std::uint64_t n = 1) {
+            if (activas())
+                particion().eventos[e].fetch_add(n, std::memory_order_relaxed);
+        }
+
+        // Devuelve el índice del comando <name> en COMANDOS
+        static std::size_t comando(std::string_view name) {
+            for (std::size_t i = 0; i + 1 < NUM_COMANDOS; i++)
+                if (COMANDOS[i] == name)
+                    return i;
+            return NUM_COMANDOS - 1;
+        }
+
+        // Registra una ejecución del comando <c> que ha durado <ns> nanosegundos
+        void registrar(const std::size_t c, const std::uint64_t ns) {
+            particion().cubetas[c][cubeta(ns)].fetch_add(1, std::memory_order_relaxed);
+        }
+
+        // Registra que una ejecución del comando <c> ha fallado con un error de clase <clase>
+        void error(const std::size_t c, const char* clase) {
+            std::lock_guard<std::mutex> lock(_mutexErrores);
+            _errores[{c, clase}]++;
+        }
+
+        // Pone a cero todas las estadísticas
+        void reset() {
+            for (Particion& p : _particiones) {
+                for (auto& e : p.eventos)
+                    e.store(0, std::memory_order_relaxed);
+                for (auto& h : p.cubetas)
+                    for (auto& c : h)
+                        c.store(0, std::memory_order_relaxed);
+            }
+            std::lock_guard<std::mutex> lock(_mutexErrores);
+            _errores.clear();
+        }
+
+        // Escribe en <out> las estadísticas recogidas, una por línea: para cada comando ejecutado alguna vez,
+        // su número de llamadas, de errores y los percentiles 50, 90, 99 y 99.9 y el máximo de su latencia;
+        // después los errores por comando y clase, y por último los eventos internos
+        void informe(std::ostream& out) {
+            out << "estadisticas " << (activas() ? "activadas" : "desactivadas") << '\n';
+            std::map<std::size_t, std::uint64_t> errores;
+            std::map<std::pair<std::size_t, std::string>, std::uint64_t> clases;
+            {
+                std::lock_guard<std::mutex> lock(_mutexErrores);
+                clases = _errores;
+            }
+            for (const auto& [clave, n] : clases)
+                errores[clave.first] += n;
+
+            out << "comando llamadas errores p50_ns p90_ns p99_ns p999_ns max_ns\n";
+            for (std::size_t c = 0; c < NUM_COMANDOS; c++) {
+                std::uint64_t cubetas[CUBETAS] = {};
+                std::uint64_t total = 0;
+                for (Particion& p : _particiones)
+                    for (std::size_t k = 0; k < CUBETAS; k++)
+                        cubetas[k] += p.cubetas[c][k].load(std::memory_order_relaxed);
+                std::size_t ultima = 0;
+                for (std::size_t k = 0; k < CUBETAS; k++) {
+                    total += cubetas[k];
+                    if (cubetas[k] != 0)
+                        ultima = k;
+                }
+                if (total == 0)
+                    continue;
+                out << COMANDOS[c] << ' ' << total << ' ' << errores[c];
+                for (double q : {0.5, 0.9, 0.99, 0.999}) {
+                    std::uint64_t objetivo = std::uint64_t(q * total), acumulado = 0;
+                    std::size_t k = 0;
+                    while (k < CUBETAS && (acumulado += cubetas[k]) <= objetivo)
+                        k++;
+                    out << ' ' << limite(k);
+                }
+                out << ' ' << limite(ultima) << '\n';
+            }
+
+            for (const auto& [clave, n] : clases)
+                out << "error " << COMANDOS[clave.first] << ' ' << clave.second << ' ' << n << '\n';
+
+            for (std::size_t e = 0; e < NUM_EVENTOS; e++) {
+                std::uint64_t total = 0;
+                for (Particion& p : _particiones)
+                    total += p.eventos[e].load(std::memory_order_relaxed);
+                out << "evento " << EVENTOS[e] << ' ' << total << '\n';
+            }
+        }
+};
@@ -1,30 +1,38 @@
-//------------------------------------------------------------------------------
-// File:   fichero.h
-// Author: Daniel Herce (NIP 848884), Alain Villagrasa (NIP 816787)
-// Date:   Marzo 2023
-// Coms:   Fichero de implementación para la clase Fichero
-//------------------------------------------------------------------------------
-
-#pragma once
-
-#include "nodo.h"
-#include <memory>
-#include <string>
-
-class Fichero : public Nodo {
-    private:
-        int _size;  // Tamaño del fichero
-    public:
-        // Constructor
-        Fichero(const std::string& name, int size = 0) : Nodo(name), _size(size) {}
-
-        //Devuelve el tamaño del fichero
-        virtual int getSize() const override {
-            return _size;
-        }
-
-        // Actualiza el tamaño del fichero con <size>
-        void updateSize(const int size) {
-            _size = size;
-        }
+//------------------------------------------------------------------------------
+// File:   fichero.h
+// Author: Daniel Herce (NIP 848884), Alain Villagrasa (NIP 816787)
+// Date:   Marzo 2023
+// Coms:   Fichero de implementación para la clase Fichero
+//------------------------------------------------------------------------------
+
+#pragma once
+
+#include "nodo.h"
+#include <memory>
+#include <string>
+
+class Fichero final : public Nodo {
+    private:
+        Tamanyo _size;  // Tamaño del fichero
+    public:
+        static constexpr TipoNodo KIND = TipoNodo::FICHERO;
+
+        // Constructor
+        Fichero(std::string_view name, Tamanyo size = 0) : Nodo(name, KIND), _size(size) {}
+
+        //Devuelve el tamaño del fichero
+        virtual Tamanyo getSize() const override {
+            return _size;
+        }
+
+        // Actualiza el tamaño del fichero con <size>, propagando la diferencia a los directorios y
+        // enlaces que dependen de él. Si el tamaño acumulado de alguno se desbordase, no se modifica nada
+        // y se lanza size_overflow. Su directorio pasa a estar modificado
+        void updateSize(const Tamanyo size) {
+            Tamanyo delta = size - _size;
+            propagateChecked(delta);
+            _size = size;
+            if (_parent != nullptr)
+                _parent->marcarModificado();
+        }
 };
\ No newline at end of file
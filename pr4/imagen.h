@@ -0,0 +1,465 @@
+//------------------------------------------------------------------------------
+// File:   imagen.h
+// Author: Daniel Herce (NIP 848884), Alain Villagrasa (NIP 816787)
+// Date:   Marzo 2023
+// Coms:   Fichero que implementa el guardado y la carga del árbol de ficheros
+//         en una imagen binaria compacta
+//------------------------------------------------------------------------------
+
+#pragma once
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "visitar.h"
+#include "arena.h"
+#include "arbol_ficheros_error.h"
+
+// Formato de la imagen (en el orden de bytes de la máquina):
+//
+//   Cabecera
+//   Registro registros[numNodos]     un registro por nodo; el nodo i se referencia por su índice
+//   uint32_t hijos[numHijos]         índices de los nodos de cada directorio, contiguos por directorio
+//   Nombre nombres[numNombres]       posición y longitud de cada nombre distinto en el bloque de texto
+//   char texto[bytesTexto]           nombres concatenados, sin separadores
+//
+// Los enlaces guardan el índice del nodo apuntado, de modo que un nodo apuntado por varios enlaces (o que
+// sólo sigue existiendo porque lo apunta un enlace) se guarda y se restaura una única vez. Los tamaños
+// acumulados de los directorios y la marca de los enlaces cíclicos se guardan ya calculados, para que la
+// carga no tenga que recorrer ni propagar nada.
+namespace imagen {
+    constexpr char MAGICO[8] = {'A', 'R', 'B', 'O', 'L', 'F', 'S', '\0'};
+    constexpr std::uint32_t VERSION = 2;
+    constexpr std::uint8_t CICLICO = 1;    // Marca de enlace cíclico en Registro::flags
+
+    struct Cabecera {
+        char magico[8];
+        std::uint32_t version;
+        std::uint32_t raiz;         // Índice del directorio raíz
+        std::uint32_t numNodos;
+        std::uint32_t numHijos;
+        std::uint32_t numNombres;
+        std::uint32_t reservado;
+        std::uint64_t bytesTexto;
+        std::uint64_t secuencia;    // Última operación del diario incluida en la imagen
+    };
+
+    struct Registro {
+        std::uint8_t kind;          // TipoNodo del nodo
+        std::uint8_t flags;
+        std::uint16_t reservado;
+        std::uint32_t name;         // Índice del nombre en la tabla de nombres
+        std::uint32_t first;        // Directorio: posición de su primer hijo. Enlace: nodo apuntado
+        std::uint32_t count;        // Directorio: número de hijos
+        std::int64_t size;          // Fichero: tamaño. Directorio: tamaño acumulado
+    };
+
+    struct Nombre {
+        std::uint32_t offset;
+        std::uint32_t length;
+    };
+
+    // Descriptor de fichero que se cierra al destruirse
+    class Descriptor {
+        private:
+            int _fd;
+        public:
+            explicit Descriptor(const int fd) : _fd(fd) {}
+            Descriptor(const Descriptor&) = delete;
+            Descriptor& operator=(const Descriptor&) = delete;
+            ~Descriptor() {
+                if (_fd >= 0)
+                    ::close(_fd);
+            }
+            int get() const {
+                return _fd;
+            }
+    };
+
+    // Escribe en <fd> los <bytes> bytes de <datos>. Si falla, lanza snapshot_error
+    inline void escribir(const int fd, const void* datos, std::size_t bytes, const std::string& path) {
+        const char* p = static_cast<const char*>(datos);
+        while (bytes > 0) {
+            ssize_t n = ::write(fd, p, bytes);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0)
+                throw snapshot_error(path, std::strerror(errno));
+            p += n;
+            bytes -= n;
+        }
+    }
+
+    // Sincroniza en disco el directorio que contiene el fichero <path>, para que su creación o su
+    // renombrado sobrevivan a una caída del sistema
+    inline void sincronizarDirectorio(const std::string& path) {
+        std::size_t pos = path.find_last_of('/');
+        std::string dir = pos == std::string::npos ? "." : pos == 0 ? "/" : path.substr(0, pos);
+        Descriptor fd(::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+        if (fd.get() >= 0)
+            ::fsync(fd.get());
+    }
+
+    // Devuelve true si, partiendo de cualquier nodo y aplicando repetidamente <siguiente> (que devuelve
+    // el nodo siguiente o UINT32_MAX si no lo hay), nunca se vuelve a un nodo ya recorrido
+    template <typename F>
+    bool sinCiclos(const std::uint32_t numNodos, F&& siguiente) {
+        // 0: sin visitar, 1: en el recorrido actual, 2: ya comprobado
+        std::vector<std::uint8_t> estado(numNodos, 0);
+        std::vector<std::uint32_t> recorrido;
+        for (std::uint32_t i = 0; i < numNodos; i++) {
+            std::uint32_t n = i;
+            while (n != UINT32_MAX && estado[n] == 0) {
+                estado[n] = 1;
+                recorrido.push_back(n);
+                n = siguiente(n);
+            }
+            if (n != UINT32_MAX && estado[n] == 1)
+                return false;
+            for (std::uint32_t r : recorrido)
+                estado[r] = 2;
+            recorrido.clear();
+        }
+        return true;
+    }
+}
+
+// Guarda en el fichero <path> una imagen de todo el árbol de raíz <root>, incluidos los nodos eliminados
+// que siguen siendo accesibles a través de enlaces, junto con el número <secuencia> de la última operación
+// del diario que refleja (sólo con el árbol bloqueado, al menos para lectura). El contenido de los directorios
+// perezosos sin cargar se lee de su respaldo sin cargarlo (nunca contiene enlaces, ni nodos a los que lleve
+// alguno). La imagen se escribe en un fichero temporal que sustituye a <path> sólo al completarse
+inline void guardarImagen(const Directorio& root, const std::string& path, const std::uint64_t secuencia = 0) {
+    using namespace imagen;
+
+    // Numeración de los nodos en anchura desde la raíz, siguiendo también los enlaces. Las entradas del
+    // contenido sin cargar de los directorios perezosos se numeran como nullptr, y se guardan aparte (junto
+    // con su respaldo), en el mismo orden, hasta tratarlas
+    std::vector<const Nodo*> nodos;
+    std::deque<std::pair<EntradaRespaldo, const Respaldo*>> sinCargar;
+    std::unordered_map<const Nodo*, std::uint32_t> indices;
+    auto indice = [&](const Nodo* node) {
+        auto [it, nuevo] = indices.emplace(node, std::uint32_t(nodos.size()));
+        if (nuevo)
+            nodos.push_back(node);
+        return it->second;
+    };
+    // Numeración de los nombres distintos
+    std::vector<std::string_view> nombres;
+    std::unordered_map<std::string_view, std::uint32_t> locales;
+    auto nombre = [&](std::string_view name) {
+        auto [it, nuevo] = locales.emplace(name, std::uint32_t(nombres.size()));
+        if (nuevo)
+            nombres.push_back(name);
+        return it->second;
+    };
+
+    std::vector<Registro> registros;
+    std::vector<std::uint32_t> hijos;
+    std::vector<EntradaRespaldo> entradas;
+    // Numera el contenido sin cargar del directorio de clave <clave> en <respaldo>
+    auto leerContenido = [&](const Respaldo* respaldo, const std::uint64_t clave) {
+        entradas.clear();
+        respaldo->contenido(clave, entradas);
+        for (const EntradaRespaldo& e : entradas) {
+            hijos.push_back(std::uint32_t(nodos.size()));
+            nodos.push_back(nullptr);
+            sinCargar.emplace_back(e, respaldo);
+        }
+    };
+    std::uint32_t raiz = indice(&root);
+    for (std::size_t i = 0; i < nodos.size(); i++) {
+        const Nodo* node = nodos[i];
+        Registro r = {};
+        if (node == nullptr) {
+            auto [e, respaldo] = sinCargar.front();
+            sinCargar.pop_front();
+            r.kind = std::uint8_t(e.kind);
+            r.name = nombre(e.name);
+            r.size = e.size;
+            if (e.kind == TipoNodo::DIRECTORIO) {
+                r.first = hijos.size();
+                leerContenido(respaldo, e.clave);
+                r.count = hijos.size() - r.first;
+            }
+            registros.push_back(r);
+            continue;
+        }
+        r.kind = std::uint8_t(node->kind());
+        r.name = nombre(node->getName());
+        if (const Directorio* dir = nodeCast<Directorio>(node)) {
+            r.first = hijos.size();
+            if (dir->cargado()) {
+                dir->forEachChild([&](const std::shared_ptr<Nodo>& child) {
+                    hijos.push_back(indice(child.get()));
+                });
+            } else {
+                leerContenido(dir->respaldo().get(), dir->clave());
+            }
+            r.count = hijos.size() - r.first;
+            r.size = dir->getSize();
+        } else if (const Enlace* enlace = nodeCast<Enlace>(node)) {
+            r.first = indice(enlace->link().get());
+            r.flags = enlace->cyclic() ? CICLICO : 0;
+        } else {
+            r.size = node->getSize();
+        }
+        registros.push_back(r);
+    }
+
+    std::vector<Nombre> tabla;
+    std::string texto;
+    tabla.reserve(nombres.size());
+    for (std::string_view s : nombres) {
+        tabla.push_back({std::uint32_t(texto.size()), std::uint32_t(s.size())});
+        texto += s;
+    }
+
+    Cabecera cab = {};
+    std::memcpy(cab.magico, MAGICO, sizeof(MAGICO));
+    cab.version = VERSION;
+    cab.raiz = raiz;
+    cab.numNodos = registros.size();
+    cab.numHijos = hijos.size();
+    cab.numNombres = tabla.size();
+    cab.bytesTexto = texto.size();
+    cab.secuencia = secuencia;
+
+    std::string temporal = path + ".tmp";
+    {
+        Descriptor fd(::open(temporal.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+        if (fd.get() < 0)
+            throw snapshot_error(path, std::strerror(errno));
+        try {
+            escribir(fd.get(), &cab, sizeof(cab), path);
+            escribir(fd.get(), registros.data(), registros.size() * sizeof(Registro), path);
+            escribir(fd.get(), hijos.data(), hijos.size() * sizeof(std::uint32_t), path);
+            escribir(fd.get(), tabla.data(), tabla.size() * sizeof(Nombre), path);
+            escribir(fd.get(), texto.data(), texto.size(), path);
+            if (::fsync(fd.get()) != 0)
+                throw snapshot_error(path, std::strerror(errno));
+        } catch (...) {
+            ::unlink(temporal.c_str());
+            throw;
+        }
+    }
+    if (::rename(temporal.c_str(), path.c_str()) != 0) {
+        int error = errno;
+        ::unlink(temporal.c_str());
+        throw snapshot_error(path, std::strerror(error));
+    }
+    sincronizarDirectorio(path);
+}
+
+namespace imagen {
+    // Imagen proyectada en memoria y ya comprobada, con el directorio que contiene a cada nodo
+    struct Vista {
+        std::unique_ptr<void, std::function<void(void*)>> proyeccion;
+        Cabecera cab;
+        const Registro* registros;
+        const std::uint32_t* hijos;
+        const Nombre* tabla;
+        const char* texto;
+        std::vector<std::uint32_t> padres;  // UINT32_MAX para la raíz y los nodos que no están en ningún directorio
+
+        // Devuelve el nombre del nodo <i>
+        std::string_view nombre(const std::uint32_t i) const {
+            const Nombre& n = tabla[registros[i].name];
+            return std::string_view(texto + n.offset, n.length);
+        }
+    };
+
+    // Proyecta en memoria la imagen guardada en el fichero <path> y la comprueba por completo. Si no es una
+    // imagen válida, lanza snapshot_error
+    inline Vista abrir(const std::string& path) {
+        Vista v;
+        Descriptor fd(::open(path.c_str(), O_RDONLY | O_CLOEXEC));
+        struct stat st;
+        if (fd.get() < 0 || ::fstat(fd.get(), &st) != 0)
+            throw snapshot_error(path, std::strerror(errno));
+        std::uint64_t bytes = st.st_size;
+        if (bytes < sizeof(Cabecera))
+            throw snapshot_error(path, "not a snapshot file");
+        void* mem = ::mmap(nullptr, bytes, PROT_READ, MAP_PRIVATE, fd.get(), 0);
+        if (mem == MAP_FAILED)
+            throw snapshot_error(path, std::strerror(errno));
+        v.proyeccion = std::unique_ptr<void, std::function<void(void*)>>(mem, [bytes](void* p) {
+            ::munmap(p, bytes);
+        });
+        ::madvise(mem, bytes, MADV_WILLNEED);
+
+        // Secciones de la imagen
+        const char* datos = static_cast<const char*>(mem);
+        Cabecera& cab = v.cab;
+        std::memcpy(&cab, datos, sizeof(cab));
+        if (std::memcmp(cab.magico, MAGICO, sizeof(MAGICO)) != 0)
+            throw snapshot_error(path, "not a snapshot file");
+        if (cab.version != VERSION)
+            throw snapshot_error(path, "unsupported version " + std::to_string(cab.version));
+        std::uint64_t esperados = sizeof(Cabecera) + std::uint64_t(cab.numNodos) * sizeof(Registro)
+            + std::uint64_t(cab.numHijos) * sizeof(std::uint32_t) + std::uint64_t(cab.numNombres) * sizeof(Nombre);
+        if (cab.bytesTexto > bytes || esperados + cab.bytesTexto != bytes)
+            throw snapshot_error(path, "truncated or corrupt file");
+        const Registro* registros = v.registros = reinterpret_cast<const Registro*>(datos + sizeof(Cabecera));
+        const std::uint32_t* hijos = v.hijos = reinterpret_cast<const std::uint32_t*>(registros + cab.numNodos);
+        const Nombre* tabla = v.tabla = reinterpret_cast<const Nombre*>(hijos + cab.numHijos);
+        v.texto = reinterpret_cast<const char*>(tabla + cab.numNombres);
+
+        // Comprobación de la imagen: índices dentro de rango, cada nodo en un único directorio y una sola vez,
+        // nombres distintos, no vacíos y sin '/' dentro de cada directorio (los que el árbol puede resolver), sin
+        // ciclos de directorios ni cadenas de enlaces cíclicas. Primero se comprueba cada registro por separado,
+        // y sólo después, con todos ya comprobados, el contenido de los directorios, que consulta los de sus hijos
+        auto corrupta = [&path] {
+            return snapshot_error(path, "corrupt file");
+        };
+        // Cada nombre de la tabla se identifica con el primero de igual texto, para que dos entradas repetidas no
+        // permitan dos nodos del mismo nombre en un directorio
+        std::vector<bool> accesibles(cab.numNombres);
+        std::vector<std::uint32_t> canonicos(cab.numNombres);
+        std::unordered_map<std::string_view, std::uint32_t> primeros;
+        for (std::uint32_t i = 0; i < cab.numNombres; i++) {
+            if (std::uint64_t(tabla[i].offset) + tabla[i].length > cab.bytesTexto)
+                throw corrupta();
+            std::string_view name(v.texto + tabla[i].offset, tabla[i].length);
+            accesibles[i] = !name.empty() && name.find('/') == std::string_view::npos;
+            canonicos[i] = primeros.emplace(name, i).first->second;
+        }
+        primeros = {};
+        if (cab.raiz >= cab.numNodos)
+            throw corrupta();
+        for (std::uint32_t i = 0; i < cab.numNodos; i++) {
+            const Registro& r = registros[i];
+            if (r.name >= cab.numNombres)
+                throw corrupta();
+            switch (TipoNodo(r.kind)) {
+                case TipoNodo::FICHERO:
+                    if (r.size < 0)
+                        throw corrupta();
+                    break;
+                case TipoNodo::ENLACE:
+                    if (r.first >= cab.numNodos)
+                        throw corrupta();
+                    break;
+                case TipoNodo::DIRECTORIO:
+                    if (std::uint64_t(r.first) + r.count > cab.numHijos || r.size < 0)
+                        throw corrupta();
+                    break;
+                default:
+                    throw corrupta();
+            }
+        }
+        if (registros[cab.raiz].kind != std::uint8_t(TipoNodo::DIRECTORIO))
+            throw corrupta();
+        std::vector<std::uint32_t>& padres = v.padres;
+        padres.assign(cab.numNodos, UINT32_MAX);
+        std::vector<std::uint32_t> marcas(cab.numNombres, UINT32_MAX);
+        for (std::uint32_t i = 0; i < cab.numNodos; i++) {
+            const Registro& r = registros[i];
+            if (r.kind != std::uint8_t(TipoNodo::DIRECTORIO))
+                continue;
+            for (std::uint32_t k = r.first; k < r.first + r.count; k++) {
+                std::uint32_t h = hijos[k];
+                if (h >= cab.numNodos || h == cab.raiz || padres[h] != UINT32_MAX)
+                    throw corrupta();
+                padres[h] = i;
+                std::uint32_t name = canonicos[registros[h].name];
+                if (!accesibles[name] || marcas[name] == i)
+                    throw corrupta();
+                marcas[name] = i;
+            }
+        }
+        if (!sinCiclos(cab.numNodos, [&](const std::uint32_t n) { return padres[n]; }))
+            throw corrupta();
+        if (!sinCiclos(cab.numNodos, [&](const std::uint32_t n) {
+                return registros[n].kind == std::uint8_t(TipoNodo::ENLACE) ? registros[n].first : UINT32_MAX;
+            }))
+            throw corrupta();
+        return v;
+    }
+}
+
+// Sustituye el contenido del directorio raíz <root> por el de la imagen guardada en el fichero <path>,
+// reservando los nuevos nodos de <arena> (sólo en una sección exclusiva). Los nodos que contenía la raíz se
+// dejan en <viejos>. Devuelve el número de secuencia guardado en la imagen.
+//
+// El fichero se proyecta en memoria y se comprueba por completo antes de modificar el árbol, de modo que
+// si no es una imagen válida se lanza snapshot_error y el árbol queda intacto. El directorio raíz se
+// conserva (sólo se sustituye su contenido), por lo que las sesiones situadas en él siguen siendo válidas
+inline std::uint64_t cargarImagen(const std::shared_ptr<Directorio>& root, Arena& arena, const std::string& path,
+                                  std::vector<std::shared_ptr<Nodo>>& viejos) {
+    using namespace imagen;
+    Vista v = abrir(path);
+    const Cabecera& cab = v.cab;
+    const Registro* registros = v.registros;
+    const std::uint32_t* hijos = v.hijos;
+    v.padres = {};
+
+    // A partir de aquí la imagen es válida: se vacía la raíz y se reconstruye el árbol
+    std::size_t primero = viejos.size();
+    root->forEachChild([&](const std::shared_ptr<Nodo>& child) {
+        viejos.push_back(child);
+    });
+    for (std::size_t i = primero; i < viejos.size(); i++)
+        root->delNode(viejos[i]);
+
+    std::vector<std::string_view> nombres(cab.numNombres);
+    for (std::uint32_t i = 0; i < cab.numNombres; i++)
+        nombres[i] = std::string_view(v.texto + v.tabla[i].offset, v.tabla[i].length);
+    std::vector<std::shared_ptr<Nodo>> nodos(cab.numNodos);
+    nodos[cab.raiz] = root;
+
+    // Ficheros y directorios, con sus tamaños ya calculados
+    for (std::uint32_t i = 0; i < cab.numNodos; i++) {
+        const Registro& r = registros[i];
+        if (i == cab.raiz) {
+            continue;
+        } else if (r.kind == std::uint8_t(TipoNodo::FICHERO)) {
+            nodos[i] = arena.crear<Fichero>(nombres[r.name], r.size);
+        } else if (r.kind == std::uint8_t(TipoNodo::DIRECTORIO)) {
+            std::shared_ptr<Directorio> dir = arena.crear<Directorio>(nombres[r.name]);
+            dir->resetSize(r.size);
+            dir->reserve(r.count);
+            nodos[i] = std::move(dir);
+        }
+    }
+
+    // Enlaces, creando antes que cada enlace el enlace al que apunta (si es el caso)
+    std::vector<std::uint32_t> cadena;
+    for (std::uint32_t i = 0; i < cab.numNodos; i++) {
+        for (std::uint32_t n = i; nodos[n] == nullptr; n = registros[n].first)
+            cadena.push_back(n);
+        for (auto it = cadena.rbegin(); it != cadena.rend(); ++it) {
+            const Registro& r = registros[*it];
+            nodos[*it] = arena.crear<Enlace>(nombres[r.name], nodos[r.first], (r.flags & CICLICO) != 0);
+        }
+        cadena.clear();
+    }
+
+    // Contenido de los directorios. Los tamaños ya son los definitivos salvo en la raíz, cuyo contenido se
+    // añade de la forma habitual para que el cambio llegue a los enlaces que la apunten
+    for (std::uint32_t i = 0; i < cab.numNodos; i++) {
+        const Registro& r = registros[i];
+        if (i == cab.raiz || r.kind != std::uint8_t(TipoNodo::DIRECTORIO))
+            continue;
+        Directorio& dir = static_cast<Directorio&>(*nodos[i]);
+        for (std::uint32_t k = r.first; k < r.first + r.count; k++)
+            dir.loadNode(nodos[hijos[k]]);
+    }
+    const Registro& r = registros[cab.raiz];
+    root->reserve(r.count);
+    for (std::uint32_t k = r.first; k < r.first + r.count; k++)
+        root->addNode(nodos[hijos[k]]);
+    return cab.secuencia;
+}
@@ -0,0 +1,503 @@
+//------------------------------------------------------------------------------
+// File:   importar.h
+// Author: Daniel Herce (NIP 848884), Alain Villagrasa (NIP 816787)
+// Date:   Marzo 2023
+// Coms:   Fichero que implementa la importación masiva de nodos al árbol de
+//         ficheros desde un manifiesto o desde un directorio real
+//------------------------------------------------------------------------------
+
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <charconv>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "arena.h"
+#include "paralelo.h"
+#include "ruta.h"
+#include "sistema_ficheros.h"
+
+// Nodo a crear al importar, en la ruta <ruta> (relativa al directorio en el que se importa)
+struct Entrada {
+    TipoNodo tipo;
+    std::string_view ruta;
+    Tamanyo size = 0;           // Tamaño (ficheros)
+    std::string_view destino;   // Ruta del nodo apuntado (enlaces), relativa al directorio del enlace (sin
+                                // subir por encima del directorio en el que se importa) o, si empieza por
+                                // '/', a la raíz del árbol. Vacía si no puede resolverse
+};
+
+// Entradas leídas para una importación, junto con la memoria en la que residen sus cadenas
+struct Lectura {
+    std::vector<Entrada> entradas;
+    std::vector<std::shared_ptr<void>> memoria;
+};
+
+// Número de nodos importados de cada tipo, y de enlaces que no se han podido crear: porque su destino no
+// existe, es relativo y sube por encima del directorio en el que se importa o, al importar un directorio
+// real, apunta fuera de él; o porque su nombre ya estaba ocupado
+struct Importacion {
+    std::size_t ficheros = 0;
+    std::size_t directorios = 0;
+    std::size_t enlaces = 0;
+    std::size_t omitidos = 0;
+};
+
+namespace importar {
+    // Aplica <f>(t, ini, fin) en paralelo a cada uno de los <trozos> tramos consecutivos en que se divide
+    // 0..<n>-1. Si <f> lanza alguna excepción, se relanza la primera cuando han terminado todos los tramos
+    template <typename F>
+    void porTrozos(const std::size_t n, const std::size_t trozos, F&& f) {
+        Tareas& tareas = Tareas::global();
+        Grupo grupo;
+        for (std::size_t t = 0; t < trozos; t++)
+            tareas.lanzar(grupo, [&f, t, ini = n * t / trozos, fin = n * (t + 1) / trozos] {
+                f(t, ini, fin);
+            });
+        tareas.esperar(grupo);
+    }
+
+    // Devuelve el número de trozos en que repartir <n> elementos, de al menos <minimo> cada uno
+    inline std::size_t trozos(const std::size_t n, const std::size_t minimo) {
+        return std::max<std::size_t>(1, std::min(Tareas::global().hilos() * 4, n / minimo));
+    }
+
+    // Devuelve el siguiente campo (separado por blancos) de <linea> y lo elimina de ella
+    inline std::string_view campo(std::string_view& linea) {
+        constexpr std::string_view BLANCOS = " \t\r";
+        std::size_t ini = std::min(linea.find_first_not_of(BLANCOS), linea.size());
+        std::size_t fin = std::min(linea.find_first_of(BLANCOS, ini), linea.size());
+        std::string_view c = linea.substr(ini, fin - ini);
+        linea.remove_prefix(fin);
+        return c;
+    }
+
+    // Devuelve true si <ruta> es una ruta relativa válida: nombres no vacíos separados por '/', ninguno de
+    // ellos "." ni ".."
+    inline bool rutaValida(std::string_view ruta) {
+        if (ruta.empty())
+            return false;
+        while (true) {
+            std::size_t sep = ruta.find('/');
+            std::string_view nombre = ruta.substr(0, sep);
+            if (nombre.empty() || nombre == "." || nombre == "..")
+                return false;
+            if (sep == std::string_view::npos)
+                return true;
+            ruta.remove_prefix(sep + 1);
+        }
+    }
+
+    // Devuelve el número de nombres de la ruta relativa <ruta> ("" tiene 0)
+    inline std::size_t niveles(std::string_view ruta) {
+        return ruta.empty() ? 0 : std::count(ruta.begin(), ruta.end(), '/') + 1;
+    }
+
+    // Devuelve true si el destino relativo <destino> de un enlace del directorio <dir> (ruta relativa al
+    // directorio en el que se importa, "" para él mismo) sube por encima del directorio en el que se importa
+    inline bool saleDeImportado(std::string_view dir, std::string_view destino) {
+        std::size_t nivel = niveles(dir);
+        while (!destino.empty()) {
+            std::size_t sep = destino.find('/');
+            std::string_view nombre = destino.substr(0, sep);
+            if (nombre == "..") {
+                if (nivel == 0)
+                    return true;
+                nivel--;
+            } else if (!nombre.empty() && nombre != ".") {
+                nivel++;
+            }
+            destino.remove_prefix(sep == std::string_view::npos ? destino.size() : sep + 1);
+        }
+        return false;
+    }
+
+    // Interpreta la línea <linea> de un manifiesto. Devuelve false si no describe ningún nodo (vacía o
+    // comentario); si no es válida, deja en <error> el motivo
+    inline bool interpretar(std::string_view linea, Entrada& e, std::string& error) {
+        std::string_view tipo = campo(linea);
+        if (tipo.empty() || tipo.front() == '#')
+            return false;
+        e = Entrada{TipoNodo::FICHERO, campo(linea)};
+        std::string_view extra = campo(linea);
+        if (!rutaValida(e.ruta))
+            error = "invalid path '" + std::string(e.ruta) + "'";
+        else if (!campo(linea).empty())
+            error = "too many fields";
+        else if (tipo == "d" && extra.empty())
+            e.tipo = TipoNodo::DIRECTORIO;
+        else if (tipo == "l" && !extra.empty())
+            e = Entrada{TipoNodo::ENLACE, e.ruta, 0, extra};
+        else if (tipo == "f") {
+            auto [fin, ec] = std::from_chars(extra.data(), extra.data() + extra.size(), e.size);
+            if (ec != std::errc() || fin != extra.data() + extra.size() || extra.empty() || e.size < 0)
+                error = "invalid size '" + std::string(extra) + "'";
+        } else
+            error = "invalid entry";
+        return true;
+    }
+
+    // Listado de un directorio real: las entradas y las cadenas a las que apuntan
+    struct Listado {
+        std::deque<std::string> textos;
+        std::vector<Entrada> entradas;
+    };
+}
+
+// Lee las entradas del manifiesto <path>, que se proyecta en memoria y se interpreta en paralelo por trozos.
+// Cada línea describe un nodo (las vacías y las que empiezan por '#' se ignoran):
+//     d <ruta>             directorio
+//     f <ruta> <tamaño>    fichero
+//     l <ruta> <destino>   enlace
+// Las rutas son relativas al directorio en el que se importa; los directorios intermedios que no aparezcan
+// se crean igualmente. Si alguna línea no es válida, lanza import_error indicando la primera
+inline Lectura leerManifiesto(const std::string& path) {
+    using namespace importar;
+    Lectura lectura;
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || ::fstat(fd, &st) != 0) {
+        int error = errno;
+        if (fd >= 0)
+            ::close(fd);
+        throw import_error(path, std::strerror(error));
+    }
+    std::size_t bytes = st.st_size;
+    void* mem = bytes > 0 ? ::mmap(nullptr, bytes, PROT_READ, MAP_PRIVATE, fd, 0) : nullptr;
+    int error = errno;
+    ::close(fd);
+    if (mem == MAP_FAILED)
+        throw import_error(path, std::strerror(error));
+    if (bytes == 0)
+        return lectura;
+    lectura.memoria.emplace_back(mem, [bytes](void* p) {
+        ::munmap(p, bytes);
+    });
+    ::madvise(mem, bytes, MADV_SEQUENTIAL | MADV_WILLNEED);
+    std::string_view datos(static_cast<const char*>(mem), bytes);
+
+    // Cada trozo empieza tras el primer salto de línea a partir de su parte proporcional del fichero
+    struct Trozo {
+        std::vector<Entrada> entradas;
+        std::size_t lineas = 0;
+        std::size_t lineaError = 0;     // Línea (dentro del trozo, desde 1) del primer error, o 0
+        std::string error;
+    };
+    std::size_t n = trozos(bytes, 1 << 16);
+    std::vector<std::size_t> inicios(n + 1, bytes);
+    inicios[0] = 0;
+    for (std::size_t t = 1; t < n; t++) {
+        std::size_t pos = datos.find('\n', bytes * t / n);
+        inicios[t] = std::max(inicios[t - 1], pos == std::string_view::npos ? bytes : pos + 1);
+    }
+    std::vector<Trozo> resultados(n);
+    porTrozos(n, n, [&](const std::size_t t, std::size_t, std::size_t) {
+        Trozo& r = resultados[t];
+        std::string_view resto = datos.substr(inicios[t], inicios[t + 1] - inicios[t]);
+        r.entradas.reserve(resto.size() / 32);
+        while (!resto.empty() && r.lineaError == 0) {
+            std::size_t fin = resto.find('\n');
+            std::string_view linea = resto.substr(0, fin);
+            resto.remove_prefix(fin == std::string_view::npos ? resto.size() : fin + 1);
+            r.lineas++;
+            Entrada e;
+            if (interpretar(linea, e, r.error))
+                r.entradas.push_back(e);
+            if (!r.error.empty())
+                r.lineaError = r.lineas;
+        }
+    });
+
+    std::size_t lineas = 0, total = 0;
+    for (const Trozo& r : resultados) {
+        if (r.lineaError != 0)
+            throw import_error(path, "line " + std::to_string(lineas + r.lineaError) + ": " + r.error);
+        lineas += r.lineas;
+        total += r.entradas.size();
+    }
+    lectura.entradas.reserve(total);
+    for (const Trozo& r : resultados)
+        lectura.entradas.insert(lectura.entradas.end(), r.entradas.begin(), r.entradas.end());
+    return lectura;
+}
+
+// Lee como entradas el contenido del directorio real <path>, recorriendo en paralelo sus subdirectorios (cada
+// uno en una tarea). Los ficheros regulares conservan su tamaño y los enlaces simbólicos su destino; los
+// destinos absolutos dentro de <path> se traducen a rutas relativas al directorio del enlace (así que no
+// dependen del directorio en el que se importe), y los que quedan fuera de <path> no se resuelven. Se ignoran
+// los demás tipos de fichero. Si algún directorio no puede leerse, lanza import_error
+inline Lectura leerDirectorio(const std::string& path) {
+    using namespace importar;
+    // Los destinos absolutos se comparan con la ruta canónica del directorio
+    std::unique_ptr<char, decltype(&std::free)> canonica(::realpath(path.c_str(), nullptr), &std::free);
+    if (canonica == nullptr)
+        throw import_error(path, std::strerror(errno));
+    std::string raiz = canonica.get();
+    if (raiz.back() != '/')
+        raiz += '/';
+    std::mutex mutex;                       // Protege listados y error
+    std::vector<std::shared_ptr<Listado>> listados;
+    std::string error;
+    Tareas& tareas = Tareas::global();
+    Grupo grupo;
+
+    // Lista el directorio de ruta relativa <rel> ("" para la raíz) y lanza una tarea por subdirectorio
+    std::function<void(std::string)> listar = [&](std::string rel) {
+        std::string host = raiz + rel;
+        auto cerrar = [](DIR* d) {::closedir(d);};
+        std::unique_ptr<DIR, decltype(cerrar)> dir(::opendir(host.c_str()), cerrar);
+        DIR* d = dir.get();
+        if (d == nullptr) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (error.empty())
+                error = host + ": " + std::strerror(errno);
+            return;
+        }
+        auto listado = std::make_shared<Listado>();
+        while (dirent* ent = ::readdir(d)) {
+            std::string_view nombre = ent->d_name;
+            if (nombre == "." || nombre == "..")
+                continue;
+            struct stat st;
+            if (::fstatat(::dirfd(d), ent->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+                continue;
+            std::string& ruta = listado->textos.emplace_back(rel.empty() ? std::string(nombre) : rel + "/" + std::string(nombre));
+            if (S_ISDIR(st.st_mode)) {
+                listado->entradas.push_back({TipoNodo::DIRECTORIO, ruta});
+                tareas.lanzar(grupo, [&listar, ruta] {
+                    listar(ruta);
+                });
+            } else if (S_ISREG(st.st_mode)) {
+                listado->entradas.push_back({TipoNodo::FICHERO, ruta, Tamanyo(st.st_size)});
+            } else if (S_ISLNK(st.st_mode)) {
+                std::string destino(st.st_size > 0 ? st.st_size + 1 : 4096, '\0');
+                ssize_t len = ::readlinkat(::dirfd(d), ent->d_name, destino.data(), destino.size());
+                destino.resize(len < 0 ? 0 : len);
+                if (!destino.empty() && destino.front() == '/') {
+                    // Sólo se traducen los destinos absolutos dentro del directorio importado (o el propio
+                    // directorio): se sube desde el del enlace hasta él y se baja hasta el destino
+                    if (destino.compare(0, raiz.size(), raiz) == 0 || destino + '/' == raiz) {
+                        std::string relativo = ".";
+                        for (std::size_t k = niveles(rel); k > 0; k--)
+                            relativo += "/..";
+                        if (destino.size() > raiz.size())
+                            relativo += "/" + destino.substr(raiz.size());
+                        destino = std::move(relativo);
+                    } else {
+                        destino.clear();
+                    }
+                }
+                listado->entradas.push_back({TipoNodo::ENLACE, ruta, 0, listado->textos.emplace_back(std::move(destino))});
+            }
+        }
+        dir.reset();
+        std::lock_guard<std::mutex> lock(mutex);
+        listados.push_back(std::move(listado));
+    };
+    tareas.lanzar(grupo, [&listar] {
+        listar("");
+    });
+    tareas.esperar(grupo);
+    if (!error.empty())
+        throw import_error(path, error);
+
+    Lectura lectura;
+    for (std::shared_ptr<Listado>& listado : listados) {
+        lectura.entradas.insert(lectura.entradas.end(), listado->entradas.begin(), listado->entradas.end());
+        lectura.memoria.push_back(std::move(listado));
+    }
+    return lectura;
+}
+
+// Importa en el directorio activo de <activo> los nodos de <entradas> (sólo en una sección exclusiva sobre
+// <fs>). Los nuevos subárboles se construyen aparte, sin propagar tamaños:
+//   1. Se crean los directorios (y los intermedios que falten), buscando cada uno por su ruta en una tabla.
+//   2. Se crean los ficheros en paralelo, agrupados por directorio para que cada directorio lo rellene una
+//      sola tarea, y cada tarea con su propia arena (que después adopta <fs>).
+//   3. Se calculan en paralelo los tamaños acumulados de los nuevos directorios.
+//   4. Se injertan en el directorio activo los nodos de primer nivel, propagando una vez el tamaño de cada uno.
+//   5. Se crean los enlaces, resolviendo sus destinos en el árbol ya completo (en varias pasadas, por si el
+//      destino de un enlace es otro enlace importado después).
+// Si algo falla antes de injertar (p.ej. dos entradas con la misma ruta, o un nodo de primer nivel con el
+// nombre de uno ya existente), lanza import_error y el árbol queda intacto. <origen> identifica la
+// importación en los errores
+inline Importacion importarEntradas(SistemaFicheros& fs, const Camino& activo, const std::vector<Entrada>& entradas,
+                                    const std::string& origen) {
+    using namespace importar;
+    Importacion res;
+    std::vector<std::unique_ptr<Arena>> arenas;     // Deben sobrevivir a raiz
+    std::shared_ptr<Directorio> raiz = fs.arena().crear<Directorio>("");
+
+    // 1. Directorios, numerados en orden de creación (0 es raiz)
+    std::vector<Directorio*> dirs = {raiz.get()};
+    std::unordered_map<std::string_view, std::uint32_t> indices = {{std::string_view(), 0}};
+    auto directorio = [&](std::string_view ruta) -> std::uint32_t {
+        // Se sube hasta el antecesor más cercano que ya exista y se crean desde él los que falten
+        std::vector<std::string_view> faltan;
+        auto it = indices.find(ruta);
+        while (it == indices.end()) {
+            faltan.push_back(ruta);
+            std::size_t sep = ruta.rfind('/');
+            ruta = sep == std::string_view::npos ? std::string_view() : ruta.substr(0, sep);
+            it = indices.find(ruta);
+        }
+        std::uint32_t i = it->second;
+        for (auto f = faltan.rbegin(); f != faltan.rend(); ++f) {
+            std::shared_ptr<Directorio> dir = fs.arena().crear<Directorio>(f->substr(f->rfind('/') + 1));
+            dirs[i]->loadNode(dir);
+            i = dirs.size();
+            dirs.push_back(dir.get());
+            indices.emplace(*f, i);
+        }
+        return i;
+    };
+    std::vector<std::uint32_t> padres(entradas.size());
+    std::string_view ultimo;
+    std::uint32_t ultimoIndice = 0;
+    for (std::size_t k = 0; k < entradas.size(); k++) {
+        const Entrada& e = entradas[k];
+        if (e.tipo == TipoNodo::DIRECTORIO) {
+            directorio(e.ruta);
+            continue;
+        }
+        std::size_t sep = e.ruta.rfind('/');
+        std::string_view padre = sep == std::string_view::npos ? std::string_view() : e.ruta.substr(0, sep);
+        if (padre != ultimo || k == 0) {
+            ultimo = padre;
+            ultimoIndice = directorio(padre);
+        }
+        padres[k] = ultimoIndice;
+    }
+    res.directorios = dirs.size() - 1;
+
+    // 2. Ficheros: se ordenan por directorio y se reparten tramos de directorios entre las tareas
+    std::vector<std::size_t> inicio(dirs.size() + 1, 0);
+    for (std::size_t k = 0; k < entradas.size(); k++)
+        if (entradas[k].tipo == TipoNodo::FICHERO)
+            inicio[padres[k] + 1]++;
+    for (std::size_t d = 0; d < dirs.size(); d++)
+        inicio[d + 1] += inicio[d];
+    res.ficheros = inicio.back();
+    std::vector<std::size_t> orden(res.ficheros);
+    {
+        std::vector<std::size_t> pos(inicio.begin(), inicio.end() - 1);
+        for (std::size_t k = 0; k < entradas.size(); k++)
+            if (entradas[k].tipo == TipoNodo::FICHERO)
+                orden[pos[padres[k]]++] = k;
+    }
+    std::size_t n = trozos(res.ficheros, 1 << 12);
+    for (std::size_t t = 0; t < n; t++)
+        arenas.push_back(std::make_unique<Arena>());
+    std::mutex mutex;
+    std::string error;
+    porTrozos(res.ficheros, n, [&](const std::size_t t, const std::size_t ini, const std::size_t fin) {
+        // Cada tarea rellena los directorios cuyo primer fichero cae en su tramo
+        std::size_t d = std::upper_bound(inicio.begin(), inicio.end(), ini) - inicio.begin() - 1;
+        if (ini > inicio[d])
+            d++;
+        for (; d < dirs.size() && inicio[d] < fin; d++) {
+            Directorio* dir = dirs[d];
+            dir->reserve(dir->numChildren() + inicio[d + 1] - inicio[d]);
+            for (std::size_t i = inicio[d]; i < inicio[d + 1]; i++) {
+                const Entrada& e = entradas[orden[i]];
+                std::string_view nombre = e.ruta.substr(e.ruta.rfind('/') + 1);
+                if (dir->findNode(nombre) != nullptr) {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (error.empty())
+                        error = "duplicate path '" + std::string(e.ruta) + "'";
+                    return;
+                }
+                dir->loadNode(arenas[t]->crear<Fichero>(nombre, e.size));
+            }
+        }
+    });
+    fs.adoptarArenas(std::move(arenas));
+    if (!error.empty())
+        throw import_error(origen, error);
+
+    // 3. Tamaños acumulados
+    try {
+        calcularTamanyo(*raiz, true);
+    } catch (const size_overflow&) {
+        throw import_error(origen, "total size too large");
+    }
+
+    // 4. Injerto en el directorio activo
+    const std::shared_ptr<Directorio>& cwd = activo.back().dir;
+    std::vector<std::shared_ptr<Nodo>> nuevos;
+    raiz->forEachChild([&](const std::shared_ptr<Nodo>& node) {
+        nuevos.push_back(node);
+    });
+    for (const std::shared_ptr<Nodo>& node : nuevos)
+        if (cwd->findNode(node->getName()) != nullptr)
+            throw import_error(origen, "'" + node->getName() + "' already exists");
+    std::size_t injertados = 0;
+    try {
+        for (; injertados < nuevos.size(); injertados++) {
+            raiz->delNode(nuevos[injertados]);
+            cwd->addNode(nuevos[injertados]);
+        }
+    } catch (const size_overflow&) {
+        for (std::size_t k = 0; k < injertados; k++)
+            cwd->delNode(nuevos[k]);
+        throw;
+    }
+    for (std::shared_ptr<Nodo>& node : nuevos)
+        fs.anotar({cwd, nullptr, std::move(node)});
+
+    // 5. Enlaces
+    std::vector<std::size_t> pendientes;
+    for (std::size_t k = 0; k < entradas.size(); k++)
+        if (entradas[k].tipo == TipoNodo::ENLACE)
+            pendientes.push_back(k);
+    bool progreso = true;
+    while (!pendientes.empty() && progreso) {
+        progreso = false;
+        std::vector<std::size_t> siguen;
+        for (std::size_t k : pendientes) {
+            const Entrada& e = entradas[k];
+            std::size_t sep = e.ruta.rfind('/');
+            std::string_view nombre = e.ruta.substr(sep + 1);
+            try {
+                std::string_view dir = sep == std::string_view::npos ? std::string_view() : e.ruta.substr(0, sep);
+                Camino camino = dir.empty() ? activo : resolveDir(activo, dir);
+                if (e.destino.empty() || camino.back().dir->findNode(nombre) != nullptr
+                    || (e.destino.front() != '/' && saleDeImportado(dir, e.destino))) {
+                    res.omitidos++;
+                    continue;
+                }
+                std::shared_ptr<Nodo> destino = resolve(camino, e.destino).nodo;
+                if (Enlace::depthTo(*destino) > fs.maxEnlaces()) {
+                    res.omitidos++;
+                    continue;
+                }
+                std::shared_ptr<Nodo> enlace = fs.arena().crear<Enlace>(nombre, destino);
+                camino.back().dir->addNode(enlace);
+                fs.anotar({camino.back().dir, nullptr, std::move(enlace)});
+                res.enlaces++;
+                progreso = true;
+            } catch (const elem_not_found&) {
+                siguen.push_back(k);
+            } catch (const arbol_ficheros_error&) {
+                res.omitidos++;
+            }
+        }
+        pendientes = std::move(siguen);
+    }
+    res.omitidos += pendientes.size();
+    return res;
+}
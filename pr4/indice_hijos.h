@@ -0,0 +1,115 @@
+//------------------------------------------------------------------------------
+// File:   indice_hijos.h
+// Author: Daniel Herce (NIP 848884), Alain Villagrasa (NIP 816787)
+// Date:   Marzo 2023
+// Coms:   Fichero que implementa el índice de nodos de un directorio, una
+//         tabla hash de direccionamiento abierto indexada por nombre internado
+//------------------------------------------------------------------------------
+
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+#include "nombres.h"
+
+class Nodo;
+
+class IndiceHijos {
+    private:
+        struct Entrada {
+            NombreId id = TablaNombres::NINGUNO;    // Nombre del nodo (NINGUNO si la entrada está libre)
+            std::shared_ptr<Nodo> nodo;             // Nodo almacenado
+        };
+
+        std::vector<Entrada> _slots; // Entradas de la tabla (su número es siempre potencia de 2)
+        std::size_t _count;          // Número de entradas ocupadas
+
+        // Devuelve la posición inicial de búsqueda de <id> (hash de Fibonacci)
+        std::size_t home(const NombreId id) const {
+            return (id * 0x9E3779B97F4A7C15ull) >> 32 & (_slots.size() - 1);
+        }
+
+        // Devuelve la posición de <id> en la tabla, o la de la entrada libre donde debería insertarse
+        std::size_t probe(const NombreId id) const {
+            std::size_t i = home(id);
+            while (_slots[i].id != TablaNombres::NINGUNO && _slots[i].id != id)
+                i = (i + 1) & (_slots.size() - 1);
+            return i;
+        }
+
+        // Redimensiona la tabla a <capacity> entradas, reinsertando las ocupadas
+        void rehash(const std::size_t capacity) {
+            std::vector<Entrada> old(capacity);
+            old.swap(_slots);
+            for (Entrada& e : old)
+                if (e.id != TablaNombres::NINGUNO)
+                    _slots[probe(e.id)] = std::move(e);
+        }
+    public:
+        // Constructor
+        IndiceHijos() : _slots(8), _count(0) {}
+
+        // Devuelve el número de nodos en el índice
+        std::size_t size() const {
+            return _count;
+        }
+
+        // Devuelve los bytes que ocupan las entradas de la tabla
+        std::size_t memoria() const {
+            return _slots.capacity() * sizeof(Entrada);
+        }
+
+        // Prepara la tabla para contener <n> nodos sin tener que redimensionarse
+        void reserve(const std::size_t n) {
+            std::size_t capacity = _slots.size();
+            while (n * 4 > capacity * 3)
+                capacity *= 2;
+            if (capacity != _slots.size())
+                rehash(capacity);
+        }
+
+        // Devuelve el nodo de nombre <id>, o nullptr si no está
+        const std::shared_ptr<Nodo>* find(const NombreId id) const {
+            const Entrada& e = _slots[probe(id)];
+            return e.id == id ? &e.nodo : nullptr;
+        }
+
+        // Añade (o sustituye) el nodo <nodo> de nombre <id>
+        void insert(const NombreId id, std::shared_ptr<Nodo> nodo) {
+            if ((_count + 1) * 4 > _slots.size() * 3)
+                rehash(_slots.size() * 2);
+            Entrada& e = _slots[probe(id)];
+            if (e.id == TablaNombres::NINGUNO)
+                _count++;
+            e.id = id;
+            e.nodo = std::move(nodo);
+        }
+
+        // Elimina el nodo de nombre <id>, desplazando hacia atrás las entradas de su misma secuencia de
+        // sondeo para no dejar marcas de borrado. Devuelve false si no estaba
+        bool erase(const NombreId id) {
+            const std::size_t mask = _slots.size() - 1;
+            std::size_t i = probe(id);
+            if (_slots[i].id != id)
+                return false;
+            for (std::size_t j = (i + 1) & mask; _slots[j].id != TablaNombres::NINGUNO; j = (j + 1) & mask) {
+                // La entrada j puede ocupar el hueco i si éste está entre su posición inicial y j
+                if (((j - home(_slots[j].id)) & mask) >= ((j - i) & mask)) {
+                    _slots[i] = std::move(_slots[j]);
+                    i = j;
+                }
+            }
+            _slots[i] = Entrada();
+            _count--;
+            return true;
+        }
+
+        // Aplica <f> a cada uno de los nodos del índice (en orden arbitrario)
+        template <typename F>
+        void forEach(F&& f) const {
+            for (const Entrada& e : _slots)
+                if (e.id != TablaNombres::NINGUNO)
+                    f(e.nodo);
+        }
+};
@@ -0,0 +1,115 @@
+//------------------------------------------------------------------------------
+// File:   indice_nombres.h
+// Author: Daniel Herce (NIP 848884), Alain Villagrasa (NIP 816787)
+// Date:   Marzo 2023
+// Coms:   Fichero que implementa el índice de nodos por nombre de un árbol,
+//         que permite buscar nodos en todo el árbol sin recorrerlo
+//------------------------------------------------------------------------------
+
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+#include <shared_mutex>
+#include <vector>
+#include "nombres.h"
+#include "nodo.h"
+
+// Índice invertido de los nodos contenidos en algún directorio de un árbol, agrupados por su nombre
+// internado. Los directorios del árbol lo mantienen al añadir y eliminar nodos; cada nodo guarda su posición
+// en la lista de su nombre, por lo que ambas operaciones cuestan O(1).
+//
+// Un nodo contenido en un directorio que ya no forma parte del árbol (p.ej. tras eliminar un antecesor)
+// sigue en el índice: las búsquedas comprueban, subiendo por sus directorios, que el nodo sigue en el
+// árbol. Así eliminar un directorio no obliga a recorrer su subárbol.
+//
+// Cada árbol (SistemaFicheros) tiene su propio índice, así que sólo contiene sus nodos y se usa con el
+// cerrojo de su árbol; los directorios que no pertenecen a ningún árbol (p.ej. los que se construyen aparte
+// para importarlos) no usan ninguno. Puede usarse desde varios hilos a la vez (los directorios perezosos se
+// cargan consultando el árbol): cada partición (por identificador de nombre) tiene su propio cerrojo.
+class IndiceNombres {
+    private:
+        static constexpr std::size_t PARTICIONES = 64;
+
+        struct Particion {
+            std::shared_mutex mutex;
+            std::vector<std::vector<Nodo*>> nodos;  // Nodos del nombre con identificador i*PARTICIONES+p
+        };
+
+        Particion _particiones[PARTICIONES];
+    public:
+        // Añade <node> al índice (si no estaba)
+        void alta(Nodo* node) {
+            Particion& p = _particiones[node->_name % PARTICIONES];
+            std::size_t i = node->_name / PARTICIONES;
+            std::lock_guard<std::shared_mutex> lock(p.mutex);
+            if (node->_posIndice != TablaNombres::NINGUNO)
+                return;
+            if (p.nodos.size() <= i)
+                p.nodos.resize(i + 1);
+            node->_posIndice = p.nodos[i].size();
+            p.nodos[i].push_back(node);
+        }
+
+        // Elimina <node> del índice (si estaba), ocupando su hueco con el último nodo de su mismo nombre
+        void baja(Nodo* node) {
+            Particion& p = _particiones[node->_name % PARTICIONES];
+            std::lock_guard<std::shared_mutex> lock(p.mutex);
+            if (node->_posIndice == TablaNombres::NINGUNO)
+                return;
+            std::vector<Nodo*>& lista = p.nodos[node->_name / PARTICIONES];
+            Nodo* ultimo = lista.back();
+            lista[node->_posIndice] = ultimo;
+            ultimo->_posIndice = node->_posIndice;
+            lista.pop_back();
+            node->_posIndice = TablaNombres::NINGUNO;
+        }
+
+        // Devuelve los bytes que ocupan las listas del índice
+        std::size_t memoria() {
+            std::size_t bytes = 0;
+            for (Particion& p : _particiones) {
+                std::shared_lock<std::shared_mutex> lock(p.mutex);
+                bytes += p.nodos.capacity() * sizeof(std::vector<Nodo*>);
+                for (const std::vector<Nodo*>& lista : p.nodos)
+                    bytes += lista.capacity() * sizeof(Nodo*);
+            }
+            return bytes;
+        }
+
+        // Reduce cada lista del índice a la memoria que necesitan sus nodos actuales
+        void ajustar() {
+            for (Particion& p : _particiones) {
+                std::lock_guard<std::shared_mutex> lock(p.mutex);
+                while (!p.nodos.empty() && p.nodos.back().empty())
+                    p.nodos.pop_back();
+                for (std::vector<Nodo*>& lista : p.nodos)
+                    lista.shrink_to_fit();
+                p.nodos.shrink_to_fit();
+            }
+        }
+
+        // Aplica <f> al identificador de cada nombre con algún nodo en el índice (en orden arbitrario). <f> no
+        // debe modificar el índice
+        template <typename F>
+        void forEachNombre(F&& f) {
+            for (std::size_t k = 0; k < PARTICIONES; k++) {
+                Particion& p = _particiones[k];
+                std::shared_lock<std::shared_mutex> lock(p.mutex);
+                for (std::size_t i = 0; i < p.nodos.size(); i++)
+                    if (!p.nodos[i].empty())
+                        f(NombreId(i * PARTICIONES + k));
+            }
+        }
+
+        // Aplica <f> a cada uno de los nodos de nombre <id> (en orden arbitrario). <f> no debe modificar el índice
+        template <typename F>
+        void forEach(const NombreId id, F&& f) {
+            Particion& p = _particiones[id % PARTICIONES];
+            std::shared_lock<std::shared_mutex> lock(p.mutex);
+            std::size_t i = id / PARTICIONES;
+            if (i < p.nodos.size())
+                for (Nodo* node : p.nodos[i])
+                    f(node);
+        }
+};
@@ -0,0 +1,136 @@
+//------------------------------------------------------------------------------
+// File:   lotes.h
+// Author: Daniel Herce (NIP 848884), Alain Villagrasa (NIP 816787)
+// Date:   Marzo 2023
+// Coms:   Fichero que implementa la ejecución no interactiva (por lotes) de
+//         un guion de comandos sobre una Shell
+//------------------------------------------------------------------------------
+
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <ostream>
+#include <streambuf>
+#include <string_view>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "comandos.h"
+
+// Búfer de salida sobre un descriptor de fichero que sólo escribe cuando se llena (o al sincronizarse),
+// de modo que la salida se vuelca en bloques grandes
+class SalidaFd : public std::streambuf {
+    private:
+        int _fd;                // Descriptor de destino
+        std::vector<char> _buf; // Búfer de escritura
+
+        // Escribe en el descriptor el contenido pendiente del búfer
+        bool volcar() {
+            const char* p = pbase();
+            while (p < pptr()) {
+                ssize_t n = ::write(_fd, p, pptr() - p);
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n < 0)
+                    return false;
+                p += n;
+            }
+            setp(_buf.data(), _buf.data() + _buf.size());
+            return true;
+        }
+    protected:
+        int_type overflow(int_type c) override {
+            if (!volcar())
+                return traits_type::eof();
+            if (!traits_type::eq_int_type(c, traits_type::eof()))
+                sputc(traits_type::to_char_type(c));
+            return traits_type::not_eof(c);
+        }
+
+        int sync() override {
+            return volcar() ? 0 : -1;
+        }
+    public:
+        // Constructor
+        SalidaFd(const int fd, const std::size_t capacity = 1 << 20) : _fd(fd), _buf(capacity) {
+            setp(_buf.data(), _buf.data() + _buf.size());
+        }
+
+        // Destructor
+        ~SalidaFd() {
+            volcar();
+        }
+};
+
+// Aplica <f> a cada una de las líneas leídas de <fd> (sin el salto de línea) hasta que <f> devuelva
+// false. Si <fd> es un fichero regular se proyecta en memoria; si no, se lee por bloques
+template <typename F>
+void forEachLine(const int fd, F&& f) {
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void* mem = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mem != MAP_FAILED) {
+            madvise(mem, st.st_size, MADV_SEQUENTIAL);
+            std::string_view datos(static_cast<const char*>(mem), st.st_size);
+            while (!datos.empty()) {
+                std::size_t fin = datos.find('\n');
+                if (!f(datos.substr(0, fin)))
+                    break;
+                datos = fin == std::string_view::npos ? std::string_view() : datos.substr(fin + 1);
+            }
+            munmap(mem, st.st_size);
+            return;
+        }
+    }
+
+    constexpr std::size_t BLOQUE = 1 << 20;
+    std::vector<char> buf(BLOQUE);
+    std::size_t usados = 0; // Bytes de buf ocupados por una línea todavía incompleta
+    for (;;) {
+        if (usados == buf.size())
+            buf.resize(buf.size() * 2);
+        ssize_t n = ::read(fd, buf.data() + usados, buf.size() - usados);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        std::string_view datos(buf.data(), usados + n);
+        std::size_t fin;
+        while ((fin = datos.find('\n')) != std::string_view::npos) {
+            if (!f(datos.substr(0, fin)))
+                return;
+            datos.remove_prefix(fin + 1);
+        }
+        usados = datos.size();
+        std::copy(datos.begin(), datos.end(), buf.begin());
+    }
+    if (usados > 0)
+        f(std::string_view(buf.data(), usados));
+}
+
+// Ejecuta sobre <sh> los comandos leídos de <fd>, uno por línea, sin mostrar el indicador de la ruta
+// activa. La salida se escribe en <out> y los errores en <err>, precedidos del número de línea
+inline void procesarLote(Shell& sh, const int fd, std::ostream& out, std::ostream& err) {
+    std::vector<std::string_view> cmd;
+    unsigned long linea = 0;
+    char prefijo[32] = "linea ";
+    BloqueLote bloque;
+    forEachLine(fd, [&](std::string_view line) {
+        linea++;
+        if (bloque.acumular(line))
+            return true;
+        tokenize(line, cmd);
+        if (cmd.empty())
+            return true;
+        char* fin = std::to_chars(prefijo + 6, prefijo + sizeof(prefijo) - 2, linea).ptr;
+        *fin++ = ':';
+        *fin++ = ' ';
+        return ejecutar(sh, cmd, out, err, std::string_view(prefijo, fin - prefijo));
+    });
+    if (bloque.abierto())
+        err << "linea " << linea << ": Error sintactico: bloque batch sin cerrar" << '\n';
+}
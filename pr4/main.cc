@@ -1,16 +1,91 @@
+#include <chrono>
+#include <cstdlib>
 #include <iostream>
 #include <string>
+#include <string_view>
 #include <vector>
-#include <sstream>
+#include <unistd.h>
 
 #include "shell.h"
+#include "comandos.h"
+#include "lotes.h"
+#include "recuperacion.h"
+#include "servidor.h"
 
 using namespace std;
 
-int main()
+int main(int argc, char* argv[])
 {
 	Shell sh;
 
+	// Modo por lotes: con la opcion -b, o si la entrada no es un terminal (salvo con -i)
+	bool lote = !isatty(STDIN_FILENO);
+	const char* imagen = nullptr;	// Imagen guardada con save de la que arrancar
+	const char* diario = nullptr;	// Diario de operaciones del que recuperarse y en el que registrar
+	int intervalo = 0;				// Intervalo de sincronizacion del diario, en milisegundos
+	const char* servir = nullptr;	// Socket en el que servir el arbol (modo servidor)
+	const char* confinar = nullptr;	// Directorio al que se confinan los ficheros de los clientes del servidor
+	for (int i = 1; i < argc; i++)
+	{
+		string_view opt = argv[i];
+		if (opt == "-b")
+			lote = true;
+		else if (opt == "-i")
+			lote = false;
+		else if (opt == "-e")
+			Estadisticas::global().activar(true);
+		else if (opt == "-l" && i + 1 < argc)
+			imagen = argv[++i];
+		else if (opt == "-d" && i + 1 < argc)
+			diario = argv[++i];
+		else if (opt == "-s" && i + 1 < argc)
+			servir = argv[++i];
+		else if (opt == "-r" && i + 1 < argc)
+			confinar = argv[++i];
+		else if (opt == "-f" && i + 1 < argc && (intervalo = atoi(argv[++i])) >= 0)
+			continue;
+		else if (opt == "-m" && i + 1 < argc && atoi(argv[i + 1]) > 0)
+			sh.fs()->setMaxEnlaces(atoi(argv[++i]));
+		else
+		{
+			cerr << "Uso: " << argv[0] << " [-b | -i | -s socket [-r dir]] [-e] [-m enlaces] [-l imagen] [-d diario [-f ms]]" << endl;
+			return 1;
+		}
+	}
+
+	try
+	{
+		if (diario != nullptr)
+			abrirDiario(sh, diario, chrono::milliseconds(intervalo));
+		if (imagen != nullptr)
+			sh.load(imagen);
+
+		// Modo servidor: el socket es la ruta de un socket Unix o un puerto TCP de localhost. Los clientes
+		// sólo pueden usar ficheros del directorio dado con -r (si no, ninguno)
+		if (servir != nullptr)
+		{
+			Servidor servidor(sh.fs(), servir,
+							  confinar != nullptr ? AccesoHost::confinado(confinar) : AccesoHost::prohibido());
+			servidor.servir();
+			return 0;
+		}
+	}
+	catch (const arbol_ficheros_error& e)
+	{
+		cerr << e.what() << endl;
+		return 1;
+	}
+
+	if (lote)
+	{
+		SalidaFd buf(STDOUT_FILENO);
+		ostream out(&buf);
+		procesarLote(sh, STDIN_FILENO, out, cerr);
+		return 0;
+	}
+
+	vector<string_view> cmd;
+	BloqueLote bloque;
 	for (bool done=false; !done; )
 	{
 		cout << sh.pwd() << "> " << flush;
@@ -25,71 +100,18 @@ int main()
 		if (line.empty())
 			continue;
 
+		// Acumular las lineas de un bloque batch hasta que se cierre
+		string_view linea = line;
+		if (bloque.acumular(linea))
+			continue;
+
 		// Separar tokens
-		vector<string> cmd;
-		istringstream iss(line);
-		for (string tok; iss >> tok; )
-			cmd.push_back(tok);
+		tokenize(linea, cmd);
 
 		if (cmd.empty())
 			continue;
 
-		try
-		{
-			if ((cmd[0]=="exit") || (cmd[0]=="by"))
-			{
-				done = true;
-			}
-			else if (cmd[0]=="pwd")
-			{
-				cout << sh.pwd() << endl;
-			}
-			else if (cmd[0]=="ls")
-			{
-				cout << sh.ls();
-			}
-			else if (cmd[0]=="du")
-			{
-				cout << sh.du();
-			}
-			else if (cmd[0]=="mkdir")
-			{
-				sh.mkdir(cmd.at(1));
-			}
-			else if (cmd[0]=="vi")
-			{
-				sh.vi(cmd.at(1),stoi(cmd.at(2)));
-			}
-			else if (cmd[0]=="stat")
-			{
-				cout << sh.stat(cmd.at(1)) << endl;
-			}
-			else if (cmd[0]=="cd")
-			{
-				sh.cd(cmd.at(1));
-			}
-			else if (cmd[0]=="ln")
-			{
-				sh.ln(cmd.at(1),cmd.at(2));
-			}
-			else if (cmd[0]=="rm")
-			{
-				sh.rm(cmd.at(1));
-			}
-			else
-			{
-				cerr << "Error sintactico: comando desconocido" << endl;
-			}
-		}
-		catch (const arbol_ficheros_error& e)
-		{
-			cerr << e.what() << endl;
-		}
-		catch (const out_of_range& e)
-		{
-			cerr << "Error sintactico: parametros insuficientes" << endl;
-			cerr << e.what() << endl;
-		}
+		done = !ejecutar(sh, cmd, cout, cerr);
 	}
 	cout << endl << "By!!" << endl;
 
@@ -0,0 +1,212 @@
+//------------------------------------------------------------------------------
+// File:   memoria.h
+// Author: Daniel Herce (NIP 848884), Alain Villagrasa (NIP 816787)
+// Date:   Marzo 2023
+// Coms:   Fichero que implementa la medida de la memoria que ocupan los nodos
+//         de un árbol de ficheros y la copia de sus nodos a memoria contigua
+//------------------------------------------------------------------------------
+
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "visitar.h"
+#include "arena.h"
+#include "indice_nombres.h"
+
+// Memoria que ocupa un grupo de nodos
+struct UsoMemoria {
+    std::size_t nodos = 0;
+    std::size_t bytes = 0;
+};
+
+// Estado de la carga de los directorios perezosos de un árbol montado
+struct CargaPerezosa {
+    std::size_t directorios = 0;    // Directorios perezosos cargados
+    std::size_t bytes = 0;          // Bytes estimados de su contenido cargado
+    std::size_t presupuesto = 0;    // Bytes de contenido cargado a partir de los que se descargan directorios
+};
+
+// Informe de la memoria que ocupa un árbol de ficheros
+struct InformeMemoria {
+    UsoMemoria tipos[3];            // Nodos del árbol, por tipo (en el orden de TipoNodo)
+    UsoMemoria huerfanos;           // Nodos eliminados del árbol que siguen vivos por enlaces alcanzables desde él
+    std::size_t subarboles = 0;     // Subárboles eliminados (o nodos sueltos) a los que pertenecen los huérfanos
+    UsoMemoria retenidos;           // Resto de nodos eliminados que siguen vivos: los que guardan los estados
+                                    // marcados y los retirados pendientes de liberar
+    std::size_t nombres = 0;        // Nombres internados
+    std::size_t nombresUsados = 0;  // De ellos, los que usa alguno de los nodos anteriores
+    std::size_t bytesNombres = 0;   // Tabla de nombres internados
+    std::size_t bytesIndice = 0;    // Índice de nodos por nombre del árbol
+    std::size_t reservados = 0;     // Bytes reservados por las arenas del árbol
+    std::size_t enUso = 0;          // De ellos, los ocupados por nodos vivos
+    bool montado = false;           // El árbol se ha montado desde un respaldo
+    CargaPerezosa perezosos;        // Directorios perezosos cargados (si está montado)
+};
+
+// Resultado de la compactación de un árbol
+struct Compactacion {
+    std::size_t nodos = 0;          // Nodos copiados
+    std::size_t antes = 0;          // Bytes reservados por las arenas antes de compactar
+    std::size_t despues = 0;        // Bytes reservados después (incluidas las arenas antiguas que aún conserve
+                                    // alguna sesión)
+    std::size_t nombres = 0;        // Nombres internados que ya no usaba nadie y se han quitado de la tabla
+};
+
+namespace memoria {
+    // Devuelve los bytes que ocupa <node>: su objeto en la arena y su memoria auxiliar
+    inline std::size_t bytesNodo(const Nodo& node) {
+        std::size_t bytes = node.memoriaAuxiliar();
+        switch (node.kind()) {
+            case TipoNodo::FICHERO:
+                return bytes + Arena::bytesCrear<Fichero>();
+            case TipoNodo::DIRECTORIO:
+                return bytes + Arena::bytesCrear<Directorio>();
+            case TipoNodo::ENLACE:
+                return bytes + Arena::bytesCrear<Enlace>();
+        }
+        return bytes;
+    }
+
+    // Aplica <f> a <inicio> y a cada nodo alcanzable desde él a través del contenido de los directorios que
+    // no esté en <vistos>, y los añade a <vistos>. Deja en <enlaces> los enlaces encontrados. El contenido
+    // de los directorios perezosos que no están cargados no se carga
+    template <typename F>
+    void recorrer(const Nodo* inicio, std::unordered_set<const Nodo*>& vistos, std::vector<const Enlace*>& enlaces,
+                  F&& f) {
+        if (!vistos.insert(inicio).second)
+            return;
+        std::vector<const Nodo*> pendientes = {inicio};
+        while (!pendientes.empty()) {
+            const Nodo* node = pendientes.back();
+            pendientes.pop_back();
+            f(*node);
+            const Directorio* dir = nodeCast<Directorio>(node);
+            if (dir != nullptr && dir->cargado()) {
+                dir->forEachChild([&](const std::shared_ptr<Nodo>& child) {
+                    if (vistos.insert(child.get()).second)
+                        pendientes.push_back(child.get());
+                });
+            } else if (const Enlace* enlace = nodeCast<Enlace>(node)) {
+                enlaces.push_back(enlace);
+            }
+        }
+    }
+}
+
+// Mide la memoria que ocupan los nodos del árbol de raíz <root>, los que siguen vivos fuera de él por los
+// enlaces alcanzables desde él y los que se conservan fuera de él desde <retenidos> (con el árbol
+// bloqueado en modo exclusivo, ya que los listados ordenados de los directorios se reconstruyen al leer)
+inline InformeMemoria medirMemoria(const Directorio& root, const std::vector<const Nodo*>& retenidos) {
+    using namespace memoria;
+    InformeMemoria inf;
+    TablaNombres& tabla = TablaNombres::global();
+    inf.nombres = tabla.size();
+    std::vector<bool> usados(tabla.limite());
+    std::unordered_set<const Nodo*> vistos;
+    std::vector<const Enlace*> enlaces;
+    auto contar = [&](UsoMemoria& uso, const Nodo& node) {
+        uso.nodos++;
+        uso.bytes += bytesNodo(node);
+        if (!usados[node.getNameId()]) {
+            usados[node.getNameId()] = true;
+            inf.nombresUsados++;
+        }
+    };
+    auto huerfano = [&](const Nodo& node) {
+        contar(inf.huerfanos, node);
+    };
+    auto retenido = [&](const Nodo& node) {
+        contar(inf.retenidos, node);
+    };
+
+    // Árbol, y subárboles eliminados a los que se llega siguiendo enlaces (desde el árbol o desde otros
+    // subárboles así alcanzados)
+    recorrer(&root, vistos, enlaces, [&](const Nodo& node) {
+        contar(inf.tipos[std::size_t(node.kind())], node);
+    });
+    for (std::size_t i = 0; i < enlaces.size(); i++) {
+        const Nodo* destino = enlaces[i]->link().get();
+        if (vistos.count(destino) == 0) {
+            inf.subarboles++;
+            recorrer(destino, vistos, enlaces, huerfano);
+        }
+    }
+
+    // Nodos conservados por otros motivos, y lo que alcanzan sus enlaces
+    enlaces.clear();
+    for (const Nodo* node : retenidos)
+        recorrer(node, vistos, enlaces, retenido);
+    for (std::size_t i = 0; i < enlaces.size(); i++)
+        recorrer(enlaces[i]->link().get(), vistos, enlaces, retenido);
+
+    inf.bytesNombres = tabla.memoria();
+    return inf;
+}
+
+// Copia en <arena> el árbol de raíz <root> y los nodos de fuera de él que se conservan desde <otros>, con
+// todo lo que alcanzan sus enlaces, y devuelve la copia de la raíz (sólo en una sección exclusiva). Deja en
+// <copias> la copia de cada nodo y en <viejos> los nodos copiados, en el orden en que se han copiado.
+//
+// Los nodos se copian por directorios, de modo que el contenido de cada uno queda contiguo en la arena. Los
+// tamaños acumulados y las marcas de ciclo de los enlaces se copian tal cual, sin recalcularlos. Los
+// directorios perezosos sin cargar se copian sin cargarlos, como perezosos; los cargados se copian con su
+// contenido y como directorios normales
+inline std::shared_ptr<Directorio> copiarNodos(const std::shared_ptr<Directorio>& root,
+                                               const std::vector<std::shared_ptr<Nodo>>& otros, Arena& arena,
+                                               std::unordered_map<const Nodo*, std::shared_ptr<Nodo>>& copias,
+                                               std::vector<std::shared_ptr<Nodo>>& viejos) {
+    std::vector<const Directorio*> pendientes;  // Directorios copiados cuyo contenido falta por copiar
+
+    // Copia <node> si no se había copiado ya, y antes que un enlace, el nodo al que apunta
+    auto copiar = [&](auto& self, const std::shared_ptr<Nodo>& node) -> const std::shared_ptr<Nodo>& {
+        auto it = copias.find(node.get());
+        if (it != copias.end())
+            return it->second;
+        std::shared_ptr<Nodo> copia;
+        if (const Enlace* enlace = nodeCast<Enlace>(node.get())) {
+            const std::shared_ptr<Nodo>& destino = self(self, enlace->link());
+            copia = arena.crear<Enlace>(node->getName(), destino, enlace->cyclic());
+        } else if (const Directorio* dir = nodeCast<Directorio>(node.get())) {
+            std::shared_ptr<Directorio> nuevo = arena.crear<Directorio>(node->getName());
+            nuevo->resetSize(dir->getSize());
+            if (dir->cargado())
+                pendientes.push_back(dir);
+            else
+                nuevo->hacerPerezoso(dir->respaldo(), dir->clave());
+            copia = std::move(nuevo);
+        } else {
+            copia = arena.crear<Fichero>(node->getName(), node->getSize());
+        }
+        viejos.push_back(node);
+        return copias.emplace(node.get(), std::move(copia)).first->second;
+    };
+
+    // Copia el contenido de los directorios pendientes (y el de los que se copien mientras tanto)
+    std::size_t siguiente = 0;
+    std::vector<std::shared_ptr<Nodo>> contenido;
+    auto vaciar = [&] {
+        while (siguiente < pendientes.size()) {
+            const Directorio* dir = pendientes[siguiente++];
+            Directorio& nuevo = static_cast<Directorio&>(*copias.at(dir));
+            contenido.clear();
+            dir->forEachChild([&](const std::shared_ptr<Nodo>& child) {
+                contenido.push_back(copiar(copiar, child));
+            });
+            nuevo.reserve(contenido.size());
+            for (std::shared_ptr<Nodo>& child : contenido)
+                nuevo.loadNode(std::move(child));
+        }
+    };
+
+    std::shared_ptr<Directorio> nuevaRaiz = std::static_pointer_cast<Directorio>(copiar(copiar, root));
+    vaciar();
+    for (const std::shared_ptr<Nodo>& node : otros) {
+        copiar(copiar, node);
+        vaciar();
+    }
+    return nuevaRaiz;
+}
@@ -7,18 +7,218 @@
 
 #pragma once
 
+#include <cstdint>
 #include <string>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <algorithm>
+#include "nombres.h"
+#include "estadisticas.h"
+#include "arbol_ficheros_error.h"
+
+// Tamaño de un nodo, en bytes
+using Tamanyo = std::int64_t;
+
+// Suma <b> a <a> en aritmética modular (por lo que restar <b> después restaura <a> exactamente). Devuelve
+// false si el resultado exacto no cabe en un Tamanyo
+inline bool sumarTamanyo(Tamanyo& a, const Tamanyo b) {
+    return !__builtin_add_overflow(a, b, &a);
+}
+
+// Tipo concreto de un nodo
+enum class TipoNodo : std::uint8_t {
+    FICHERO,
+    DIRECTORIO,
+    ENLACE
+};
+
+class IndiceNombres;
 
 class Nodo {
     protected:
-        std::string _name;  // Nombre del nodo
-    public:        
+        const TipoNodo _kind;       // Tipo concreto del nodo
+        RefNombre _name;            // Nombre (internado) del nodo
+        std::uint32_t _posIndice;   // Posición del nodo en el índice de nombres de su árbol (o NINGUNO)
+        Nodo* _parent;              // Directorio que contiene al nodo (nullptr si no está en ninguno)
+        std::vector<Nodo*> _refs;   // Enlaces que apuntan directamente al nodo
+
+        friend class IndiceNombres;
+
+        // Comunica a los nodos cuyo tamaño depende de éste (su directorio padre y los enlaces que lo
+        // apuntan, y a su vez los que dependen de ellos) que su tamaño ha variado en <delta>. Devuelve false
+        // si algún tamaño acumulado se ha desbordado; como toda la aritmética es modular, propagar después
+        // -<delta> deja todos los tamaños exactamente como estaban
+        bool propagateSize(const Tamanyo delta) {
+            if (delta == 0)
+                return true;
+            // Caso habitual: cadena de directorios antecesores a los que no apunta ningún enlace
+            Nodo* actual = this;
+            std::uint64_t actualizados = 0;
+            bool ok = true;
+            while (actual->_refs.empty()) {
+                actual = actual->sizeParent();
+                if (actual == nullptr) {
+                    Estadisticas::global().contar(Estadisticas::NODOS_ACTUALIZADOS, actualizados);
+                    return ok;
+                }
+                ok &= actual->addToSize(delta);
+                actualizados++;
+            }
+            Estadisticas::global().contar(Estadisticas::NODOS_ACTUALIZADOS, actualizados);
+            return propagateGraph(actual, delta) && ok;
+        }
+
+        // Propaga <delta> como propagateSize() y, si algún tamaño se desborda, deshace la propagación y lanza
+        // size_overflow
+        void propagateChecked(const Tamanyo delta) {
+            if (!propagateSize(delta)) {
+                propagateSize(-delta);
+                throw size_overflow(getName());
+            }
+        }
+
+        // Propaga la variación <delta> del tamaño de <origen> por el grafo de nodos que dependen de él.
+        // Como un nodo puede depender de <origen> por varios caminos (a través de enlaces), se recorren
+        // en orden topológico acumulando la variación que llega a cada uno, de modo que cada nodo se
+        // actualiza una sola vez aunque el número de caminos sea muy grande. Devuelve false si se ha
+        // desbordado algún tamaño o la variación acumulada en algún nodo
+        static bool propagateGraph(Nodo* origen, const Tamanyo delta) {
+            // Recorrido en profundidad: el inverso del orden de finalización es un orden topológico
+            std::vector<Nodo*> orden;
+            std::unordered_set<Nodo*> visitados = {origen};
+            std::vector<std::pair<Nodo*, std::size_t>> pila = {{origen, 0}};
+            while (!pila.empty()) {
+                auto& [nodo, siguiente] = pila.back();
+                Nodo* sucesor = nullptr;
+                while (sucesor == nullptr && siguiente <= nodo->_refs.size()) {
+                    Nodo* candidato = siguiente < nodo->_refs.size() ? nodo->_refs[siguiente] : nodo->sizeParent();
+                    siguiente++;
+                    if (candidato != nullptr && visitados.insert(candidato).second)
+                        sucesor = candidato;
+                }
+                if (sucesor != nullptr) {
+                    pila.push_back({sucesor, 0});
+                } else {
+                    orden.push_back(nodo);
+                    pila.pop_back();
+                }
+            }
+
+            Estadisticas::global().contar(Estadisticas::NODOS_ACTUALIZADOS, orden.size() - 1);
+            std::unordered_map<Nodo*, Tamanyo> deltas = {{origen, delta}};
+            bool ok = true;
+            for (auto it = orden.rbegin(); it != orden.rend(); ++it) {
+                Nodo* nodo = *it;
+                Tamanyo d = deltas[nodo];
+                if (nodo != origen)
+                    ok &= nodo->addToSize(d);
+                if (Nodo* parent = nodo->sizeParent())
+                    ok &= sumarTamanyo(deltas[parent], d);
+                for (Nodo* ref : nodo->_refs)
+                    ok &= sumarTamanyo(deltas[ref], d);
+            }
+            return ok;
+        }
+    public:
         // Constructor
-        Nodo(const std::string& name) : _name(name) {}
+        Nodo(std::string_view name, const TipoNodo kind)
+            : _kind(kind), _name(name), _posIndice(TablaNombres::NINGUNO),
+              _parent(nullptr) {}
+
+        // Destructor
+        virtual ~Nodo() = default;
+
+        // Devuelve el tipo concreto del nodo
+        TipoNodo kind() const {return _kind;}
 
         // Devuelve el nombre del nodo
-        std::string getName() const {return _name;}
+        const std::string& getName() const {return TablaNombres::global().name(_name);}
+
+        // Devuelve el identificador del nombre del nodo
+        NombreId getNameId() const {return _name;}
+
+        // Cambia el nombre del nodo por <name> (sólo mientras no está en ningún directorio)
+        void rename(RefNombre name) {_name = std::move(name);}
 
         // Devuelve el tamaño del nodo
-        virtual int getSize() const = 0;
+        virtual Tamanyo getSize() const = 0;
+
+        // Devuelve el tamaño con el que el nodo contribuye al tamaño acumulado de su directorio padre
+        virtual Tamanyo aggregateSize() const {
+            return getSize();
+        }
+
+        // Suma <delta> al tamaño acumulado del nodo, sin propagarlo, y devuelve false si se desborda. Sólo los
+        // directorios guardan un tamaño acumulado; el del resto de nodos se obtiene directamente
+        virtual bool addToSize(const Tamanyo) {
+            return true;
+        }
+
+        // Indica que el contenido del nodo ha cambiado (sólo les importa a los directorios perezosos, que dejan
+        // de poder descargarse)
+        virtual void marcarModificado() {}
+
+        // Devuelve los bytes de memoria dinámica que usa el nodo además de su propio objeto
+        virtual std::size_t memoriaAuxiliar() const {
+            return _refs.capacity() * sizeof(Nodo*);
+        }
+
+        // Devuelve el directorio que contiene al nodo (nullptr si no está en ninguno)
+        Nodo* getParent() const {
+            return _parent;
+        }
+
+        // Devuelve el nodo al que debe propagarse el tamaño de éste como parte de su contenido (por
+        // defecto, su directorio padre)
+        virtual Nodo* sizeParent() const {
+            return _parent;
+        }
+
+        // Establece <parent> como el directorio que contiene al nodo
+        virtual void setParent(Nodo* parent) {
+            _parent = parent;
+        }
+
+        // Establece <parent> como el directorio que contiene al nodo, sin ninguna comprobación (para
+        // reconstruir un árbol guardado cuyo estado ya es coherente)
+        void restoreParent(Nodo* parent) {
+            _parent = parent;
+        }
+
+        // Registra (o elimina) el enlace <ref> como uno de los que apuntan al nodo
+        void addRef(Nodo* ref) {
+            _refs.push_back(ref);
+        }
+        void delRef(Nodo* ref) {
+            auto it = std::find(_refs.begin(), _refs.end(), ref);
+            if (it != _refs.end())
+                _refs.erase(it);
+        }
+
+        // Aplica <f> a cada uno de los enlaces que apuntan directamente al nodo
+        template <typename F>
+        void forEachRef(F&& f) const {
+            for (const Nodo* ref : _refs)
+                f(ref);
+        }
+
+        // Devuelve true si una variación del tamaño de este nodo llegaría a propagarse hasta <node>
+        bool reaches(const Nodo* node) const {
+            std::unordered_set<const Nodo*> visitados;
+            std::vector<const Nodo*> pendientes = {this};
+            while (!pendientes.empty()) {
+                const Nodo* actual = pendientes.back();
+                pendientes.pop_back();
+                if (actual == node)
+                    return true;
+                if (!visitados.insert(actual).second)
+                    continue;
+                if (Nodo* parent = actual->sizeParent())
+                    pendientes.push_back(parent);
+                pendientes.insert(pendientes.end(), actual->_refs.begin(), actual->_refs.end());
+            }
+            return false;
+        }
 };
@@ -0,0 +1,240 @@
+//------------------------------------------------------------------------------
+// File:   nombres.h
+// Author: Daniel Herce (NIP 848884), Alain Villagrasa (NIP 816787)
+// Date:   Marzo 2023
+// Coms:   Fichero que implementa la tabla de nombres internados, compartida
+//         por todos los nodos, con la cuenta de referencias de cada nombre
+//------------------------------------------------------------------------------
+
+#pragma once
+
+#include <atomic>
+#include <bit>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Identificador compacto de un nombre internado
+using NombreId = std::uint32_t;
+
+// Tabla de nombres internados. Puede usarse desde varios hilos: la consulta de un nombre por su
+// identificador no necesita cerrojos, y la búsqueda por nombre sólo bloquea una de sus particiones.
+//
+// Cada nombre lleva la cuenta de quienes lo usan (nodos, cambios registrados y rutas de las sesiones, a
+// través de RefNombre). Un nombre que deja de usarse sigue en la tabla, con el mismo identificador, hasta
+// que se purga (al compactar la memoria de algún árbol); entonces su identificador queda libre y puede
+// reutilizarse para otro nombre.
+class TablaNombres {
+    private:
+        static constexpr unsigned BASE = 10;        // El primer bloque de nombres tiene 2^BASE entradas
+        static constexpr unsigned BLOQUES = 33 - BASE;
+        static constexpr std::size_t PARTICIONES = 64;
+        static constexpr std::uint32_t LIBRE = UINT32_MAX;  // Cuenta de las entradas purgadas
+
+        struct Entrada {
+            std::string name;
+            std::atomic<std::uint32_t> refs{0};     // Referencias al nombre, o LIBRE si se ha purgado
+        };
+
+        struct Particion {
+            std::shared_mutex mutex;
+            std::unordered_map<std::string_view, NombreId> ids; // Identificador de cada nombre
+        };
+
+        // Nombres, indexados por su identificador. El bloque k tiene 2^(BASE+k) entradas y no se mueve
+        // una vez creado
+        std::atomic<Entrada*> _bloques[BLOQUES] = {};
+        Particion _particiones[PARTICIONES];
+        std::mutex _altas;                          // Serializa la creación y la purga de identificadores
+        NombreId _siguiente = 0;                    // Siguiente identificador sin usar nunca
+        std::vector<NombreId> _libres;              // Identificadores purgados, que se reutilizan antes
+
+        // Devuelve la entrada del nombre con identificador <id>
+        Entrada& entrada(const NombreId id) const {
+            std::uint64_t x = std::uint64_t(id) + (1u << BASE);
+            unsigned p = std::bit_width(x) - 1;
+            return _bloques[p - BASE].load(std::memory_order_acquire)[x - (std::uint64_t(1) << p)];
+        }
+
+        // Devuelve la partición en la que se guarda <name>
+        Particion& particion(std::string_view name) {
+            return _particiones[std::hash<std::string_view>()(name) % PARTICIONES];
+        }
+    public:
+        // Identificador que no corresponde a ningún nombre
+        static constexpr NombreId NINGUNO = UINT32_MAX;
+
+        // Destructor
+        ~TablaNombres() {
+            for (auto& b : _bloques)
+                delete[] b.load();
+        }
+
+        // Devuelve la tabla utilizada por todos los nodos. No se destruye al terminar el programa, ya que los
+        // nodos que aún queden vivos entonces deben poder soltar sus nombres
+        static TablaNombres& global() {
+            static TablaNombres* tabla = new TablaNombres();
+            return *tabla;
+        }
+
+        // Devuelve el identificador de <name>, añadiéndolo a la tabla si no estaba, con una referencia más que
+        // el llamante debe soltar con soltar()
+        NombreId intern(std::string_view name) {
+            Particion& part = particion(name);
+            {
+                // La purga no puede quitar el nombre mientras se tiene su partición
+                std::shared_lock<std::shared_mutex> lock(part.mutex);
+                auto it = part.ids.find(name);
+                if (it != part.ids.end()) {
+                    entrada(it->second).refs.fetch_add(1, std::memory_order_relaxed);
+                    return it->second;
+                }
+            }
+            std::lock_guard<std::mutex> altas(_altas);
+            std::unique_lock<std::shared_mutex> lock(part.mutex);
+            auto it = part.ids.find(name);
+            if (it != part.ids.end()) {
+                entrada(it->second).refs.fetch_add(1, std::memory_order_relaxed);
+                return it->second;
+            }
+
+            NombreId id;
+            if (!_libres.empty()) {
+                id = _libres.back();
+                _libres.pop_back();
+            } else {
+                id = _siguiente++;
+                std::uint64_t x = std::uint64_t(id) + (1u << BASE);
+                unsigned p = std::bit_width(x) - 1;
+                if (_bloques[p - BASE].load(std::memory_order_relaxed) == nullptr)
+                    _bloques[p - BASE].store(new Entrada[std::size_t(1) << p], std::memory_order_release);
+            }
+            Entrada& e = entrada(id);
+            e.name = name;
+            e.refs.store(1, std::memory_order_relaxed);
+            part.ids.emplace(e.name, id);
+            return id;
+        }
+
+        // Añade una referencia al nombre <id>, que el llamante ya sabe en uso (p.ej. el de un nodo vivo)
+        void retener(const NombreId id) {
+            entrada(id).refs.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        // Suelta una referencia al nombre <id>. Aunque fuera la última, el nombre sigue en la tabla hasta purgar()
+        void soltar(const NombreId id) {
+            entrada(id).refs.fetch_sub(1, std::memory_order_release);
+        }
+
+        // Quita de la tabla los nombres que nadie usa, liberando su texto, y deja libres sus identificadores.
+        // Devuelve cuántos nombres se han quitado. Cuesta O(identificadores) y bloquea las altas mientras tanto
+        std::size_t purgar() {
+            std::lock_guard<std::mutex> altas(_altas);
+            std::size_t purgados = 0;
+            for (NombreId id = 0; id < _siguiente; id++) {
+                Entrada& e = entrada(id);
+                if (e.refs.load(std::memory_order_acquire) != 0)
+                    continue;
+                // Con la partición bloqueada nadie puede encontrar el nombre y volver a usarlo
+                Particion& part = particion(e.name);
+                std::unique_lock<std::shared_mutex> lock(part.mutex);
+                if (e.refs.load(std::memory_order_acquire) != 0)
+                    continue;
+                part.ids.erase(e.name);
+                std::string().swap(e.name);
+                e.refs.store(LIBRE, std::memory_order_relaxed);
+                _libres.push_back(id);
+                purgados++;
+            }
+            return purgados;
+        }
+
+        // Devuelve el identificador de <name>, o NINGUNO si no está en la tabla
+        NombreId find(std::string_view name) {
+            Particion& part = particion(name);
+            std::shared_lock<std::shared_mutex> lock(part.mutex);
+            auto it = part.ids.find(name);
+            return it != part.ids.end() ? it->second : NINGUNO;
+        }
+
+        // Devuelve el número de nombres en la tabla
+        NombreId size() {
+            std::lock_guard<std::mutex> altas(_altas);
+            return _siguiente - NombreId(_libres.size());
+        }
+
+        // Devuelve un valor mayor que todos los identificadores de la tabla
+        NombreId limite() {
+            std::lock_guard<std::mutex> altas(_altas);
+            return _siguiente;
+        }
+
+        // Devuelve una estimación de los bytes que ocupa la tabla: sus bloques de nombres, el texto de los
+        // nombres que no caben dentro de su entrada y los índices de búsqueda por nombre
+        std::size_t memoria() {
+            std::lock_guard<std::mutex> altas(_altas);
+            std::size_t bytes = 0;
+            for (unsigned k = 0; k < BLOQUES; k++)
+                if (_bloques[k].load(std::memory_order_relaxed) != nullptr)
+                    bytes += (std::size_t(1) << (BASE + k)) * sizeof(Entrada);
+            const std::size_t interna = std::string().capacity();
+            for (NombreId id = 0; id < _siguiente; id++)
+                if (entrada(id).name.capacity() > interna)
+                    bytes += entrada(id).name.capacity() + 1;
+            bytes += _libres.capacity() * sizeof(NombreId);
+            for (Particion& part : _particiones) {
+                std::shared_lock<std::shared_mutex> lock(part.mutex);
+                bytes += part.ids.bucket_count() * sizeof(void*)
+                    + part.ids.size() * (sizeof(std::pair<const std::string_view, NombreId>) + 2 * sizeof(void*));
+            }
+            return bytes;
+        }
+
+        // Devuelve el nombre con identificador <id>
+        const std::string& name(const NombreId id) const {
+            return entrada(id).name;
+        }
+};
+
+// Referencia a un nombre internado, que lo mantiene en la tabla mientras exista (NINGUNO si está vacía).
+// Se convierte implícitamente en su identificador, y desde él (añadiendo una referencia)
+class RefNombre {
+    private:
+        NombreId _id = TablaNombres::NINGUNO;
+    public:
+        // Constructor de una referencia vacía
+        RefNombre() = default;
+
+        // Constructor de una referencia al nombre <id>, que debe estar en uso
+        RefNombre(const NombreId id) : _id(id) {
+            if (_id != TablaNombres::NINGUNO)
+                TablaNombres::global().retener(_id);
+        }
+
+        // Constructor de una referencia a <name>, que se interna si no estaba en la tabla
+        explicit RefNombre(std::string_view name) : _id(TablaNombres::global().intern(name)) {}
+
+        RefNombre(const RefNombre& otra) : RefNombre(otra._id) {}
+
+        RefNombre(RefNombre&& otra) noexcept : _id(std::exchange(otra._id, TablaNombres::NINGUNO)) {}
+
+        RefNombre& operator=(RefNombre otra) noexcept {
+            std::swap(_id, otra._id);
+            return *this;
+        }
+
+        // Destructor
+        ~RefNombre() {
+            if (_id != TablaNombres::NINGUNO)
+                TablaNombres::global().soltar(_id);
+        }
+
+        // Devuelve el identificador del nombre
+        operator NombreId() const {return _id;}
+};
@@ -0,0 +1,183 @@
+//------------------------------------------------------------------------------
+// File:   paralelo.h
+// Author: Daniel Herce (NIP 848884), Alain Villagrasa (NIP 816787)
+// Date:   Marzo 2023
+// Coms:   Fichero que implementa un conjunto de hilos con robo de trabajo
+//         para recorridos paralelos del árbol de ficheros
+//------------------------------------------------------------------------------
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Grupo de tareas lanzadas juntas, cuya finalización se espera con Tareas::esperar
+class Grupo {
+    private:
+        std::atomic<long> _pendientes{0};   // Tareas del grupo sin terminar
+        std::mutex _mutex;                  // Protege _error
+        std::exception_ptr _error;          // Primera excepción lanzada por una tarea del grupo
+
+        // Guarda <e> como error del grupo si es la primera excepción de sus tareas
+        void fallar(std::exception_ptr e) {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (_error == nullptr)
+                _error = std::move(e);
+        }
+
+        friend class Tareas;
+};
+
+// Conjunto de hilos trabajadores, cada uno con su propia cola de tareas. Un hilo toma primero las
+// tareas más recientes de su cola y, si está vacía, roba las más antiguas de las colas de los demás.
+// Los hilos que esperan a un grupo ejecutan tareas mientras tanto, por lo que las tareas pueden lanzar
+// y esperar a su vez otras tareas sin bloquear el conjunto.
+class Tareas {
+    private:
+        struct Tarea {
+            std::function<void()> f;
+            Grupo* grupo;
+        };
+
+        struct Cola {
+            std::mutex mutex;
+            std::deque<Tarea> tareas;
+        };
+
+        std::vector<std::unique_ptr<Cola>> _colas;  // Una cola por trabajador, más una para el resto de hilos
+        std::vector<std::thread> _hilos;            // Hilos trabajadores
+        std::atomic<bool> _fin{false};              // Los trabajadores deben terminar
+        std::atomic<long> _encoladas{0};            // Tareas en alguna cola
+        std::mutex _dormir;                         // Protege la espera de los trabajadores ociosos
+        std::condition_variable _despertar;         // Avisa a los trabajadores de nuevas tareas
+
+        // Devuelve el índice de la cola del hilo actual (la última para hilos ajenos al conjunto)
+        std::size_t& indice() {
+            thread_local std::size_t i = SIZE_MAX;
+            return i;
+        }
+
+        std::size_t miCola() {
+            std::size_t i = indice();
+            return i < _colas.size() ? i : _colas.size() - 1;
+        }
+
+        // Extrae una tarea, primero de la cola propia (la más reciente) y si no de las demás (la más antigua)
+        bool tomar(Tarea& t) {
+            if (_encoladas.load(std::memory_order_acquire) == 0)
+                return false;
+            std::size_t propia = miCola();
+            for (std::size_t k = 0; k < _colas.size(); k++) {
+                Cola& c = *_colas[(propia + k) % _colas.size()];
+                std::lock_guard<std::mutex> lock(c.mutex);
+                if (!c.tareas.empty()) {
+                    if (k == 0) {
+                        t = std::move(c.tareas.back());
+                        c.tareas.pop_back();
+                    } else {
+                        t = std::move(c.tareas.front());
+                        c.tareas.pop_front();
+                    }
+                    _encoladas.fetch_sub(1, std::memory_order_release);
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        // Ejecuta la tarea <t> y descuenta su finalización en su grupo. Si la tarea lanza una excepción, se
+        // guarda en el grupo para relanzarla al esperarlo
+        static void ejecutar(Tarea& t) {
+            try {
+                t.f();
+            } catch (...) {
+                t.grupo->fallar(std::current_exception());
+            }
+            t.grupo->_pendientes.fetch_sub(1, std::memory_order_acq_rel);
+        }
+
+        // Bucle de cada trabajador
+        void trabajar(const std::size_t i) {
+            indice() = i;
+            Tarea t;
+            while (!_fin.load(std::memory_order_acquire)) {
+                if (tomar(t)) {
+                    ejecutar(t);
+                } else {
+                    std::unique_lock<std::mutex> lock(_dormir);
+                    _despertar.wait_for(lock, std::chrono::milliseconds(10), [this] {
+                        return _fin.load() || _encoladas.load() > 0;
+                    });
+                }
+            }
+        }
+    public:
+        // Constructor. Crea <hilos> trabajadores (por defecto, uno menos que núcleos disponibles, ya que el
+        // hilo que espera también trabaja)
+        explicit Tareas(std::size_t hilos = std::thread::hardware_concurrency() - 1) {
+            if (hilos == 0 || hilos > 1024)
+                hilos = 1;
+            for (std::size_t i = 0; i <= hilos; i++)
+                _colas.push_back(std::make_unique<Cola>());
+            for (std::size_t i = 0; i < hilos; i++)
+                _hilos.emplace_back(&Tareas::trabajar, this, i);
+        }
+
+        // Destructor
+        ~Tareas() {
+            _fin.store(true, std::memory_order_release);
+            _despertar.notify_all();
+            for (std::thread& h : _hilos)
+                h.join();
+        }
+
+        // Devuelve el conjunto de hilos compartido por todo el programa
+        static Tareas& global() {
+            static Tareas tareas;
+            return tareas;
+        }
+
+        // Devuelve el número de hilos que pueden ejecutar tareas simultáneamente
+        std::size_t hilos() const {
+            return _colas.size();
+        }
+
+        // Lanza <f> como tarea del grupo <grupo>
+        void lanzar(Grupo& grupo, std::function<void()> f) {
+            grupo._pendientes.fetch_add(1, std::memory_order_relaxed);
+            Cola& c = *_colas[miCola()];
+            {
+                std::lock_guard<std::mutex> lock(c.mutex);
+                c.tareas.push_back({std::move(f), &grupo});
+            }
+            _encoladas.fetch_add(1, std::memory_order_release);
+            _despertar.notify_one();
+        }
+
+        // Espera a que terminen todas las tareas de <grupo>, ejecutando tareas pendientes mientras tanto. Si
+        // alguna ha lanzado una excepción, una vez terminadas todas relanza la primera
+        void esperar(Grupo& grupo) {
+            Tarea t;
+            while (grupo._pendientes.load(std::memory_order_acquire) > 0) {
+                if (tomar(t))
+                    ejecutar(t);
+                else
+                    std::this_thread::yield();
+            }
+            std::exception_ptr error;
+            {
+                std::lock_guard<std::mutex> lock(grupo._mutex);
+                std::swap(error, grupo._error);
+            }
+            if (error != nullptr)
+                std::rethrow_exception(error);
+        }
+};
@@ -0,0 +1,78 @@
+//------------------------------------------------------------------------------
+// File:   recuperacion.h
+// Author: Daniel Herce (NIP 848884), Alain Villagrasa (NIP 816787)
+// Date:   Marzo 2023
+// Coms:   Fichero que implementa la recuperación de un árbol de ficheros a
+//         partir de su diario de operaciones
+//------------------------------------------------------------------------------
+
+#pragma once
+
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <unistd.h>
+#include "shell.h"
+#include "diario.h"
+
+// Reconstruye en el árbol de <sh> (que debe estar vacío y sin otras sesiones) el estado registrado en el
+// diario <path> y en su imagen, y asocia el diario al árbol para registrar a partir de ahora sus
+// modificaciones, sincronizándolo cada <intervalo>. Si el diario no existe, se crea.
+//
+// Se carga la imagen (si existe) y se repiten sobre ella, desde la ruta activa en que se hicieron, las
+// operaciones del diario posteriores a la imagen (un montaje vuelve a montar su fuente, que debe seguir
+// disponible). Los registros incompletos del final del diario se
+// descartan. Devuelve el número de operaciones repetidas; la sesión <sh> queda en la raíz
+inline std::uint64_t abrirDiario(Shell& sh, const std::string& path, const std::chrono::milliseconds intervalo) {
+    std::uint64_t secuencia = 0;
+    std::string imagen = path + ".img";
+    if (::access(imagen.c_str(), F_OK) == 0) {
+        auto lock = sh.fs()->escribir();
+        secuencia = sh.fs()->cargar(imagen);
+    }
+
+    std::uint64_t repetidas = 0;
+    std::uint64_t validos = leerDiario(path, [&](const diario::Registro& r) {
+        if (r.secuencia <= secuencia)
+            return;
+        secuencia = r.secuencia;
+        repetidas++;
+        // La ruta registrada llevaba desde la raíz al directorio en que se hizo la operación, pero el de la
+        // sesión puede haberse eliminado con la misma ruta, así que se resuelve siempre. Las operaciones
+        // fallidas no llegan al diario; si alguna falla al repetirla, se descarta
+        try {
+            sh.cd(r.ruta);
+            switch (r.op) {
+                case Operacion::VI:
+                    sh.vi(r.a, r.size);
+                    break;
+                case Operacion::MKDIR:
+                    sh.mkdir(r.a);
+                    break;
+                case Operacion::LN:
+                    sh.ln(r.a, r.b);
+                    break;
+                case Operacion::RM:
+                    sh.rm(r.a);
+                    break;
+                case Operacion::MV:
+                    sh.mv(r.a, r.b);
+                    break;
+                case Operacion::MOUNT:
+                    sh.mount(abrirFuente(std::string(r.a)), std::size_t(r.size));
+                    break;
+            }
+        } catch (const arbol_ficheros_error&) {
+        }
+    });
+    if (validos > 0 && ::truncate(path.c_str(), validos) != 0)
+        throw journal_error(path, std::strerror(errno));
+    sh.cd("/");
+
+    auto lock = sh.fs()->escribir();
+    sh.fs()->activarDiario(std::make_unique<Diario>(path, secuencia, intervalo));
+    return repetidas;
+}
@@ -0,0 +1,443 @@
+//------------------------------------------------------------------------------
+// File:   respaldo.h
+// Author: Daniel Herce (NIP 848884), Alain Villagrasa (NIP 816787)
+// Date:   Marzo 2023
+// Coms:   Fichero que implementa el montaje de árboles muy grandes cuyos
+//         directorios se cargan al consultarlos, desde una imagen guardada o
+//         un generador, y se descargan según un presupuesto de memoria
+//------------------------------------------------------------------------------
+
+#pragma once
+
+#include <atomic>
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+#include "visitar.h"
+#include "arena.h"
+#include "imagen.h"
+#include "memoria.h"
+#include "estadisticas.h"
+#include "arbol_ficheros_error.h"
+
+// Origen del contenido de un árbol montado, en el que cada directorio se identifica por una clave. Puede
+// usarse desde varios hilos a la vez
+class Fuente {
+    public:
+        // Destructor
+        virtual ~Fuente() = default;
+
+        // Devuelve la clave del directorio raíz
+        virtual std::uint64_t raiz() const = 0;
+
+        // Devuelve el tamaño acumulado del directorio raíz
+        virtual Tamanyo tamanyoRaiz() const = 0;
+
+        // Devuelve la descripción de la fuente con la que abrirFuente() vuelve a abrirla
+        virtual std::string origen() const = 0;
+
+        // Deja en <entradas> los ficheros y los directorios que contiene el directorio <clave>, con sus tamaños
+        // (los acumulados, en los directorios). Los enlaces no se incluyen: se crean todos al montar el árbol
+        virtual void contenido(std::uint64_t clave, std::vector<EntradaRespaldo>& entradas) const = 0;
+
+        // Crea en el árbol recién montado de raíz <root> los enlaces de la fuente, cuyos nodos se reservan de
+        // <arena>, y carga para ello los directorios que los contienen y los que llevan hasta sus destinos (sólo
+        // al montar el árbol, en una sección exclusiva). Como un directorio con enlaces nunca se descarga, los
+        // que no están cargados nunca contienen enlaces
+        virtual void anclar(const std::shared_ptr<Respaldo>&, const std::shared_ptr<Directorio>&, Arena&) {}
+};
+
+// Fuente que lee el árbol de una imagen guardada (ver imagen.h), que se mantiene proyectada en memoria: sus
+// páginas sólo se leen del fichero cuando se consultan y el sistema puede descartarlas cuando le haga falta.
+// La clave de cada directorio es su índice en la imagen
+class FuenteImagen final : public Fuente {
+    private:
+        imagen::Vista _vista;                                       // Imagen comprobada
+        std::string _origen;                                        // Ruta canónica de la imagen
+        std::vector<std::uint32_t> _enlaces;                        // Enlaces de la imagen
+        std::unordered_map<std::uint32_t, std::uint32_t> _padres;   // Directorio de cada nodo que lleva a un
+                                                                    // enlace o a su destino (hasta anclar())
+    public:
+        // Constructor. Proyecta y comprueba la imagen <path>; si no es válida, lanza snapshot_error
+        explicit FuenteImagen(const std::string& path) : _vista(imagen::abrir(path)), _origen(path) {
+            std::unique_ptr<char, decltype(&std::free)> canonica(::realpath(path.c_str(), nullptr), &std::free);
+            if (canonica != nullptr)
+                _origen = canonica.get();
+            const imagen::Registro* registros = _vista.registros;
+            for (std::uint32_t i = 0; i < _vista.cab.numNodos; i++)
+                if (registros[i].kind == std::uint8_t(TipoNodo::ENLACE))
+                    _enlaces.push_back(i);
+            // Sólo se conservan los padres de los nodos por los que hay que pasar para crear los enlaces
+            auto conservar = [this](std::uint32_t n) {
+                while (n != UINT32_MAX && _padres.emplace(n, _vista.padres[n]).second)
+                    n = _vista.padres[n];
+            };
+            for (std::uint32_t i : _enlaces) {
+                conservar(i);
+                conservar(registros[i].first);
+            }
+            _vista.padres = {};
+        }
+
+        std::uint64_t raiz() const override {
+            return _vista.cab.raiz;
+        }
+
+        Tamanyo tamanyoRaiz() const override {
+            return _vista.registros[_vista.cab.raiz].size;
+        }
+
+        // La ruta de la imagen (que nunca empieza por "-g ")
+        std::string origen() const override {
+            return _origen;
+        }
+
+        void contenido(const std::uint64_t clave, std::vector<EntradaRespaldo>& entradas) const override {
+            const imagen::Registro& r = _vista.registros[clave];
+            for (std::uint32_t k = r.first; k < r.first + r.count; k++) {
+                std::uint32_t h = _vista.hijos[k];
+                const imagen::Registro& hijo = _vista.registros[h];
+                if (hijo.kind != std::uint8_t(TipoNodo::ENLACE))
+                    entradas.push_back({TipoNodo(hijo.kind), _vista.nombre(h), hijo.size, h});
+            }
+        }
+
+        // Los enlaces se crean en el mismo orden que al cargar la imagen (antes que cada enlace, el enlace al que
+        // apunta), buscando cada nodo por su nombre desde su directorio. Los nodos que sólo siguen vivos por
+        // los enlaces (fuera de todo directorio) se crean sueltos
+        void anclar(const std::shared_ptr<Respaldo>& respaldo, const std::shared_ptr<Directorio>& root,
+                    Arena& arena) override {
+            using namespace imagen;
+            const Registro* registros = _vista.registros;
+            std::unordered_map<std::uint32_t, std::shared_ptr<Nodo>> sueltos = {{_vista.cab.raiz, root}};
+
+            // Devuelve el nodo <i>, cargando los directorios que llevan hasta él
+            auto nodo = [&](auto& self, const std::uint32_t i) -> std::shared_ptr<Nodo> {
+                auto it = sueltos.find(i);
+                if (it != sueltos.end())
+                    return it->second;
+                std::uint32_t padre = _padres.at(i);
+                if (padre != UINT32_MAX)
+                    return static_cast<Directorio&>(*self(self, padre)).findNode(_vista.nombre(i));
+                const Registro& r = registros[i];
+                std::shared_ptr<Nodo> node;
+                if (r.kind == std::uint8_t(TipoNodo::DIRECTORIO)) {
+                    std::shared_ptr<Directorio> dir = arena.crear<Directorio>(_vista.nombre(i));
+                    dir->resetSize(r.size);
+                    dir->hacerPerezoso(respaldo, i);
+                    node = std::move(dir);
+                } else {
+                    node = arena.crear<Fichero>(_vista.nombre(i), r.size);
+                }
+                return sueltos.emplace(i, std::move(node)).first->second;
+            };
+
+            std::unordered_set<std::uint32_t> creados;
+            std::vector<std::uint32_t> cadena;
+            for (std::uint32_t i : _enlaces) {
+                for (std::uint32_t n = i; registros[n].kind == std::uint8_t(TipoNodo::ENLACE) && creados.count(n) == 0;
+                     n = registros[n].first)
+                    cadena.push_back(n);
+                for (auto it = cadena.rbegin(); it != cadena.rend(); ++it) {
+                    const Registro& r = registros[*it];
+                    std::shared_ptr<Nodo> enlace = arena.crear<Enlace>(_vista.nombre(*it), nodo(nodo, r.first),
+                                                                       (r.flags & CICLICO) != 0);
+                    std::uint32_t padre = _padres.at(*it);
+                    if (padre == UINT32_MAX)
+                        sueltos.emplace(*it, std::move(enlace));
+                    else
+                        static_cast<Directorio&>(*nodo(nodo, padre)).loadNode(std::move(enlace));
+                    creados.insert(*it);
+                }
+                cadena.clear();
+            }
+            _enlaces = {};
+            _padres = {};
+        }
+};
+
+// Fuente que genera un árbol sintético completo de <niveles> niveles de directorios, en el que cada directorio
+// contiene <ficheros> ficheros f0, f1... de tamaño <tamanyo> y, salvo los del último nivel, <ramas>
+// subdirectorios d0, d1... Las claves numeran los directorios por niveles, así que el contenido de cada uno y
+// su tamaño acumulado se calculan directamente, sin guardar nada por directorio
+class FuenteGenerada final : public Fuente {
+    private:
+        static constexpr std::uint64_t MAX_ANCHURA = 1 << 20;  // Máximo de ficheros o subdirectorios por directorio
+
+        std::uint64_t _ramas;
+        Tamanyo _tamanyo;
+        std::vector<std::uint64_t> _inicios;    // Clave del primer directorio de cada nivel (y total, al final)
+        std::vector<Tamanyo> _tamanyos;         // Tamaño acumulado de los directorios de cada nivel
+        std::vector<std::string> _dirs;         // Nombres de los subdirectorios
+        std::vector<std::string> _ficheros;     // Nombres de los ficheros
+    public:
+        // Constructor. Si los parámetros no son válidos o el árbol no puede representarse, lanza mount_error
+        FuenteGenerada(const std::int64_t ramas, const std::int64_t ficheros, const std::int64_t niveles,
+                       const Tamanyo tamanyo)
+            : _ramas(ramas), _tamanyo(tamanyo) {
+            const std::string origen = "generator";
+            if (ramas < 0 || ficheros < 0 || std::uint64_t(ramas) > MAX_ANCHURA || std::uint64_t(ficheros) > MAX_ANCHURA)
+                throw mount_error(origen, "branches and files must be between 0 and " + std::to_string(MAX_ANCHURA));
+            if (niveles < 1 || niveles > 64)
+                throw mount_error(origen, "levels must be between 1 and 64");
+            if (tamanyo < 0)
+                throw negative_size(tamanyo);
+
+            _inicios = {0};
+            std::uint64_t anchura = 1;
+            for (std::int64_t l = 0; l < niveles; l++) {
+                std::uint64_t fin;
+                if (__builtin_add_overflow(_inicios.back(), anchura, &fin)
+                    || (l + 1 < niveles && __builtin_mul_overflow(anchura, _ramas, &anchura)))
+                    throw mount_error(origen, "too many directories");
+                _inicios.push_back(fin);
+            }
+            // Cada directorio suma sus ficheros y sus subdirectorios, del último nivel hacia arriba
+            Tamanyo propio;
+            if (__builtin_mul_overflow(ficheros, tamanyo, &propio))
+                throw mount_error(origen, "total size too large");
+            _tamanyos.assign(niveles, propio);
+            for (std::int64_t l = niveles - 2; l >= 0; l--) {
+                Tamanyo sub;
+                if (__builtin_mul_overflow(_tamanyos[l + 1], ramas, &sub) || !sumarTamanyo(_tamanyos[l], sub))
+                    throw mount_error(origen, "total size too large");
+            }
+            for (std::int64_t j = 0; j < ramas; j++)
+                _dirs.push_back("d" + std::to_string(j));
+            for (std::int64_t j = 0; j < ficheros; j++)
+                _ficheros.push_back("f" + std::to_string(j));
+        }
+
+        std::uint64_t raiz() const override {
+            return 0;
+        }
+
+        Tamanyo tamanyoRaiz() const override {
+            return _tamanyos.front();
+        }
+
+        // Los parámetros del constructor, como en el comando mount: "-g <ramas> <ficheros> <niveles> <tamaño>"
+        std::string origen() const override {
+            return "-g " + std::to_string(_ramas) + " " + std::to_string(_ficheros.size()) + " "
+                + std::to_string(_tamanyos.size()) + " " + std::to_string(_tamanyo);
+        }
+
+        void contenido(const std::uint64_t clave, std::vector<EntradaRespaldo>& entradas) const override {
+            std::size_t nivel = 0;
+            while (_inicios[nivel + 1] <= clave)
+                nivel++;
+            if (nivel + 1 < _tamanyos.size()) {
+                std::uint64_t primero = _inicios[nivel + 1] + (clave - _inicios[nivel]) * _ramas;
+                for (std::uint64_t j = 0; j < _ramas; j++)
+                    entradas.push_back({TipoNodo::DIRECTORIO, _dirs[j], _tamanyos[nivel + 1], primero + j});
+            }
+            for (const std::string& name : _ficheros)
+                entradas.push_back({TipoNodo::FICHERO, name, _tamanyo, 0});
+        }
+};
+
+// Devuelve la fuente descrita por <origen> (ver Fuente::origen()): la imagen de esa ruta o, si empieza por
+// "-g ", el árbol generado con esos parámetros. Si no puede abrirse, lanza mount_error o snapshot_error
+inline std::unique_ptr<Fuente> abrirFuente(const std::string& origen) {
+    if (origen.compare(0, 3, "-g ") != 0)
+        return std::make_unique<FuenteImagen>(origen);
+    std::int64_t p[4];
+    const char* ini = origen.data() + 3;
+    const char* fin = origen.data() + origen.size();
+    for (std::int64_t& v : p) {
+        auto [sig, ec] = std::from_chars(ini, fin, v);
+        if (ec != std::errc() || (sig != fin && *sig != ' '))
+            throw mount_error(origen, "invalid generator parameters");
+        ini = sig == fin ? fin : sig + 1;
+    }
+    if (ini != fin)
+        throw mount_error(origen, "invalid generator parameters");
+    return std::make_unique<FuenteGenerada>(p[0], p[1], p[2], p[3]);
+}
+
+// Árbol montado desde una fuente, del que sólo está en memoria lo que se ha consultado. Cada directorio perezoso
+// carga su contenido de la fuente la primera vez que se consulta (incluso desde varios lectores a la vez) y los
+// tamaños acumulados de sus subdirectorios vienen ya calculados de ella, así que du o stat no necesitan cargar
+// nada por debajo del directorio que consultan.
+//
+// Cuando el contenido cargado supera el presupuesto, al empezar la siguiente operación se descargan directorios
+// por el algoritmo del reloj (una aproximación de LRU: se descartan los que no se han consultado desde la vuelta
+// anterior) hasta quedar en 3/4 del presupuesto. Sólo se descargan los que pueden volver a cargarse tal cual: los
+// no modificados, sin enlaces ni subdirectorios cargados y cuyos nodos no referencia nada más (ni rutas activas,
+// ni estados marcados, ni enlaces), así que la memoria queda acotada por lo que se usa y se ha modificado.
+// Durante una misma operación no puede descargarse nada, así que si lo cargado llega a superar el límite en
+// otro presupuesto entero, las cargas siguientes fallan (con mount_error) hasta que se descargue; los recorridos
+// de subárboles enteros (du -r, find, save) no cargan nada, sino que leen de la fuente lo que no está cargado.
+//
+// Se crea con std::make_shared, ya que los directorios perezosos comparten su propiedad
+class Montaje final : public Respaldo, public std::enable_shared_from_this<Montaje> {
+    private:
+        // Directorio cargado, con los bytes que se estimaron para su contenido al cargarlo
+        struct Cargado {
+            Directorio* dir;
+            std::size_t bytes;
+        };
+
+        std::unique_ptr<Fuente> _fuente;            // Origen del contenido
+        std::size_t _presupuesto;                   // Bytes de contenido cargado a partir de los que se descarga
+        Arena* _arena;                              // Arena del árbol, de la que se reservan los nodos cargados
+        std::mutex _mutex;                          // Serializa las cargas entre lectores
+        std::vector<Cargado> _cargados;             // Directorios cargados, en el orden en que los recorre el reloj
+        std::size_t _mano;                          // Posición del reloj en _cargados
+        std::atomic<std::size_t> _bytes;            // Bytes estimados del contenido cargado
+        std::atomic<std::size_t> _limite;           // Bytes a partir de los que conviene descargar
+        std::vector<EntradaRespaldo> _entradas;     // Contenido del directorio que se está cargando
+
+        // Crea un nodo de tipo <T> para el contenido que se carga: en la arena del árbol o, si ya no está montado,
+        // fuera de ella
+        template <typename T, typename... Args>
+        std::shared_ptr<T> crear(Args&&... args) {
+            if (_arena != nullptr)
+                return _arena->crear<T>(std::forward<Args>(args)...);
+            return std::make_shared<T>(std::forward<Args>(args)...);
+        }
+
+        // Quita de los cargados el de la posición <pos>, ocupando su hueco con el último
+        void quitar(const std::size_t pos) {
+            _bytes.fetch_sub(_cargados[pos].bytes, std::memory_order_relaxed);
+            _cargados[pos] = _cargados.back();
+            _cargados[pos].dir->_posCargado = pos;
+            _cargados.pop_back();
+        }
+    public:
+        // Presupuesto por defecto del contenido cargado
+        static constexpr std::size_t PRESUPUESTO = std::size_t(64) << 20;
+
+        // Constructor
+        Montaje(std::unique_ptr<Fuente> fuente, const std::size_t presupuesto = PRESUPUESTO)
+            : _fuente(std::move(fuente)), _presupuesto(presupuesto), _arena(nullptr), _mano(0), _bytes(0),
+              _limite(presupuesto) {}
+
+        // Crea la raíz del árbol montado, perezosa, y los enlaces de la fuente, reservándolos de <arena>, que
+        // también se usará para los nodos que se carguen (sólo en una sección exclusiva)
+        std::shared_ptr<Directorio> montar(Arena& arena) {
+            _arena = &arena;
+            std::shared_ptr<Directorio> root = arena.crear<Directorio>("");
+            root->resetSize(_fuente->tamanyoRaiz());
+            root->hacerPerezoso(shared_from_this(), _fuente->raiz());
+            _fuente->anclar(shared_from_this(), root, arena);
+            return root;
+        }
+
+        // Pasa a reservar los nodos que se carguen de <arena> (p.ej. tras compactar el árbol; sólo en una sección
+        // exclusiva)
+        void usarArena(Arena& arena) {
+            _arena = &arena;
+        }
+
+        // Devuelve la fuente del montaje
+        const Fuente& fuente() const {
+            return *_fuente;
+        }
+
+        // Devuelve el presupuesto del contenido cargado
+        std::size_t presupuesto() const {
+            return _presupuesto;
+        }
+
+        // Deja de usar la arena del árbol, que ya no contiene el árbol montado (sólo en una sección exclusiva). Los
+        // directorios que aún conserve alguna sesión pueden seguir cargándose, fuera de la arena
+        void desmontar() {
+            _arena = nullptr;
+        }
+
+        void contenido(const std::uint64_t clave, std::vector<EntradaRespaldo>& entradas) const override {
+            _fuente->contenido(clave, entradas);
+        }
+
+        void cargar(Directorio& dir) override {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (dir.cargado())
+                return;
+            std::size_t cargados = _bytes.load(std::memory_order_relaxed);
+            if (cargados > _limite.load(std::memory_order_relaxed) + _presupuesto)
+                throw mount_error(_fuente->origen(), "cannot load more than the memory budget in one operation ("
+                                  + std::to_string(cargados) + " bytes loaded)");
+            _entradas.clear();
+            _fuente->contenido(dir.clave(), _entradas);
+            std::vector<std::shared_ptr<Nodo>> nodos;
+            nodos.reserve(_entradas.size());
+            std::size_t bytes = 0;
+            for (const EntradaRespaldo& e : _entradas) {
+                if (e.kind == TipoNodo::DIRECTORIO) {
+                    std::shared_ptr<Directorio> sub = crear<Directorio>(e.name);
+                    sub->resetSize(e.size);
+                    sub->hacerPerezoso(shared_from_this(), e.clave);
+                    nodos.push_back(std::move(sub));
+                } else {
+                    nodos.push_back(crear<Fichero>(e.name, e.size));
+                }
+                bytes += memoria::bytesNodo(*nodos.back());
+            }
+            dir.completarCarga(nodos);
+            bytes += dir._children.memoria();
+            dir._posCargado = _cargados.size();
+            _cargados.push_back({&dir, bytes});
+            _bytes.fetch_add(bytes, std::memory_order_relaxed);
+            Estadisticas::global().contar(Estadisticas::CARGAS);
+        }
+
+        void olvidar(Directorio& dir) override {
+            if (dir._posCargado < _cargados.size() && _cargados[dir._posCargado].dir == &dir)
+                quitar(dir._posCargado);
+        }
+
+        // Devuelve true si el contenido cargado ha superado el presupuesto desde la última descarga (con el árbol
+        // bloqueado, al menos para lectura)
+        bool excedido() const {
+            return _bytes.load(std::memory_order_relaxed) > _limite.load(std::memory_order_relaxed);
+        }
+
+        // Descarga directorios hasta que el contenido cargado quede en 3/4 del presupuesto o, si <todo>, todos los
+        // que puedan descargarse, aunque se hayan consultado hace poco (sólo en una sección exclusiva). Si no se
+        // llega, no se vuelve a intentar hasta que el contenido cargado crezca otro octavo del presupuesto
+        void descargar(const bool todo = false) {
+            std::size_t objetivo = todo ? 0 : _presupuesto - _presupuesto / 4;
+            bool descargado = true;
+            while (descargado && _bytes.load(std::memory_order_relaxed) > objetivo) {
+                // Dos vueltas del reloj: en la primera se borran las marcas de uso y en la segunda se descargan
+                // los que no se hayan vuelto a usar
+                descargado = false;
+                for (std::size_t revisados = 0, n = 2 * _cargados.size();
+                     revisados < n && !_cargados.empty() && _bytes.load(std::memory_order_relaxed) > objetivo;
+                     revisados++) {
+                    if (_mano >= _cargados.size())
+                        _mano = 0;
+                    Directorio& dir = *_cargados[_mano].dir;
+                    bool usado = dir._usado.exchange(false, std::memory_order_relaxed);
+                    if ((usado && !todo) || !dir.descargable()) {
+                        _mano++;
+                        continue;
+                    }
+                    quitar(_mano);
+                    dir.descargar();
+                    descargado = true;
+                    Estadisticas::global().contar(Estadisticas::DESCARGAS);
+                }
+                // Descargar un directorio puede hacer descargable a su padre, que quizá ya se ha revisado
+                if (!todo)
+                    break;
+            }
+            std::size_t bytes = _bytes.load(std::memory_order_relaxed);
+            _limite.store(bytes > _presupuesto ? bytes + _presupuesto / 8 : _presupuesto, std::memory_order_relaxed);
+        }
+
+        // Devuelve el estado de la carga de los directorios (sólo en una sección exclusiva)
+        CargaPerezosa estado() const {
+            return {_cargados.size(), _bytes.load(std::memory_order_relaxed), _presupuesto};
+        }
+};
@@ -0,0 +1,118 @@
+//------------------------------------------------------------------------------
+// File:   ruta.h
+// Author: Daniel Herce (NIP 848884), Alain Villagrasa (NIP 816787)
+// Date:   Marzo 2023
+// Coms:   Fichero que implementa la resolución de rutas sobre el árbol de
+//         directorios, sin modificar la ruta activa de la Shell
+//------------------------------------------------------------------------------
+
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <memory>
+#include <vector>
+#include "fichero.h"
+#include "enlace.h"
+#include "directorio.h"
+#include "visitar.h"
+#include "arbol_ficheros_error.h"
+
+// Paso de una ruta: directorio alcanzado y nombre con el que se ha llegado a él (que puede ser el de
+// un enlace al directorio)
+struct Paso {
+    std::shared_ptr<Directorio> dir;
+    RefNombre name;
+};
+
+// Cadena de directorios desde la raíz (primer paso) hasta un directorio dado (último paso)
+using Camino = std::vector<Paso>;
+
+// Resultado de resolver una ruta completa
+struct Resolucion {
+    Camino camino;              // Directorios desde la raíz hasta el que contiene al nodo
+    std::shared_ptr<Nodo> nodo; // Nodo referenciado por la ruta
+};
+
+// Devuelve la ruta textual de <camino>, con los nombres de los pasos separados por '/'
+inline std::string toString(const Camino& camino) {
+    if (camino.size() == 1)
+        return "/";
+    std::string ruta;
+    for (std::size_t i = 1; i < camino.size(); i++)
+        ruta += "/" + TablaNombres::global().name(camino[i].name);
+    return ruta;
+}
+
+// Devuelve el directorio al que lleva <elem> siguiendo los enlaces (de forma sucesiva). Si no es un
+// directorio, lanza is_a_file(<name>)
+inline std::shared_ptr<Directorio> followDir(const std::shared_ptr<Nodo>& elem, std::string_view name) {
+    std::shared_ptr<Directorio> dir = nodeCast<Directorio>(follow(elem));
+    if (dir == nullptr)
+        throw is_a_file(std::string(name));
+    return dir;
+}
+
+// Avanza <camino> un paso según el componente <name> ("." , ".." o el nombre de un nodo que debe ser un
+// directorio o un enlace a un directorio)
+inline void step(Camino& camino, std::string_view name) {
+    Estadisticas::global().contar(Estadisticas::COMPONENTES);
+    if (name.empty() || name == ".") {
+        return;
+    } else if (name == "..") {
+        if (camino.size() == 1)
+            throw already_root();
+        camino.pop_back();
+    } else {
+        std::shared_ptr<Nodo> elem = camino.back().dir->findNode(name);
+        if (elem == nullptr)
+            throw elem_not_found(std::string(name));
+        camino.push_back({followDir(elem, name), elem->getNameId()});
+    }
+}
+
+// Recorre <path> desde la raíz (si comienza por '/') o desde <activo>, tratando todos sus componentes
+// salvo el último como directorios. Devuelve el camino hasta el directorio que contiene al último
+// componente y deja éste en <last>
+inline Camino resolveParent(const Camino& activo, std::string_view path, std::string_view& last) {
+    Camino camino;
+    if (!path.empty() && path.front() == '/')
+        camino.push_back(activo.front());
+    else
+        camino = activo;
+
+    std::size_t pos = path.find_last_of('/');
+    last = pos == std::string_view::npos ? path : path.substr(pos + 1);
+    std::string_view dirs = pos == std::string_view::npos ? std::string_view() : path.substr(0, pos);
+    while (!dirs.empty()) {
+        std::size_t sep = dirs.find('/');
+        step(camino, dirs.substr(0, sep));
+        dirs = sep == std::string_view::npos ? std::string_view() : dirs.substr(sep + 1);
+    }
+    return camino;
+}
+
+// Recorre <path> desde la raíz o desde <activo> tratando todos sus componentes como directorios, y
+// devuelve el camino hasta el último de ellos
+inline Camino resolveDir(const Camino& activo, std::string_view path) {
+    std::string_view last;
+    Camino camino = resolveParent(activo, path, last);
+    step(camino, last);
+    return camino;
+}
+
+// Recorre <path> desde la raíz o desde <activo> y devuelve el nodo al que hace referencia junto con
+// el camino hasta el directorio que lo contiene (o hasta el propio nodo si la ruta acaba en "." o "..")
+inline Resolucion resolve(const Camino& activo, std::string_view path) {
+    std::string_view last;
+    Resolucion res{resolveParent(activo, path, last), nullptr};
+    if (last.empty() || last == "." || last == "..") {
+        step(res.camino, last);
+        res.nodo = res.camino.back().dir;
+    } else {
+        res.nodo = res.camino.back().dir->findNode(last);
+        if (res.nodo == nullptr)
+            throw elem_not_found(std::string(last));
+    }
+    return res;
+}
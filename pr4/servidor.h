@@ -0,0 +1,344 @@
+//------------------------------------------------------------------------------
+// File:   servidor.h
+// Author: Daniel Herce (NIP 848884), Alain Villagrasa (NIP 816787)
+// Date:   Marzo 2023
+// Coms:   Fichero que implementa el modo servidor: un bucle de eventos que
+//         atiende a varios clientes sobre un mismo árbol de ficheros a través
+//         de un socket local
+//------------------------------------------------------------------------------
+
+#pragma once
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <ostream>
+#include <streambuf>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include <arpa/inet.h>
+#include <csignal>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "comandos.h"
+
+// Búfer de salida que añade todo lo que se escribe al final de una cadena
+class SalidaCadena : public std::streambuf {
+    private:
+        std::string* _destino;
+    protected:
+        int_type overflow(int_type c) override {
+            if (!traits_type::eq_int_type(c, traits_type::eof()))
+                _destino->push_back(traits_type::to_char_type(c));
+            return traits_type::not_eof(c);
+        }
+
+        std::streamsize xsputn(const char* s, std::streamsize n) override {
+            _destino->append(s, n);
+            return n;
+        }
+    public:
+        // Constructor
+        explicit SalidaCadena(std::string& destino) : _destino(&destino) {}
+};
+
+namespace servidor {
+    // Descriptor (eventfd) con el que las señales de terminación avisan al bucle de eventos
+    inline int aviso = -1;
+
+    inline void alTerminar(int) {
+        std::uint64_t uno = 1;
+        [[maybe_unused]] ssize_t n = ::write(aviso, &uno, sizeof(uno));
+    }
+}
+
+// Servidor que atiende a varios clientes sobre un mismo árbol con un único hilo y un bucle de eventos (epoll).
+// Escucha en un socket Unix o, si la dirección es sólo un número, en ese puerto TCP de localhost.
+//
+// Cada conexión es una sesión independiente (con su propia ruta activa) que envía comandos, uno por línea,
+// con el mismo vocabulario que la shell interactiva (incluidos los bloques batch en varias líneas). Los
+// comandos se ejecutan en orden en cuanto llegan, sin esperar a que el cliente lea las respuestas anteriores,
+// de modo que el cliente puede enviar muchos seguidos. La respuesta a cada comando es su salida, con los
+// errores precedidos de "error: ", terminada por una línea con un solo punto; las líneas de la salida que
+// empiezan por un punto se envían con otro punto delante (como en SMTP). Las líneas vacías no tienen
+// respuesta. El comando exit cierra la conexión una vez enviadas las respuestas.
+//
+// Los comandos que usan ficheros del sistema real (save, load, import, mount de una imagen y stats dump) sólo
+// pueden usar los del directorio al que se confine el servidor, con rutas relativas a él; si no se confina,
+// están prohibidos. Un comando que falla, con la excepción que sea, sólo responde con su error.
+//
+// Si un cliente no lee sus respuestas, se deja de procesar su entrada en cuanto tiene demasiada salida
+// pendiente. Los comandos se ejecutan en el propio bucle, así que uno largo (o la espera a que el diario sea
+// duradero, si no hay intervalo de sincronización) retrasa a todos los clientes.
+class Servidor {
+    private:
+        static constexpr std::size_t MAX_SALIDA = 4 << 20;     // Salida pendiente a partir de la que no se
+                                                                // procesa más entrada
+        static constexpr std::size_t MAX_LINEA = 64 << 20;     // Longitud máxima de una línea
+        static constexpr std::size_t BLOQUE = 64 << 10;        // Bytes leídos de cada vez
+
+        // Conexión con un cliente
+        struct Conexion {
+            int fd;
+            Shell sh;                   // Sesión del cliente
+            BloqueLote bloque;          // Bloque batch en curso
+            std::string entrada;        // Datos recibidos pendientes de procesar
+            std::string salida;         // Respuestas pendientes de enviar
+            std::size_t enviados = 0;   // Bytes de <salida> ya enviados
+            bool fin = false;           // El cliente ha cerrado su lado o ha ejecutado exit
+            std::uint32_t eventos = EPOLLIN | EPOLLRDHUP;   // Eventos vigilados
+        };
+
+        std::string _direccion;                 // Ruta del socket Unix o puerto TCP
+        bool _unix;                             // Se escucha en un socket Unix
+        int _escucha = -1;                      // Socket en el que se aceptan conexiones
+        int _epoll = -1;
+        int _aviso = -1;                        // eventfd de las señales de terminación
+        std::shared_ptr<SistemaFicheros> _fs;   // Árbol compartido por todas las conexiones
+        AccesoHost _host;                       // Acceso de los clientes a ficheros del sistema real
+        std::unordered_map<int, std::unique_ptr<Conexion>> _conexiones;
+        std::vector<std::string_view> _cmd;     // Palabras del comando en curso
+        std::string _respuesta;                 // Salida del comando en curso
+
+        // Lanza server_error con el motivo <que> y la descripción de errno
+        [[noreturn]] void fallo(const std::string& que) const {
+            throw server_error(_direccion, que + ": " + std::strerror(errno));
+        }
+
+        // Vigila en el bucle los eventos <eventos> de <fd>, con la operación <op> de epoll_ctl
+        void vigilar(const int fd, const std::uint32_t eventos, const int op = EPOLL_CTL_ADD) {
+            epoll_event ev = {};
+            ev.events = eventos;
+            ev.data.fd = fd;
+            if (::epoll_ctl(_epoll, op, fd, &ev) != 0)
+                fallo("epoll_ctl");
+        }
+
+        // Crea el socket de escucha
+        void escuchar() {
+            if (_unix) {
+                sockaddr_un dir = {};
+                dir.sun_family = AF_UNIX;
+                if (_direccion.size() >= sizeof(dir.sun_path))
+                    throw server_error(_direccion, "socket path too long");
+                std::memcpy(dir.sun_path, _direccion.c_str(), _direccion.size() + 1);
+                // Un socket abandonado por un servidor anterior se sustituye
+                struct stat st;
+                if (::stat(_direccion.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+                    ::unlink(_direccion.c_str());
+                _escucha = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+                if (_escucha < 0 || ::bind(_escucha, reinterpret_cast<sockaddr*>(&dir), sizeof(dir)) != 0)
+                    fallo("bind");
+            } else {
+                sockaddr_in dir = {};
+                dir.sin_family = AF_INET;
+                dir.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+                dir.sin_port = htons(std::stoi(_direccion));
+                int uno = 1;
+                _escucha = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+                if (_escucha < 0 || ::setsockopt(_escucha, SOL_SOCKET, SO_REUSEADDR, &uno, sizeof(uno)) != 0
+                    || ::bind(_escucha, reinterpret_cast<sockaddr*>(&dir), sizeof(dir)) != 0)
+                    fallo("bind");
+            }
+            if (::listen(_escucha, SOMAXCONN) != 0)
+                fallo("listen");
+        }
+
+        // Acepta todas las conexiones pendientes
+        void aceptar() {
+            while (true) {
+                int fd = ::accept4(_escucha, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                if (fd < 0) {
+                    if (errno == EINTR)
+                        continue;
+                    return;     // EAGAIN, o un error de la conexión que no afecta al servidor
+                }
+                if (!_unix) {
+                    int uno = 1;
+                    ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &uno, sizeof(uno));
+                }
+                vigilar(fd, EPOLLIN | EPOLLRDHUP);
+                _conexiones.emplace(fd, std::unique_ptr<Conexion>(new Conexion{fd, Shell(_fs)}));
+            }
+        }
+
+        // Añade a la salida de <c> la respuesta del comando en curso, con los puntos iniciales duplicados y la
+        // línea final
+        static void responder(Conexion& c, std::string_view respuesta) {
+            bool inicio = true;
+            for (char ch : respuesta) {
+                if (inicio && ch == '.')
+                    c.salida += '.';
+                c.salida += ch;
+                inicio = ch == '\n';
+            }
+            if (!inicio)
+                c.salida += '\n';
+            c.salida += ".\n";
+        }
+
+        // Ejecuta los comandos completos recibidos por <c>, mientras no tenga demasiada salida pendiente
+        void procesar(Conexion& c) {
+            SalidaCadena buf(_respuesta);
+            std::ostream out(&buf);
+            std::size_t pos = 0;
+            bool sigue = true;
+            while (sigue && c.salida.size() - c.enviados < MAX_SALIDA) {
+                std::size_t fin = c.entrada.find('\n', pos);
+                if (fin == std::string::npos && !(c.fin && pos < c.entrada.size()))
+                    break;
+                fin = std::min(fin, c.entrada.size());
+                std::string_view line(c.entrada.data() + pos, fin - pos);
+                pos = std::min(fin + 1, c.entrada.size());
+                if (c.bloque.acumular(line))
+                    continue;
+                tokenize(line, _cmd);
+                if (_cmd.empty())
+                    continue;
+                _respuesta.clear();
+                sigue = ejecutar(c.sh, _cmd, out, out, "error: ", _host);
+                responder(c, _respuesta);
+            }
+            c.entrada.erase(0, pos);
+            if (!sigue) {
+                c.fin = true;
+                c.entrada.clear();
+            }
+        }
+
+        // Envía toda la salida pendiente de <c> que admita el socket. Devuelve false si la conexión ha fallado
+        bool enviar(Conexion& c) {
+            while (c.enviados < c.salida.size()) {
+                ssize_t n = ::send(c.fd, c.salida.data() + c.enviados, c.salida.size() - c.enviados, MSG_NOSIGNAL);
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n < 0)
+                    return errno == EAGAIN || errno == EWOULDBLOCK;
+                c.enviados += n;
+            }
+            c.salida.clear();
+            c.enviados = 0;
+            return true;
+        }
+
+        // Cierra la conexión <c>
+        void cerrar(Conexion& c) {
+            int fd = c.fd;
+            ::close(fd);
+            _conexiones.erase(fd);
+        }
+
+        // Atiende los eventos <recibidos> de la conexión <c>
+        void atender(Conexion& c, const std::uint32_t recibidos) {
+            if (recibidos & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                while (!c.fin) {
+                    std::size_t antes = c.entrada.size();
+                    c.entrada.resize(antes + BLOQUE);
+                    ssize_t n = ::recv(c.fd, c.entrada.data() + antes, BLOQUE, 0);
+                    c.entrada.resize(antes + std::max<ssize_t>(n, 0));
+                    if (n < 0 && errno == EINTR)
+                        continue;
+                    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                        break;
+                    if (n <= 0)
+                        c.fin = true;
+                    else if (c.entrada.size() > MAX_LINEA && c.entrada.find('\n') == std::string::npos)
+                        return cerrar(c);
+                    else if (c.salida.size() - c.enviados >= MAX_SALIDA)
+                        break;
+                }
+            }
+            procesar(c);
+            if (!enviar(c))
+                return cerrar(c);
+            std::size_t pendiente = c.salida.size() - c.enviados;
+            bool quedan = c.fin ? !c.entrada.empty() : c.entrada.find('\n') != std::string::npos;
+            if (c.fin && pendiente == 0 && !quedan)
+                return cerrar(c);
+            // Con demasiada salida pendiente no se lee más entrada. Con salida pendiente se espera a poder
+            // enviarla; sin ella, si quedan comandos que no se procesaron por exceso de salida, se vuelve a
+            // atender la conexión en cuanto se pueda escribir
+            std::uint32_t eventos = (c.fin || pendiente >= MAX_SALIDA ? 0 : EPOLLIN | EPOLLRDHUP)
+                                    | (pendiente > 0 || quedan ? EPOLLOUT : 0);
+            if (eventos != c.eventos) {
+                vigilar(c.fd, eventos, EPOLL_CTL_MOD);
+                c.eventos = eventos;
+            }
+        }
+    public:
+        // Constructor. Prepara un servidor sobre el árbol <fs> en la dirección <direccion>: la ruta de un socket
+        // Unix o un número de puerto TCP (en localhost). Los clientes usan los ficheros del sistema real según
+        // <host>. Si no puede escuchar en la dirección, lanza server_error
+        Servidor(std::shared_ptr<SistemaFicheros> fs, const std::string& direccion,
+                 AccesoHost host = AccesoHost::prohibido())
+            : _direccion(direccion), _unix(direccion.empty() || direccion.find_first_not_of("0123456789") != std::string::npos),
+              _fs(std::move(fs)), _host(std::move(host)) {
+            if (!_unix && std::stoul(direccion) > 65535)
+                throw server_error(direccion, "invalid port");
+            _epoll = ::epoll_create1(EPOLL_CLOEXEC);
+            _aviso = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (_epoll < 0 || _aviso < 0)
+                fallo("epoll");
+            escuchar();
+            vigilar(_escucha, EPOLLIN);
+            vigilar(_aviso, EPOLLIN);
+        }
+
+        Servidor(const Servidor&) = delete;
+        Servidor& operator=(const Servidor&) = delete;
+
+        // Destructor. Cierra todas las conexiones y, si es un socket Unix, lo elimina
+        ~Servidor() {
+            for (auto& [fd, c] : _conexiones)
+                ::close(fd);
+            _conexiones.clear();
+            if (_escucha >= 0) {
+                ::close(_escucha);
+                if (_unix)
+                    ::unlink(_direccion.c_str());
+            }
+            if (_aviso >= 0)
+                ::close(_aviso);
+            if (_epoll >= 0)
+                ::close(_epoll);
+        }
+
+        // Atiende a los clientes hasta recibir SIGINT o SIGTERM
+        void servir() {
+            servidor::aviso = _aviso;
+            struct sigaction sa = {};
+            sa.sa_handler = servidor::alTerminar;
+            ::sigaction(SIGINT, &sa, nullptr);
+            ::sigaction(SIGTERM, &sa, nullptr);
+            std::vector<epoll_event> eventos(256);
+            while (true) {
+                int n = ::epoll_wait(_epoll, eventos.data(), eventos.size(), -1);
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n < 0)
+                    fallo("epoll_wait");
+                for (int i = 0; i < n; i++) {
+                    int fd = eventos[i].data.fd;
+                    if (fd == _aviso)
+                        return;
+                    if (fd == _escucha) {
+                        aceptar();
+                        continue;
+                    }
+                    auto it = _conexiones.find(fd);
+                    if (it != _conexiones.end())
+                        atender(*it->second, eventos[i].events);
+                }
+            }
+        }
+};
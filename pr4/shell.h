@@ -7,266 +7,849 @@
 
 #pragma once
 
+#include <algorithm>
+#include <numeric>
+#include <sstream>
 #include <string>
+#include <string_view>
 #include <memory>
-#include <list>
+#include <vector>
 #include "fichero.h"
 #include "enlace.h"
 #include "directorio.h"
+#include "visitar.h"
 #include "arbol_ficheros_error.h"
+#include "ruta.h"
+#include "sistema_ficheros.h"
+#include "buscar.h"
+#include "importar.h"
 
+// Modificaciones que puede agrupar una transacción (Shell::batch)
+enum class OrdenLote : std::uint8_t {
+    MKDIR,
+    VI,
+    LN,
+    RM,
+    MV,
+    CD
+};
+
+// Modificación de una transacción, con los argumentos del método de Shell del mismo nombre: <a> es el nombre
+// o la ruta (de origen, en mv), y <b> el nombre del enlace (ln) o la ruta de destino (mv). Las cadenas deben
+// seguir vivas mientras dure la transacción
+struct OpLote {
+    OrdenLote orden;
+    std::string_view a;
+    std::string_view b;
+    Tamanyo size = 0;
+};
+
+// Sesión de trabajo sobre un árbol de ficheros. Varias Shell pueden compartir el mismo SistemaFicheros
+// (cada una con su propia ruta activa) y usarse desde hilos distintos; una misma Shell no debe usarse
+// desde varios hilos a la vez. Copiar una Shell crea una nueva sesión sobre el mismo árbol.
+//
+// Las operaciones que modifican el árbol se registran en su diario (si lo tiene) dentro de la propia
+// sección exclusiva, y esperan a que el registro sea duradero una vez liberado el cerrojo.
+//
+// Con cd @marca[/ruta] la sesión pasa a un estado marcado con snapshot (ver VistaMarca), en el que pwd, cd, ls,
+// du, stat y find consultan ese estado y las modificaciones lanzan read_only_snapshot; un cd a una ruta absoluta
+// vuelve al árbol. Desde el árbol, stat también acepta rutas "@marca/ruta".
 class Shell {
     private:
-        std::list<std::shared_ptr<Directorio>> _rutaActiva;
-        std::string _ruta;
+        std::shared_ptr<SistemaFicheros> _fs;   // Árbol de ficheros sobre el que se trabaja
+        Camino _rutaActiva;                     // Directorios desde la raíz hasta el directorio activo
+        std::string _ruta;                      // Ruta activa en forma textual
+        std::uint64_t _traslados;               // traslados() del árbol cuando se calculó la ruta activa
+        std::uint64_t _comprobada;              // bajas() del árbol cuando se comprobó que la ruta activa seguía en él
+        std::string _marca;                     // Estado marcado en el que está la sesión (vacío si está en el árbol)
+        std::vector<std::string> _pasosMarca;   // Ruta de la sesión en ese estado, desde su raíz
+        std::string _rutaMarca;                 // Ruta en el estado marcado en forma textual ("@marca/...")
+
+        // Recalcula <camino> a partir de la posición actual de su último directorio en el árbol, subiendo por
+        // sus antecesores (así que deja de pasar por enlaces). Si el directorio ya no está en el árbol, no lo
+        // modifica y devuelve false (con el árbol bloqueado)
+        bool reubicar(Camino& camino) const {
+            std::vector<const Nodo*> antecesores;
+            for (const Nodo* node = camino.back().dir.get(); node != nullptr; node = node->getParent())
+                antecesores.push_back(node);
+            if (antecesores.back() != _fs->root().get())
+                return false;
+            Camino nuevo = {{_fs->root(), _fs->root()->getNameId()}};
+            for (auto it = antecesores.rbegin() + 1; it != antecesores.rend(); ++it)
+                nuevo.push_back({nodeCast<Directorio>(nuevo.back().dir->findNode((*it)->getName())), (*it)->getNameId()});
+            camino = std::move(nuevo);
+            return true;
+        }
+
+        // Recalcula la ruta activa resolviendo su forma textual desde la raíz actual; si ya no lleva a ningún
+        // directorio, la sesión vuelve a la raíz (con el árbol bloqueado)
+        void resolverRuta() {
+            Camino raiz = {{_fs->root(), _fs->root()->getNameId()}};
+            try {
+                _rutaActiva = resolveDir(raiz, _ruta);
+            } catch (const arbol_ficheros_error&) {
+                _rutaActiva = std::move(raiz);
+            }
+            _ruta = toString(_rutaActiva);
+        }
+
+        // Si desde que se calculó la ruta activa se ha cambiado la ruta de algún directorio (con mv o rollback),
+        // la recalcula con reubicar(). Si su directorio ya no está en el árbol (p.ej. porque se ha compactado o
+        // se ha cargado una imagen, y sus nodos son otros), la recalcula con resolverRuta() (con el árbol
+        // bloqueado)
+        void seguirTraslados() {
+            std::uint64_t traslados = _fs->traslados();
+            if (traslados == _traslados)
+                return;
+            _traslados = traslados;
+            if (reubicar(_rutaActiva))
+                _ruta = toString(_rutaActiva);
+            else
+                resolverRuta();
+        }
+
+        // Devuelve cuántos directorios de <camino>, empezando por la raíz, siguen en el árbol: cada uno es el que
+        // se alcanza desde el anterior por su nombre (con el árbol bloqueado). Si todos siguen, la forma textual
+        // de <camino> lleva desde la raíz exactamente a su último directorio
+        std::size_t vigentes(const Camino& camino) const {
+            if (camino.empty() || camino.front().dir != _fs->root())
+                return 0;
+            std::size_t n = 1;
+            for (; n < camino.size(); n++) {
+                std::shared_ptr<Nodo> elem = camino[n - 1].dir->findNode(TablaNombres::global().name(camino[n].name));
+                if (elem == nullptr || follow(elem) != camino[n].dir)
+                    break;
+            }
+            return n;
+        }
+
+        // Comprueba, antes de modificar el árbol, que la ruta activa sigue en él (con el árbol bloqueado). Si otra
+        // sesión (o ésta) ha eliminado alguno de sus directorios, la sesión pasa al antecesor más cercano que sigue
+        // en el árbol y lanza dir_removed: así nunca se modifica un directorio eliminado, y la ruta registrada en
+        // el diario con cada modificación lleva al directorio en que se hizo. Sólo se recorre la ruta si se ha
+        // retirado algún directorio o enlace desde la última comprobación (cd no puede salir de él, y los
+        // traslados ya los sigue seguirTraslados())
+        void comprobarRuta() {
+            std::uint64_t bajas = _fs->bajas();
+            if (bajas == _comprobada)
+                return;
+            std::size_t n = vigentes(_rutaActiva);
+            _comprobada = bajas;
+            if (n == _rutaActiva.size())
+                return;
+            std::string anterior = _ruta;
+            if (n == 0)
+                _rutaActiva = {{_fs->root(), _fs->root()->getNameId()}};
+            else
+                _rutaActiva.resize(n);
+            _ruta = toString(_rutaActiva);
+            throw dir_removed(anterior);
+        }
+
+        // Devuelve true si <path> se refiere a un estado marcado: si empieza por '@' ("@marca/ruta") o si es
+        // relativa y la sesión está en uno
+        bool enMarca(std::string_view path) const {
+            return path.starts_with('@') || (!_marca.empty() && !path.starts_with('/'));
+        }
+
+        // Sale del estado marcado en el que está la sesión, que vuelve a su ruta activa en el árbol
+        void salirDeMarca() {
+            _marca.clear();
+            _pasosMarca.clear();
+            _rutaMarca.clear();
+        }
+
+        // Lanza read_only_snapshot si la sesión está en un estado marcado, que no puede modificarse
+        void comprobarEscritura() const {
+            if (!_marca.empty())
+                throw read_only_snapshot(_marca);
+        }
+
+        // Avanza el camino <dirs> (con los nombres <pasos>) de la vista <vista> un paso según el componente
+        // <name>, como step()
+        static void pasoMarca(const VistaMarca& vista, std::string_view name, std::vector<const Directorio*>& dirs,
+                              std::vector<std::string>& pasos) {
+            if (name.empty() || name == ".")
+                return;
+            if (name == "..") {
+                if (pasos.empty())
+                    throw already_root();
+                dirs.pop_back();
+                pasos.pop_back();
+                return;
+            }
+            dirs.push_back(vista.paso(*dirs.back(), name));
+            pasos.emplace_back(name);
+        }
+
+        // Recorre <path>, que debe referirse a un estado marcado (ver enMarca()), desde su raíz o desde la ruta
+        // de la sesión en él, como resolveParent(), y devuelve la vista del estado (con el árbol bloqueado). Deja
+        // en <marca> el nombre del estado, en <dirs> los directorios desde su raíz hasta el que contiene al último
+        // componente, en <pasos> sus nombres, y en <last> el último componente. Si la sesión está en un estado que
+        // ya no existe (se ha eliminado su marca o se ha vuelto a otra anterior), sale de él y lanza
+        // unknown_snapshot
+        VistaMarca recorrerMarca(std::string_view path, std::string& marca, std::vector<const Directorio*>& dirs,
+                                 std::vector<std::string>& pasos, std::string_view& last) {
+            if (path.starts_with('@')) {
+                std::size_t sep = path.find('/');
+                marca = path.substr(1, sep - 1);
+                path = sep == std::string_view::npos ? std::string_view() : path.substr(sep + 1);
+                pasos.clear();
+            } else {
+                marca = _marca;
+                pasos = _pasosMarca;
+            }
+            VistaMarca vista;
+            try {
+                vista = _fs->vista(marca);
+            } catch (const unknown_snapshot&) {
+                if (marca == _marca)
+                    salirDeMarca();
+                throw;
+            }
+            dirs = {_fs->root().get()};
+            for (const std::string& name : pasos)
+                dirs.push_back(vista.paso(*dirs.back(), name));
+            std::size_t pos = path.find_last_of('/');
+            last = pos == std::string_view::npos ? path : path.substr(pos + 1);
+            std::string_view resto = pos == std::string_view::npos ? std::string_view() : path.substr(0, pos);
+            while (!resto.empty()) {
+                std::size_t sep = resto.find('/');
+                pasoMarca(vista, resto.substr(0, sep), dirs, pasos);
+                resto = sep == std::string_view::npos ? std::string_view() : resto.substr(sep + 1);
+            }
+            return vista;
+        }
+
+        // Devuelve la vista del estado marcado en el que está la sesión y deja en <dir> su directorio activo en
+        // él (con el árbol bloqueado). Ver recorrerMarca()
+        VistaMarca vistaActiva(const Directorio*& dir) {
+            std::string marca;
+            std::vector<const Directorio*> dirs;
+            std::vector<std::string> pasos;
+            std::string_view last;
+            VistaMarca vista = recorrerMarca({}, marca, dirs, pasos, last);
+            dir = dirs.back();
+            return vista;
+        }
+
+        // Devuelve true si <cambio> ha quitado del árbol un directorio o un enlace (que puede estar en una ruta)
+        static bool quitaDirectorio(const Cambio& cambio) {
+            return cambio.quitado != nullptr && cambio.quitado->kind() != TipoNodo::FICHERO;
+        }
+
+        // Las operaciones hacer*() aplican una modificación del árbol como los métodos públicos del mismo
+        // nombre, pero desde la ruta activa <ruta> y sin anotarla, y devuelven el cambio hecho, que después
+        // debe pasarse a aplicar() o a deshacer() (todo en la misma sección exclusiva)
+
+        Cambio hacerVi(const Camino& ruta, std::string_view name, const Tamanyo size) {
+            const std::shared_ptr<Directorio>& dir = ruta.back().dir;
+            // Buscamos si hay algun nodo de nombre <name>
+            std::shared_ptr<Nodo> elem = dir->findNode(name);
+            if (elem == nullptr) { // Si no existe, lo añadimos
+                std::shared_ptr<Nodo> fichero = _fs->arena().crear<Fichero>(name, size);
+                dir->addNode(fichero);
+                return {dir, nullptr, std::move(fichero)};
+            }
+            // Si existe y es un enlace, tomamos el nodo final al que lleva
+            const std::shared_ptr<Nodo>& target = follow(elem);
+
+            // Si es un fichero, lo actualizamos
+            if (Fichero* fichero = nodeCast<Fichero>(target.get())) {
+                Tamanyo anterior = fichero->getSize();
+                fichero->updateSize(size);
+                return {nullptr, nullptr, target, anterior};
+            }
+            // Si no, es un directorio => excepción
+            throw is_a_directory(target->getName());
+        }
+
+        Cambio hacerMkdir(const Camino& ruta, std::string_view name) {
+            const std::shared_ptr<Directorio>& dir = ruta.back().dir;
+            if (dir->findNode(name) != nullptr) // Si ya existe un nodo con nombre <name>, excepción
+                throw dir_exists(std::string(name));
+            std::shared_ptr<Nodo> nuevo = _fs->arena().crear<Directorio>(name);
+            dir->addNode(nuevo);
+            return {dir, nullptr, std::move(nuevo)};
+        }
+
+        Cambio hacerLn(const Camino& ruta, std::string_view path, std::string_view name) {
+            const std::shared_ptr<Directorio>& dir = ruta.back().dir;
+            std::shared_ptr<Nodo> elem = resolve(ruta, path).nodo;
+            if (Enlace::depthTo(*elem) > _fs->maxEnlaces())
+                throw too_many_links(std::string(path), _fs->maxEnlaces());
+            std::shared_ptr<Nodo> old = dir->findNode(name); // El enlace sustituye a un nodo con su mismo nombre
+            std::shared_ptr<Nodo> enlace = _fs->arena().crear<Enlace>(name, elem);
+            dir->addNode(enlace);
+            return {dir, std::move(old), std::move(enlace)};
+        }
+
+        Cambio hacerRm(const Camino& ruta, std::string_view path) {
+            std::string_view name;
+            Camino camino = resolveParent(ruta, path, name);
+            std::shared_ptr<Nodo> elem = camino.back().dir->findNode(name);
+            if (elem == nullptr)
+                throw elem_not_found(std::string(name));
+            camino.back().dir->delNode(elem);
+            return {camino.back().dir, std::move(elem), nullptr};
+        }
+
+        Cambio hacerMv(const Camino& ruta, std::string_view src, std::string_view dst) {
+            std::string_view name;
+            Camino origen = resolveParent(ruta, src, name);
+            std::shared_ptr<Nodo> elem = origen.back().dir->findNode(name);
+            if (elem == nullptr)
+                throw elem_not_found(std::string(name));
+            // Si el destino es un directorio (o un enlace a uno), el nodo se mueve dentro de él con su nombre
+            std::string_view nuevo;
+            Camino destino = resolveParent(ruta, dst, nuevo);
+            bool dentro = nuevo.empty() || nuevo == "." || nuevo == "..";
+            if (!dentro) {
+                std::shared_ptr<Nodo> node = destino.back().dir->findNode(nuevo);
+                dentro = node != nullptr && follow(node)->kind() == TipoNodo::DIRECTORIO;
+            }
+            if (dentro) {
+                step(destino, nuevo);
+                nuevo = name;
+            }
+            std::shared_ptr<Nodo> existente = destino.back().dir->findNode(nuevo);
+            const std::shared_ptr<Directorio>& dir = destino.back().dir;
+            if (existente == elem)
+                throw invalid_move(std::string(src), "source and destination are the same");
+            if (existente != nullptr && existente->kind() == TipoNodo::DIRECTORIO)
+                throw dir_exists(existente->getName());
+            if (const Directorio* movido = nodeCast<Directorio>(elem.get())) {
+                for (const Nodo* node = dir.get(); node != nullptr; node = node->getParent())
+                    if (node == movido)
+                        throw invalid_move(std::string(src), "destination is inside it");
+                // Si el tamaño del nuevo padre ya depende del directorio (a través de algún enlace de su
+                // interior), colgarlo de él cerraría un ciclo
+                if (dir->reaches(movido))
+                    throw invalid_move(std::string(src), "it would form a cycle through links");
+            }
+            RefNombre anterior = elem->getNameId();
+            origen.back().dir->delNode(elem);
+            elem->rename(RefNombre(nuevo));
+            try {
+                dir->addNode(elem);
+            } catch (const size_overflow&) {
+                elem->rename(anterior);
+                origen.back().dir->addNode(elem);
+                throw;
+            }
+            return {dir, std::move(existente), std::move(elem), 0, origen.back().dir, std::move(anterior)};
+        }
+
+        // Anota <cambio>, recién hecho, para poder deshacerlo con rollback(), y retira el nodo que ha quitado
+        // del árbol (si lo hay)
+        void aplicar(Cambio cambio) {
+            std::shared_ptr<Nodo> quitado = cambio.quitado;
+            _fs->anotar(std::move(cambio));
+            if (quitado != nullptr)
+                _fs->retirar(std::move(quitado));
+        }
+
+        // Deshace, del último al primero, los cambios <hechos>, todavía sin aplicar
+        void deshacerTodos(std::vector<Cambio>& hechos) {
+            for (auto it = hechos.rbegin(); it != hechos.rend(); ++it)
+                deshacer(*it, [this](std::shared_ptr<Nodo> node) {_fs->retirar(std::move(node));});
+        }
+
+        // Registra en el diario <cambio>, recién hecho como la operación <op> con argumentos <a>, <b> y <size>
+        // desde la ruta activa, y lo aplica. Devuelve su número de secuencia. Si no puede registrarse, deshace el
+        // cambio y relanza el error, de modo que el árbol nunca contiene modificaciones que no estén en el diario
+        std::uint64_t aplicar(Cambio cambio, const Operacion op, std::string_view a, std::string_view b = {},
+                              const Tamanyo size = 0) {
+            std::uint64_t secuencia;
+            try {
+                secuencia = _fs->registrar(op, _ruta, a, b, size);
+            } catch (...) {
+                deshacer(cambio, [this](std::shared_ptr<Nodo> node) {_fs->retirar(std::move(node));});
+                throw;
+            }
+            aplicar(std::move(cambio));
+            return secuencia;
+        }
     public:
-        // Constructor
-        Shell() : _ruta("/") {
-            _rutaActiva.push_back(std::make_shared<Directorio>(""));
+        // Constructor. Crea una sesión sobre un árbol nuevo
+        Shell() : Shell(std::make_shared<SistemaFicheros>()) {}
+
+        // Constructor. Crea una sesión sobre el árbol <fs>, situada en su raíz
+        explicit Shell(std::shared_ptr<SistemaFicheros> fs) : _fs(std::move(fs)), _ruta("/"), _traslados(_fs->traslados()),
+              _comprobada(_fs->bajas()) {
+            _rutaActiva.push_back({_fs->root(), _fs->root()->getNameId()});
+        }
+
+        // Devuelve el árbol de ficheros sobre el que trabaja la sesión
+        const std::shared_ptr<SistemaFicheros>& fs() const {
+            return _fs;
         }
 
         // Devuelve la ruta completa de forma textual, con todos los nombres de los directorios desde la raíz hasta
         // el directorio actual concatenados y separados por el separador '/'.
-        std::string pwd() const {
+        const std::string& pwd() {
+            if (!_marca.empty())
+                return _rutaMarca;
+            if (_traslados != _fs->traslados()) {
+                auto lock = _fs->leer();
+                seguirTraslados();
+            }
             return _ruta;
         }
 
         // Devuelve un listado con el nombre de todos los nodos contenidos en la ruta actual, uno por línea.
-        std::string ls() const {
-            return _rutaActiva.back()->print("ls");
+        std::string ls() {
+            std::ostringstream out;
+            ls(out);
+            return out.str();
+        }
+
+        // Escribe en <out> las líneas de <pagina> del listado de ls(), sin componerlo antes entero
+        void ls(std::ostream& out, const Pagina& pagina = {}) {
+            auto lock = _fs->leer();
+            seguirTraslados();
+            if (!_marca.empty()) {
+                const Directorio* dir;
+                vistaActiva(dir).escribir(*dir, out, false, false, pagina);
+                return;
+            }
+            _rutaActiva.back().dir->print(out, false, pagina);
         }
 
         // Devuelve un listado con el nombre y el tamaño de todos los nodos contenidos en la ruta actual, uno por
-        // línea.
-        std::string du() const {
-            return _rutaActiva.back()->print("du");
+        // línea. Si <recursive>, se listan también (con su ruta relativa) los nodos de todos los subdirectorios
+        // (en un árbol montado, sin cargar los que no lo estén).
+        std::string du(const bool recursive = false) {
+            auto lock = _fs->leer();
+            seguirTraslados();
+            if (!_marca.empty()) {
+                std::ostringstream out;
+                const Directorio* dir;
+                vistaActiva(dir).escribir(*dir, out, true, recursive);
+                return out.str();
+            }
+            if (recursive && !_fs->montado())
+                return listarRecursivo(*_rutaActiva.back().dir);
+            std::ostringstream out;
+            if (recursive)
+                escribirRecursivo(*_rutaActiva.back().dir, out);
+            else
+                _rutaActiva.back().dir->print(out, true);
+            return out.str();
+        }
+
+        // Escribe en <out> las líneas de <pagina> del listado de du(<recursive>), a medida que recorre el
+        // directorio, sin componerlo antes entero
+        void du(std::ostream& out, const bool recursive, const Pagina& pagina = {}) {
+            auto lock = _fs->leer();
+            seguirTraslados();
+            if (!_marca.empty()) {
+                const Directorio* dir;
+                vistaActiva(dir).escribir(*dir, out, true, recursive, pagina);
+                return;
+            }
+            if (recursive)
+                escribirRecursivo(*_rutaActiva.back().dir, out, pagina);
+            else
+                _rutaActiva.back().dir->print(out, true, pagina);
+        }
+
+        // Devuelve, a una por línea y ordenadas, las rutas (relativas a la ruta actual) de los nodos bajo la ruta
+        // actual cuyo nombre encaja con el patrón <pattern> (con comodines *, ? y [...]) y cuyo tamaño cumple
+        // <filtro>. Los enlaces no se recorren.
+        std::string find(std::string_view pattern, const FiltroTamanyo& filtro = {}) {
+            auto lock = _fs->leer();
+            seguirTraslados();
+            std::string res;
+            if (!_marca.empty()) {
+                const Directorio* dir;
+                for (const std::string& ruta : vistaActiva(dir).buscar(*dir, pattern, filtro)) {
+                    res += ruta;
+                    res += '\n';
+                }
+                return res;
+            }
+            // En un árbol montado, el índice de nombres no contiene lo que aún no se ha cargado
+            const Directorio& dir = *_rutaActiva.back().dir;
+            bool recorrer = _fs->montado() || dir.indice() == nullptr;
+            for (const std::string& ruta : recorrer ? buscarRecorriendo(dir, pattern, filtro)
+                                                    : buscar(dir, pattern, filtro)) {
+                res += ruta;
+                res += '\n';
+            }
+            return res;
         }
 
         // Edita el fichero de nombre 'name' (en el directorio actual). Para simular la edición, simplemente se cambia
         // el tamaño del fichero al valor especificado como parámetro. Si el fichero no existe, se debe crear con
         // el nombre y tamaño especificados.
-        void vi(const std::string& name, const int size) {
+        void vi(std::string_view name, const Tamanyo size) {
+            comprobarEscritura();
             if (size < 0) {
                 throw negative_size(size);
             }
-            // Buscamos si hay algun nodo de nombre <name>
-            std::shared_ptr<Nodo> elem = _rutaActiva.back()->findNode(name);
-            if (elem == nullptr) { // Si no existe, lo añadimos
-                _rutaActiva.back()->addNode(std::make_shared<Fichero>(name, size));
-            } else { // Si existe...
-                // Si elem es un shared_ptr<Enlace>, tomamos el enlace (de forma sucesiva)
-                while (dynamic_pointer_cast<Enlace>(elem) != nullptr) {
-                    std::shared_ptr<Enlace> ref = dynamic_pointer_cast<Enlace>(elem);
-                    elem = ref->link();
-                }
-
-                // Si elem es un fichero, lo actualizamos
-                if (dynamic_pointer_cast<Fichero>(elem) != nullptr) {
-                    std::shared_ptr<Fichero> fichero = dynamic_pointer_cast<Fichero>(elem);
-                    fichero->updateSize(size);
-                } else { // Si elem no es ninguna de las anteriores, es un directorio => excepción
-                    throw is_a_directory(elem->getName());
-                }
-            }
+            auto lock = _fs->escribir();
+            seguirTraslados();
+            comprobarRuta();
+            std::uint64_t op = aplicar(hacerVi(_rutaActiva, name, size), Operacion::VI, name, {}, size);
+            lock.unlock();
+            _fs->confirmar(op);
         }
 
         // Crea un directorio de nombre 'name' en el directorio activo.
-        void mkdir(const std::string& name) {
-            std::shared_ptr<Nodo> elem = _rutaActiva.back()->findNode(name);
-            if (elem == nullptr) { // Si no existe un nodo con nombre <name> lo añadimos
-                _rutaActiva.back()->addNode(std::make_shared<Directorio>(name));
-            } else { // Sino excepción
-                throw dir_exists(name);
-            }
+        void mkdir(std::string_view name) {
+            comprobarEscritura();
+            auto lock = _fs->escribir();
+            seguirTraslados();
+            comprobarRuta();
+            std::uint64_t op = aplicar(hacerMkdir(_rutaActiva, name), Operacion::MKDIR, name);
+            lock.unlock();
+            _fs->confirmar(op);
         }
 
         // Hace que la ruta activa pase a referenciar a otro directorio.
         // La nueva ruta activa definida en 'path' debe referenciar un directorio o un enlace a un directorio.
-        void cd(std::string path) {
-            if (path != ".") { // Caso contrario, no hay que hacer nada (ya estamos en el propio directorio)
-                if (path == "/") { // Si el path es "/" se vuelve a root directamente
-                    std::shared_ptr<Directorio> root = _rutaActiva.front();
-                    _rutaActiva.clear();
-                    _rutaActiva.push_back(root);
-                    _ruta = "/";
-                } else if (path == "..") { // Si es ".." subimos al padre
-                    if (_rutaActiva.back()->getName() != "") {
-                        _rutaActiva.pop_back();
-                        int pos = _ruta.find_last_of("/");
-                        if (_rutaActiva.back()->getName() == "") // Mi padre es root
-                            _ruta = "/";
-                        else
-                            _ruta = _ruta.substr(0, pos);
-                    } else {
-                        throw already_root();
-                    }
-                } else { // Es una ruta más compleja
-                    if (path.find("/") == 0) { // Hay una barra al comienzo, vamos a root primero
-                        cd("/");
-                        path = path.substr(1);
-                    }
-                    std::shared_ptr<Nodo> elem;
-                    bool fin = false;
-                    while (!fin) { // Mientras queden directorios en el path por recorrer
-                        int pos = path.find("/");
-                        if (pos == -1) { // Ya no quedan "/"
-                            fin = true;
-                        }
-                        std::string name = path.substr(0, pos);
-                        if (name == ".") { // El propio directorio 
-                            cd(".");
-                        } else if (name == "..") { // Directorio padre
-                            cd("..");
-                        } else { // Otro directorio, lo buscamos
-                            elem = _rutaActiva.back()->findNode(name);
-                            if (elem != nullptr) { // Si se ha encontrado
-                                // Si elem es un shared_ptr<Enlace>, tomamos el enlace (de forma sucesiva)
-                                while (dynamic_pointer_cast<Enlace>(elem) != nullptr) {
-                                    std::shared_ptr<Enlace> ref = dynamic_pointer_cast<Enlace>(elem);
-                                    elem = ref->link();
-                                }
-                                // Si elem es un directorio
-                                if (dynamic_pointer_cast<Directorio>(elem) != nullptr) {
-                                    _rutaActiva.push_back(dynamic_pointer_cast<Directorio>(elem));
-                                    if (_ruta == "/") {
-                                        _ruta += name;
-                                    } else {
-                                        _ruta += "/" + name;
-                                    }
-                                } else { // Si elem no es ninguna de las anteriores, es un fichero => excepción
-                                    throw is_a_file(name);
-                                }
-                            } else { // Si no se ha encontrado, excepción
-                                throw elem_not_found(name);
-                            }
-                        } // Eliminamos del path el directorio al que se ha viajado
-                        path = path.substr(pos + 1);
-                    }
-                }
+        // Si la ruta no es válida, la ruta activa no se modifica.
+        void cd(std::string_view path) {
+            auto lock = _fs->leer();
+            seguirTraslados();
+            if (enMarca(path)) {
+                std::string marca;
+                std::vector<const Directorio*> dirs;
+                std::vector<std::string> pasos;
+                std::string_view last;
+                VistaMarca vista = recorrerMarca(path, marca, dirs, pasos, last);
+                pasoMarca(vista, last, dirs, pasos);
+                _rutaMarca = "@" + marca;
+                for (const std::string& name : pasos)
+                    _rutaMarca += "/" + name;
+                if (pasos.empty())
+                    _rutaMarca += "/";
+                _marca = std::move(marca);
+                _pasosMarca = std::move(pasos);
+                return;
             }
+            _rutaActiva = resolveDir(_rutaActiva, path);
+            _ruta = toString(_rutaActiva);
+            salirDeMarca();
         }
 
         // Crea en el directorio actual un enlace simbólico de nombre 'name' que apunta al elemento identificado
         // mediante la ruta especificada en 'path', que puede ser de cualquier tipo. El nombre 'name' es un nombre
         // simple de nodo (se creará en el directorio activo), por lo que no puede contener una ruta completa.
         // La ruta definida en 'path' sí, de tal modo que se puede crear un enlace a un elemento en otro directorio
-        // del árbol, que debe existir previamente.
-        void ln(std::string& path, const std::string& name) {
-            std::string dirActual = pwd();
-
-            if (path == ".") { // Si el path es el directorio actual
-                std::shared_ptr<Enlace> link = make_shared<Enlace>(name, dynamic_pointer_cast<Nodo>(_rutaActiva.back()));
-            } else if (path == "..") {
-                cd(".."); // Si el path es el directorio padre
-                std::shared_ptr<Enlace> link = make_shared<Enlace>(name, dynamic_pointer_cast<Nodo>(_rutaActiva.back()));
-                cd(dirActual);
-                _rutaActiva.back()->addNode(link);
-            } else { // En cualquier otro caso
-                int pos = path.find_last_of("/");
-                if (pos != -1) { // Hay barras en el path luego hay que recorrer la ruta hasta el directorio con el nodo
-                    std::string dir;
-                    pos == 0 ? dir = "/" : dir = path.substr(0, pos);
-
-                    path = path.substr(pos + 1);
-                    if (path == ".") { // Si es el siguiente paso es el propio directorio
-                        ln(dir, name);
-                    } else if (path == "..") { // Si el siguiente paso es el directorio padre
-                        pos = dir.find_last_of("/");
-                        dir = dir.substr(0, pos);
-                        ln(dir, name);
-                    } else { // En cualquier otro caso, viajar a ese directorio
-                        cd(dir);
-                        std::shared_ptr<Nodo> elem = _rutaActiva.back()->findNode(path); // Buscar el elemento
-                        if (elem != nullptr) { // Si está, hacer el enlace, volver y añadirlo
-                            std::shared_ptr<Enlace> link = make_shared<Enlace>(name, elem);
-                            cd(dirActual);
-                            _rutaActiva.back()->addNode(link);
-                        } else { // Sino excepción
-                            cd(dirActual);
-                            throw elem_not_found(path);
-                        }
-                    }
-                } else { // Si no hay barras de ruta ya estamos en el directorio donde esta el nodo que buscamos.
-                    // Buscamos el nodo 
-                    std::shared_ptr<Nodo> elem = _rutaActiva.back()->findNode(path);
-                    if (elem != nullptr) { // si existe añadimos el enlace
-                        _rutaActiva.back()->addNode(make_shared<Enlace>(name, elem));
-                    } else { // Si no existe excepción
-                        throw elem_not_found(path);
-                    }
-                }
-            }
+        // del árbol, que debe existir previamente. Si 'path' es a su vez un enlace, la cadena resultante no puede
+        // superar el máximo de enlaces encadenados del árbol.
+        void ln(std::string_view path, std::string_view name) {
+            comprobarEscritura();
+            auto lock = _fs->escribir();
+            seguirTraslados();
+            comprobarRuta();
+            std::uint64_t op = aplicar(hacerLn(_rutaActiva, path, name), Operacion::LN, path, name);
+            lock.unlock();
+            _fs->confirmar(op);
         }
 
         // Devuelve el tamaño del nodo que referencia el path.
-        int stat(std::string& path) {
-            std::string dirActual = pwd();
-            if (path == ".") { // Si es el propio directorio en el que estoy
-                return _rutaActiva.back()->getSize();
-            } else if (path == "..") { // Si es el directorio padre
-                cd("..");
-                int size = _rutaActiva.back()->getSize();
-                cd(dirActual);
-                return size;
-            } else { // Sino...
-                int pos = path.find_last_of("/");
-                if (pos != -1) { // Si se ha encontrado "/"
-                    std::string dir = path.substr(0, pos);
-                    path = path.substr(pos + 1);
-                    if (path == ".") { // Mismo directorio
-                        return stat(dir);
-                    } else if (path == "..") { // Directorio padre
-                        pos = dir.find_last_of("/");
-                        dir = dir.substr(0, pos);
-                        return stat(dir);
-                    } else { // En otro caso, viajamos a ese directorio
-                        cd(dir);
-                        std::shared_ptr<Nodo> elem = _rutaActiva.back()->findNode(path);
-                        if (elem != nullptr) { // Si existe el nodo, guardamos su tamaño y volvemos
-                            int size = elem->getSize();
-                            cd(dirActual);
-                            return size;
-                        } else { // Sino, volvemos y excepción
-                            cd(dirActual);
-                            throw elem_not_found(elem->getName());
-                        }
-                    }
-                } else { // Buscamos el nodo
-                    std::shared_ptr<Nodo> elem = _rutaActiva.back()->findNode(path);
-                    if (elem != nullptr) { // Si el nodo existe, devolvemos su tamaño
-                        return elem->getSize();
-                    } else { // Sino, excepción
-                        throw elem_not_found(path);
-                    }
+        Tamanyo stat(std::string_view path) {
+            auto lock = _fs->leer();
+            seguirTraslados();
+            if (enMarca(path)) {
+                std::string marca;
+                std::vector<const Directorio*> dirs;
+                std::vector<std::string> pasos;
+                std::string_view last;
+                VistaMarca vista = recorrerMarca(path, marca, dirs, pasos, last);
+                if (last.empty() || last == "." || last == "..") {
+                    pasoMarca(vista, last, dirs, pasos);
+                    return vista.tamanyo(*dirs.back());
                 }
+                const Nodo* node = vista.buscarNodo(*dirs.back(), last);
+                if (node == nullptr)
+                    throw elem_not_found(std::string(last));
+                return vista.tamanyo(*node);
             }
+            return resolve(_rutaActiva, path).nodo->getSize();
         }
 
         // Elimina un nodo. Si es un fichero, es simplemente eliminado. Si es un enlace, elimina el enlace pero no
         // el nodo referenciado. Si es un directorio, elimina el directorio y todo su contenido. Si existen enlaces al
         // elemento borrado, ese elemento sigue siendo accesible a traves del enlace (todavía existe), pero no a
         // través de su ubicación original (que ha sido eliminada).
-        void rm(std::string& path) {
-            std::string dirActual = pwd();
-            int pos = path.find_last_of("/");
-            if (pos != -1) { // Si es una ruta compuesta, viajamos al path
-                std::string dir = path.substr(0, pos);
-                path = path.substr(pos + 1);
-                cd(dir);
+        void rm(std::string_view path) {
+            comprobarEscritura();
+            auto lock = _fs->escribir();
+            seguirTraslados();
+            comprobarRuta();
+            std::uint64_t op = aplicar(hacerRm(_rutaActiva, path), Operacion::RM, path);
+            lock.unlock();
+            _fs->confirmar(op);
+        }
+
+        // Mueve el nodo <src> a <dst>: si <dst> es un directorio (o un enlace a uno), dentro de él con el mismo
+        // nombre, y si no, con el nombre y en el directorio que indica <dst>. Si allí ya hay un fichero o un
+        // enlace con ese nombre, lo sustituye. El nodo no se copia, sólo se cambia de directorio, así que cuesta
+        // lo mismo que resolver las rutas y propagar su tamaño (O(profundidad)), y los enlaces a él o a sus
+        // descendientes siguen llevando a los mismos nodos. No se puede mover un directorio dentro de sí mismo,
+        // ni a un lugar en el que formaría un ciclo a través de los enlaces de su interior
+        void mv(std::string_view src, std::string_view dst) {
+            comprobarEscritura();
+            auto lock = _fs->escribir();
+            seguirTraslados();
+            comprobarRuta();
+            std::uint64_t op = aplicar(hacerMv(_rutaActiva, src, dst), Operacion::MV, src, dst);
+            _fs->trasladado();
+            seguirTraslados();
+            lock.unlock();
+            _fs->confirmar(op);
+        }
+
+        // Guarda en el fichero <path> una imagen binaria de todo el árbol
+        void save(std::string_view path) const {
+            auto lock = _fs->leer();
+            _fs->guardar(std::string(path));
+        }
+
+        // Sustituye todo el árbol por el guardado en la imagen <path>. La sesión vuelve a la raíz; si el
+        // fichero no es una imagen válida, el árbol no se modifica
+        void load(std::string_view path) {
+            auto lock = _fs->escribir();
+            _fs->cargar(std::string(path));
+            _traslados = _fs->traslados();
+            _rutaActiva.resize(1);
+            _ruta = toString(_rutaActiva);
+        }
+
+        // Sustituye todo el árbol por el montado de <fuente>, cuyos directorios se cargan al usarse y se
+        // descargan cuando los cargados ocupan más de <presupuesto> bytes. La fuente se abre antes de bloquear
+        // el árbol. La sesión vuelve a la raíz; si no se puede montar, el árbol no se modifica
+        void mount(std::unique_ptr<Fuente> fuente, const std::size_t presupuesto = Montaje::PRESUPUESTO) {
+            auto montaje = std::make_shared<Montaje>(std::move(fuente), presupuesto);
+            auto lock = _fs->escribir();
+            seguirTraslados();
+            // La sesión suelta su ruta activa mientras tanto, para que el árbol anterior pueda liberarse ya
+            _rutaActiva.clear();
+            std::uint64_t op;
+            try {
+                op = _fs->montar(std::move(montaje));
+            } catch (...) {
+                resolverRuta();
+                throw;
             }
-            // Buscamos el nodo en el directorio
-            std::shared_ptr<Nodo> elem = _rutaActiva.back()->findNode(path);
-            if (elem != nullptr) { // Si existe
-                if (dynamic_pointer_cast<Fichero>(elem) != nullptr) { // Si es un fichero
-                    _rutaActiva.back()->delNode(dynamic_pointer_cast<Fichero>(elem));
-                } else if (dynamic_pointer_cast<Enlace>(elem) != nullptr) { // Si es un enlace
-                    _rutaActiva.back()->delNode(dynamic_pointer_cast<Enlace>(elem));
-                } else { // Si es un directorio
-                    _rutaActiva.back()->delNode(dynamic_pointer_cast<Directorio>(elem));
+            _traslados = _fs->traslados();
+            _rutaActiva.push_back({_fs->root(), _fs->root()->getNameId()});
+            _ruta = toString(_rutaActiva);
+            lock.unlock();
+            _fs->confirmar(op);
+        }
+
+        // Importa en el directorio activo los nodos descritos en el manifiesto <path> o, si <host>, el contenido
+        // del directorio real <path>. La lectura se hace antes de bloquear el árbol, y no depende del directorio
+        // activo, que sólo se resuelve después. No se registra en el diario operación a operación, sino que
+        // después se compacta; sí se anota para poder deshacerla
+        Importacion import(std::string_view path, const bool host = false) {
+            comprobarEscritura();
+            Lectura lectura = host ? leerDirectorio(std::string(path)) : leerManifiesto(std::string(path));
+            auto lock = _fs->escribir();
+            seguirTraslados();
+            comprobarRuta();
+            Importacion res = importarEntradas(*_fs, _rutaActiva, lectura.entradas, std::string(path));
+            _fs->compactarDiario();
+            return res;
+        }
+
+        // Aplica las modificaciones <ops> como una sola transacción: se hacen en orden sobre el árbol bloqueado
+        // y, si alguna falla, se deshacen las anteriores y se lanza batch_error, de modo que el árbol y la ruta
+        // activa quedan como estaban y no se registra nada en el diario. Los cd sólo afectan a las
+        // modificaciones siguientes y, si la transacción termina bien, a la sesión.
+        //
+        // Cada tramo de vi consecutivos se ordena por nombre y se queda con el último tamaño de cada fichero,
+        // y los ficheros nuevos del tramo se añaden al directorio con una sola propagación de tamaño
+        void batch(const std::vector<OpLote>& ops) {
+            comprobarEscritura();
+            for (const OpLote& op : ops)
+                if (op.orden == OrdenLote::VI && op.size < 0)
+                    throw negative_size(op.size);
+            // Operación a registrar en el diario, desde la ruta activa número <ruta> de la transacción
+            struct Registro {
+                Operacion op;
+                std::size_t ruta;
+                std::string_view a, b;
+                Tamanyo size;
+            };
+            auto lock = _fs->escribir();
+            seguirTraslados();
+            comprobarRuta();
+            Camino ruta = _rutaActiva;
+            std::vector<std::string> rutas = {_ruta};
+            std::vector<Registro> registros;
+            std::vector<Cambio> hechos;
+            bool movidos = false;
+            std::size_t i = 0;
+            try {
+                while (i < ops.size()) {
+                    const OpLote& op = ops[i];
+                    switch (op.orden) {
+                        case OrdenLote::MKDIR:
+                            hechos.push_back(hacerMkdir(ruta, op.a));
+                            registros.push_back({Operacion::MKDIR, rutas.size() - 1, op.a, {}, 0});
+                            i++;
+                            break;
+                        case OrdenLote::LN:
+                            hechos.push_back(hacerLn(ruta, op.a, op.b));
+                            registros.push_back({Operacion::LN, rutas.size() - 1, op.a, op.b, 0});
+                            // El enlace puede haber sustituido a un directorio de la ruta de la transacción
+                            if (quitaDirectorio(hechos.back()) && vigentes(ruta) != ruta.size())
+                                throw dir_removed(rutas.back());
+                            i++;
+                            break;
+                        case OrdenLote::RM:
+                            hechos.push_back(hacerRm(ruta, op.a));
+                            registros.push_back({Operacion::RM, rutas.size() - 1, op.a, {}, 0});
+                            if (quitaDirectorio(hechos.back()) && vigentes(ruta) != ruta.size())
+                                throw dir_removed(rutas.back());
+                            i++;
+                            break;
+                        case OrdenLote::MV:
+                            hechos.push_back(hacerMv(ruta, op.a, op.b));
+                            registros.push_back({Operacion::MV, rutas.size() - 1, op.a, op.b, 0});
+                            movidos = true;
+                            // La ruta de la transacción puede haber cambiado con el movimiento
+                            if (reubicar(ruta))
+                                rutas.push_back(toString(ruta));
+                            i++;
+                            break;
+                        case OrdenLote::CD:
+                            ruta = resolveDir(ruta, op.a);
+                            rutas.push_back(toString(ruta));
+                            i++;
+                            break;
+                        case OrdenLote::VI: {
+                            std::size_t fin = i;
+                            while (fin < ops.size() && ops[fin].orden == OrdenLote::VI)
+                                fin++;
+                            std::vector<std::size_t> tramo(fin - i);
+                            std::iota(tramo.begin(), tramo.end(), i);
+                            std::stable_sort(tramo.begin(), tramo.end(), [&ops](std::size_t x, std::size_t y) {
+                                return ops[x].a < ops[y].a;
+                            });
+                            const std::shared_ptr<Directorio>& dir = ruta.back().dir;
+                            std::vector<std::shared_ptr<Nodo>> nuevos;
+                            std::size_t primero = i;    // Primer vi que crea un fichero
+                            for (std::size_t k = 0; k < tramo.size(); k++) {
+                                if (k + 1 < tramo.size() && ops[tramo[k + 1]].a == ops[tramo[k]].a)
+                                    continue;
+                                i = tramo[k];
+                                if (dir->findNode(ops[i].a) == nullptr) {
+                                    if (nuevos.empty())
+                                        primero = i;
+                                    nuevos.push_back(_fs->arena().crear<Fichero>(ops[i].a, ops[i].size));
+                                } else {
+                                    hechos.push_back(hacerVi(ruta, ops[i].a, ops[i].size));
+                                }
+                                registros.push_back({Operacion::VI, rutas.size() - 1, ops[i].a, {}, ops[i].size});
+                            }
+                            i = primero;
+                            dir->addNodes(nuevos);
+                            for (std::shared_ptr<Nodo>& nuevo : nuevos)
+                                hechos.push_back({dir, nullptr, std::move(nuevo)});
+                            i = fin;
+                            break;
+                        }
+                    }
                 }
-            } else { // Si no, excepción
-                throw elem_not_found(path);
+            } catch (const arbol_ficheros_error& e) {
+                deshacerTodos(hechos);
+                throw batch_error(i + 1, e.what());
+            }
+            // Se registran todas las operaciones a la vez antes de aplicarlas, para no dejar en el árbol parte de
+            // la transacción sin registrar si el diario ha fallado
+            std::vector<diario::Registro> entradas;
+            entradas.reserve(registros.size());
+            for (const Registro& r : registros)
+                entradas.push_back({0, r.op, r.size, rutas[r.ruta], r.a, r.b});
+            std::uint64_t op;
+            try {
+                op = _fs->registrar(entradas);
+            } catch (...) {
+                deshacerTodos(hechos);
+                throw;
+            }
+            for (Cambio& cambio : hechos)
+                aplicar(std::move(cambio));
+            _rutaActiva = std::move(ruta);
+            _ruta = std::move(rutas.back());
+            if (movidos) {
+                _fs->trasladado();
+                _traslados = _fs->traslados();
+            }
+            lock.unlock();
+            _fs->confirmar(op);
+        }
+
+        // Devuelve la memoria que ocupan los nodos del árbol (por tipo), los eliminados que siguen vivos
+        // (huérfanos alcanzables por enlaces y retenidos por los estados marcados) y los nombres
+        InformeMemoria memstat() const {
+            auto lock = _fs->escribir();
+            return _fs->memoria();
+        }
+
+        // Compacta la memoria del árbol: copia todos sus nodos a memoria contigua, libera la anterior y la devuelve
+        // al sistema si es posible. El árbol y los estados marcados no cambian, pero sus nodos son otros, así que
+        // todas las sesiones recalculan su ruta activa a partir de su forma textual
+        Compactacion compact() {
+            auto lock = _fs->escribir();
+            seguirTraslados();
+            // La sesión suelta su ruta activa mientras tanto, para que sus directorios puedan liberarse ya
+            _rutaActiva.clear();
+            Compactacion res;
+            try {
+                res = _fs->compactarMemoria();
+            } catch (...) {
+                resolverRuta();
+                throw;
+            }
+            _traslados = _fs->traslados();
+            resolverRuta();
+            return res;
+        }
+
+        // Marca con el nombre <name> el estado actual del árbol, para poder volver a él con rollback() o
+        // consultarlo con cd @<name>
+        void snapshot(std::string_view name) {
+            auto lock = _fs->escribir();
+            _fs->marcar(std::string(name));
+        }
+
+        // Devuelve todo el árbol al estado marcado como <name>, deshaciendo las modificaciones posteriores (de
+        // todas las sesiones), y elimina las marcas posteriores. La sesión sigue en su directorio activo si
+        // sigue en el árbol (aunque haya vuelto a otra ruta); si no, en su ruta activa si sigue existiendo, y si
+        // no vuelve a la raíz
+        void rollback(std::string_view name) {
+            auto lock = _fs->escribir();
+            seguirTraslados();
+            _fs->volver(std::string(name));
+            _traslados = _fs->traslados();
+            if (reubicar(_rutaActiva))
+                _ruta = toString(_rutaActiva);
+            else
+                resolverRuta();
+        }
+
+        // Elimina la marca <name>
+        void dropSnapshot(std::string_view name) {
+            auto lock = _fs->escribir();
+            _fs->desmarcar(std::string(name));
+        }
+
+        // Devuelve los nombres de los estados marcados, uno por línea y ordenados
+        std::string snapshots() const {
+            auto lock = _fs->leer();
+            std::string res;
+            for (const std::string& name : _fs->marcas()) {
+                res += name;
+                res += '\n';
             }
-            cd(dirActual);
+            return res;
         }
 };
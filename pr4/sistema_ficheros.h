@@ -0,0 +1,484 @@
+//------------------------------------------------------------------------------
+// File:   sistema_ficheros.h
+// Author: Daniel Herce (NIP 848884), Alain Villagrasa (NIP 816787)
+// Date:   Marzo 2023
+// Coms:   Fichero que implementa la clase SistemaFicheros, el árbol de
+//         ficheros compartido por todas las sesiones (Shell) que trabajan
+//         sobre él
+//------------------------------------------------------------------------------
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#include "directorio.h"
+#include "arena.h"
+#include "cerrojo.h"
+#include "tamanyos.h"
+#include "imagen.h"
+#include "diario.h"
+#include "cambios.h"
+#include "vista_marca.h"
+#include "memoria.h"
+#include "respaldo.h"
+
+// Árbol de ficheros compartido por varias sesiones, posiblemente en hilos distintos. Las consultas se
+// realizan con el cerrojo en modo compartido y las modificaciones en modo exclusivo.
+//
+// El cerrojo es uno solo para todo el árbol: mientras un escritor modifica cualquier directorio, ningún
+// lector avanza, ni siquiera en otros subárboles. No hay cerrojos por directorio ni lecturas sin cerrojo al
+// estilo RCU porque una modificación no se limita a su directorio: su variación de tamaño llega a todos los
+// antecesores y, a través de los enlaces, a nodos de cualquier otra parte del árbol, que un lector vería a
+// medio actualizar. Lo que se acota es la duración de las secciones exclusivas (O(profundidad) salvo en las
+// operaciones que recorren el árbol), y el cerrojo hace que los lectores no compitan entre sí. La prueba
+// concurrencia.cc (make test) comprueba que los tamaños que ven los lectores son siempre coherentes.
+//
+// Para que ningún nodo se destruya mientras haya lectores (su destructor modifica otros nodos y la
+// arena), los nodos que se eliminan del árbol no se liberan directamente, sino que se retiran: el
+// sistema los conserva hasta que sólo él los referencia y los libera más tarde, dentro de una sección
+// exclusiva. Así, los cursores de las sesiones nunca son los últimos propietarios de un nodo.
+//
+// Si se le asocia un diario, las sesiones registran en él cada modificación del árbol. Mientras haya algún
+// estado marcado, las sesiones anotan además cada modificación en el registro de cambios, para poder volver
+// a él.
+//
+// Si el árbol se ha montado desde una fuente (ver respaldo.h), sus directorios se cargan al consultarlos, y al
+// adquirir el cerrojo, si el contenido cargado supera el presupuesto, se descargan antes los menos usados.
+class SistemaFicheros {
+    private:
+        std::unique_ptr<Arena> _arena;                  // Memoria de la que se reservan los nodos
+        IndiceNombres _indice;                          // Índice de los nodos del árbol por nombre (debe
+                                                        // sobrevivir a todos ellos)
+        std::vector<std::unique_ptr<Arena>> _adoptadas; // Arenas de las que se reservaron nodos importados
+        std::vector<std::unique_ptr<Arena>> _antiguas;  // Arenas de antes de compactar con nodos aún vivos
+        std::shared_ptr<Directorio> _root;              // Directorio raíz
+        std::vector<std::shared_ptr<Nodo>> _retirados;  // Nodos eliminados del árbol pendientes de liberar
+        std::size_t _umbral;                            // Número de retirados a partir del que se liberan
+        std::uint32_t _maxEnlaces;                      // Longitud máxima de una cadena de enlaces
+        mutable CerrojoLectores _cerrojo;               // Cerrojo lectores/escritor sobre todo el árbol
+        std::unique_ptr<Diario> _diario;                // Diario de operaciones (nullptr si no hay)
+        std::mutex _compactando;                        // Serializa las compactaciones del diario
+        RegistroCambios _cambios;                       // Cambios desde el estado marcado más antiguo
+        std::atomic<std::uint64_t> _traslados{0};       // Modificaciones que han podido cambiar la ruta de
+                                                        // algún directorio (mv, rollback, compact, mount y load)
+        std::atomic<std::uint64_t> _bajas{0};           // Directorios y enlaces retirados, que han podido dejar
+                                                        // fuera del árbol la ruta activa de alguna sesión
+        std::shared_ptr<Montaje> _montaje;              // Montaje del que se carga el árbol (nullptr si no hay)
+
+        // Libera los retirados que ya no están referenciados desde otro lugar, y las arenas antiguas que se han
+        // quedado sin nodos (sólo en una sección exclusiva)
+        void liberar() {
+            std::size_t vivos = 0;
+            for (std::size_t i = 0; i < _retirados.size(); i++)
+                if (_retirados[i].use_count() > 1)
+                    _retirados[vivos++] = std::move(_retirados[i]);
+            _retirados.resize(vivos);
+            _umbral = std::max<std::size_t>(64, vivos * 2);
+            std::erase_if(_antiguas, [](const std::unique_ptr<Arena>& arena) {return arena->enUso() == 0;});
+        }
+
+        // Aplica <f> a cada una de las arenas de las que se han reservado nodos del árbol
+        template <typename F>
+        void forEachArena(F&& f) const {
+            f(*_arena);
+            for (const std::unique_ptr<Arena>& arena : _adoptadas)
+                f(*arena);
+            for (const std::unique_ptr<Arena>& arena : _antiguas)
+                f(*arena);
+        }
+    public:
+        // Longitud máxima por defecto de una cadena de enlaces (la misma que en Linux)
+        static constexpr std::uint32_t MAX_ENLACES = 40;
+
+        // Constructor
+        SistemaFicheros()
+            : _arena(std::make_unique<Arena>()), _root(_arena->crear<Directorio>("")), _umbral(64),
+              _maxEnlaces(MAX_ENLACES) {
+            _root->usarIndice(&_indice);
+        }
+
+        SistemaFicheros(const SistemaFicheros&) = delete;
+        SistemaFicheros& operator=(const SistemaFicheros&) = delete;
+
+        // Destructor. Los nodos deben destruirse antes que la arena que los contiene. Los que mantengan vivos
+        // los ciclos de enlaces no llegan a destruirse, así que antes se da de baja del índice de nombres todo
+        // lo alcanzable (también a través de enlaces) y sus directorios dejan de usarlo, para que ninguno
+        // conserve un puntero al índice una vez destruido
+        ~SistemaFicheros() {
+            _diario.reset();
+            std::vector<const Nodo*> pendientes = {_root.get()};
+            std::unordered_set<const Nodo*> vistos = {_root.get()};
+            auto guardado = [&](const std::shared_ptr<Nodo>& node) {
+                if (vistos.insert(node.get()).second)
+                    pendientes.push_back(node.get());
+            };
+            for (const std::shared_ptr<Nodo>& node : _retirados)
+                guardado(node);
+            _cambios.forEachNodo(guardado);
+            while (!pendientes.empty()) {
+                const Nodo* node = pendientes.back();
+                pendientes.pop_back();
+                _indice.baja(const_cast<Nodo*>(node));
+                auto visitar = [&](const std::shared_ptr<Nodo>& next) {
+                    if (vistos.insert(next.get()).second)
+                        pendientes.push_back(next.get());
+                };
+                const Directorio* dir = nodeCast<Directorio>(node);
+                if (dir != nullptr)
+                    const_cast<Directorio*>(dir)->soltarIndice();
+                if (dir != nullptr && dir->cargado())
+                    dir->forEachChild(visitar);
+                else if (const Enlace* enlace = nodeCast<Enlace>(node))
+                    visitar(enlace->link());
+            }
+            _cambios.clear();
+            _retirados.clear();
+            _root.reset();
+        }
+
+        // Devuelve el directorio raíz
+        const std::shared_ptr<Directorio>& root() const {
+            return _root;
+        }
+
+        // Devuelve la arena de la que se reservan los nodos (sólo en una sección exclusiva)
+        Arena& arena() {
+            return *_arena;
+        }
+
+        // Adopta las arenas <arenas>, de las que se han reservado nodos que pasan a formar parte del árbol, para
+        // que vivan tanto como él (sólo en una sección exclusiva)
+        void adoptarArenas(std::vector<std::unique_ptr<Arena>> arenas) {
+            for (std::unique_ptr<Arena>& arena : arenas)
+                _adoptadas.push_back(std::move(arena));
+        }
+
+        // Devuelve el número de modificaciones hechas hasta ahora que han podido cambiar la ruta de algún
+        // directorio (las sesiones lo comparan con el de la última vez que calcularon su ruta activa)
+        std::uint64_t traslados() const {
+            return _traslados.load(std::memory_order_acquire);
+        }
+
+        // Indica que se acaba de cambiar la ruta de algún directorio (en la misma sección exclusiva)
+        void trasladado() {
+            _traslados.fetch_add(1, std::memory_order_release);
+        }
+
+        // Devuelve el número de directorios y enlaces retirados del árbol hasta ahora (con el árbol bloqueado)
+        std::uint64_t bajas() const {
+            return _bajas.load(std::memory_order_acquire);
+        }
+
+        // Devuelve el número máximo de enlaces que puede encadenar un enlace nuevo
+        std::uint32_t maxEnlaces() const {
+            return _maxEnlaces;
+        }
+
+        // Fija en <max> el número máximo de enlaces que puede encadenar un enlace nuevo (sólo en una sección
+        // exclusiva). Los enlaces ya existentes no se ven afectados
+        void setMaxEnlaces(const std::uint32_t max) {
+            _maxEnlaces = max;
+        }
+
+        // Adquiere el cerrojo del árbol en modo compartido, para consultarlo. Si hay que descargar directorios
+        // perezosos, antes lo adquiere un momento en modo exclusivo para hacerlo
+        std::shared_lock<CerrojoLectores> leer() const {
+            std::shared_lock<CerrojoLectores> lock(_cerrojo);
+            if (_montaje != nullptr && _montaje->excedido()) {
+                lock.unlock();
+                {
+                    std::unique_lock<CerrojoLectores> exclusivo(_cerrojo);
+                    if (_montaje != nullptr && _montaje->excedido())
+                        _montaje->descargar();
+                }
+                lock.lock();
+            }
+            return lock;
+        }
+
+        // Adquiere el cerrojo del árbol en modo exclusivo, para modificarlo. Si hay que descargar directorios
+        // perezosos, lo hace antes
+        std::unique_lock<CerrojoLectores> escribir() {
+            std::unique_lock<CerrojoLectores> lock(_cerrojo);
+            if (_montaje != nullptr && _montaje->excedido())
+                _montaje->descargar();
+            return lock;
+        }
+
+        // Devuelve true si el árbol se ha montado desde una fuente, así que puede tener directorios sin cargar
+        // (con el árbol bloqueado)
+        bool montado() const {
+            return _montaje != nullptr;
+        }
+
+        // Reconstruye, recorriendo todo el árbol en paralelo, los tamaños acumulados de sus directorios (sólo en
+        // una sección exclusiva). Devuelve el tamaño total
+        Tamanyo recalcularTamanyos() {
+            return calcularTamanyo(*_root, true);
+        }
+
+        // Retira <node>, recién eliminado del árbol (sólo en una sección exclusiva). Cuando el número de
+        // retirados se ha duplicado, se liberan los que ya no están referenciados desde otro lugar
+        void retirar(std::shared_ptr<Nodo> node) {
+            if (node->kind() != TipoNodo::FICHERO)
+                _bajas.fetch_add(1, std::memory_order_release);
+            _retirados.push_back(std::move(node));
+            if (_retirados.size() >= _umbral)
+                liberar();
+        }
+
+        // Devuelve la memoria que ocupan los nodos del árbol, los que siguen vivos fuera de él y los nombres (sólo
+        // en una sección exclusiva)
+        InformeMemoria memoria() const {
+            std::vector<const Nodo*> retenidos;
+            for (const std::shared_ptr<Nodo>& node : _retirados)
+                retenidos.push_back(node.get());
+            _cambios.forEachNodo([&retenidos](const std::shared_ptr<Nodo>& node) {
+                retenidos.push_back(node.get());
+            });
+            InformeMemoria inf = medirMemoria(*_root, retenidos);
+            inf.bytesIndice = const_cast<IndiceNombres&>(_indice).memoria();
+            if (_montaje != nullptr) {
+                inf.montado = true;
+                inf.perezosos = _montaje->estado();
+            }
+            forEachArena([&inf](const Arena& arena) {
+                inf.reservados += arena.reservados();
+                inf.enUso += arena.enUso();
+            });
+            return inf;
+        }
+
+        // Copia todos los nodos vivos del árbol (los del árbol, los que guardan los estados marcados y los que
+        // alcanzan sus enlaces) a una arena nueva, en la que el contenido de cada directorio queda contiguo, y
+        // libera las anteriores (sólo en una sección exclusiva). Los estados marcados pasan a referirse a las
+        // copias. Los nodos antiguos se retiran y se vacían, así que los que aún conserve alguna sesión en su
+        // ruta activa (que debe recalcularla, ya que la raíz cambia) se liberan más tarde, junto con su arena.
+        //
+        // Los identificadores de los nombres internados no cambian, ya que los comparten todos los árboles y las
+        // sesiones, pero al final se purgan de la tabla los que ya no usa nadie (de éste ni de ningún otro árbol),
+        // para que reutilicen sus identificadores los nombres que se creen después. En un árbol montado, antes se
+        // descargan todos los directorios perezosos que se pueda, y los que sigan cargados pasan a ser directorios
+        // normales
+        Compactacion compactarMemoria() {
+            Compactacion res;
+            if (_montaje != nullptr)
+                _montaje->descargar(true);
+            liberar();
+            forEachArena([&res](const Arena& arena) {
+                res.antes += arena.reservados();
+            });
+
+            std::vector<std::shared_ptr<Nodo>> otros;
+            _cambios.forEachNodo([&otros](const std::shared_ptr<Nodo>& node) {
+                otros.push_back(node);
+            });
+            auto nueva = std::make_unique<Arena>();
+            std::unordered_map<const Nodo*, std::shared_ptr<Nodo>> copias;
+            std::vector<std::shared_ptr<Nodo>> viejos;
+            std::shared_ptr<Directorio> root = copiarNodos(_root, otros, *nueva, copias, viejos);
+            _cambios.sustituirNodos([&copias](const std::shared_ptr<Nodo>& node) {
+                return copias.at(node.get());
+            });
+            std::erase_if(_retirados, [&copias](const std::shared_ptr<Nodo>& node) {
+                return copias.count(node.get()) != 0;
+            });
+            res.nodos = viejos.size();
+            copias.clear();
+            _root = std::move(root);
+            _root->usarIndice(&_indice);
+            _antiguas.push_back(std::move(_arena));
+            for (std::unique_ptr<Arena>& arena : _adoptadas)
+                _antiguas.push_back(std::move(arena));
+            _adoptadas.clear();
+            _arena = std::move(nueva);
+            if (_montaje != nullptr)
+                _montaje->usarArena(*_arena);
+
+            // Cada nodo antiguo se retira por separado y los directorios se vacían, para que ninguna sesión sea
+            // la última en referenciar un nodo ni retenga más que los directorios de su ruta activa
+            _retirados.reserve(_retirados.size() + viejos.size());
+            for (std::shared_ptr<Nodo>& viejo : viejos) {
+                if (Directorio* dir = nodeCast<Directorio>(viejo.get()))
+                    dir->soltarContenido();
+                _retirados.push_back(std::move(viejo));
+            }
+            viejos = {};
+            otros = {};
+            for (std::size_t antes = SIZE_MAX; _retirados.size() != antes; ) {
+                antes = _retirados.size();
+                liberar();
+            }
+            _indice.ajustar();
+            res.nombres = TablaNombres::global().purgar();
+#ifdef __GLIBC__
+            ::malloc_trim(0);
+#endif
+            trasladado();
+
+            forEachArena([&res](const Arena& arena) {
+                res.despues += arena.reservados();
+            });
+            return res;
+        }
+
+        // Guarda en el fichero <path> una imagen de todo el árbol (con el árbol bloqueado, al menos para lectura)
+        void guardar(const std::string& path) const {
+            guardarImagen(*_root, path, _diario != nullptr ? _diario->secuencia() : 0);
+        }
+
+        // Sustituye el contenido del árbol por el de la imagen <path> (sólo en una sección exclusiva). Si hay
+        // diario, se compacta a continuación, para que su recuperación no dependa del fichero <path>. Los
+        // estados marcados se descartan, y el árbol deja de estar montado. Los directorios anteriores quedan
+        // fuera del árbol, así que las sesiones recalculan su ruta activa. Devuelve el número de secuencia
+        // guardado en la imagen
+        std::uint64_t cargar(const std::string& path) {
+            std::vector<std::shared_ptr<Nodo>> viejos;
+            std::uint64_t secuencia = cargarImagen(_root, *_arena, path, viejos);
+            if (_montaje != nullptr) {
+                _montaje->desmontar();
+                _montaje.reset();
+            }
+            _cambios.clear();
+            for (std::shared_ptr<Nodo>& viejo : viejos)
+                retirar(std::move(viejo));
+            trasladado();
+            if (_diario != nullptr)
+                compactar();
+            return secuencia;
+        }
+
+        // Sustituye todo el árbol por el de <montaje>, cuyos directorios se cargarán al consultarlos (sólo en una
+        // sección exclusiva). La raíz es otra, así que las sesiones recalculan su ruta activa; el árbol anterior
+        // se retira entero y se libera cuando ninguna sesión lo conserve. Los estados marcados se descartan.
+        //
+        // Si hay diario, no se guarda la imagen del árbol montado, que obligaría a leerlo entero: la imagen queda
+        // vacía y el diario empieza por el montaje (con el origen de su fuente), así que al recuperarse se vuelve
+        // a montar. Devuelve el número de secuencia del montaje en el diario, que debe pasarse a confirmar() (0
+        // si no hay diario)
+        std::uint64_t montar(std::shared_ptr<Montaje> montaje) {
+            std::shared_ptr<Directorio> root = montaje->montar(*_arena);
+            root->usarIndice(&_indice);
+            if (_montaje != nullptr)
+                _montaje->desmontar();
+            _cambios.clear();
+            retirar(std::move(_root));
+            _root = std::move(root);
+            _montaje = std::move(montaje);
+            liberar();
+            trasladado();
+            if (_diario == nullptr)
+                return 0;
+            guardarImagen(*std::make_shared<Directorio>(""), _diario->imagen(), _diario->secuencia());
+            _diario->reiniciar();
+            return _diario->registrar(Operacion::MOUNT, "/", _montaje->fuente().origen(), {},
+                                      std::int64_t(_montaje->presupuesto()));
+        }
+
+        // Anota <cambio>, recién aplicado al árbol, si hay algún estado marcado (en la misma sección exclusiva)
+        void anotar(Cambio cambio) {
+            _cambios.anotar(std::move(cambio));
+        }
+
+        // Marca con el nombre <name> el estado actual del árbol (sólo en una sección exclusiva)
+        void marcar(const std::string& name) {
+            _cambios.marcar(name);
+        }
+
+        // Elimina la marca <name> (sólo en una sección exclusiva). Si no existe, lanza unknown_snapshot
+        void desmarcar(const std::string& name) {
+            if (!_cambios.desmarcar(name))
+                throw unknown_snapshot(name);
+        }
+
+        // Devuelve los nombres de los estados marcados, ordenados (con el árbol bloqueado)
+        std::vector<std::string> marcas() const {
+            return _cambios.marcas();
+        }
+
+        // Devuelve la vista de sólo lectura del estado marcado como <name> (con el árbol bloqueado, al menos para
+        // lectura, mientras se use). Si no existe, lanza unknown_snapshot
+        VistaMarca vista(const std::string& name) const {
+            VistaMarca vista;
+            if (!_cambios.forEachPosterior(name, [&vista](const Cambio& cambio) {vista.deshacer(cambio);}))
+                throw unknown_snapshot(name);
+            vista.completar();
+            return vista;
+        }
+
+        // Devuelve el árbol al estado marcado como <name>, deshaciendo los cambios posteriores, y elimina las
+        // marcas posteriores (sólo en una sección exclusiva). Si no existe, lanza unknown_snapshot. Si hay
+        // diario, se compacta, ya que los cambios deshechos siguen registrados en él
+        void volver(const std::string& name) {
+            if (!_cambios.volver(name, [this](std::shared_ptr<Nodo> node) {retirar(std::move(node));}))
+                throw unknown_snapshot(name);
+            trasladado();
+            if (_diario != nullptr)
+                compactar();
+        }
+
+        // Asocia al árbol el diario <diario>, en el que se registrarán a partir de ahora sus modificaciones
+        // (sólo en una sección exclusiva)
+        void activarDiario(std::unique_ptr<Diario> diario) {
+            _diario = std::move(diario);
+        }
+
+        // Registra en el diario, si lo hay, la operación <op> hecha desde la ruta activa <ruta> (sólo en la
+        // sección exclusiva en la que se aplica). Devuelve su número de secuencia (0 si no hay diario), que debe
+        // pasarse a confirmar() una vez liberado el cerrojo. Si el diario ha fallado, lanza journal_error, y la
+        // operación debe deshacerse
+        std::uint64_t registrar(const Operacion op, std::string_view ruta, std::string_view a,
+                                std::string_view b = {}, const std::int64_t size = 0) {
+            return _diario != nullptr ? _diario->registrar(op, ruta, a, b, size) : 0;
+        }
+
+        // Registra juntas, como registrar(), las operaciones <registros> de una transacción: o todas o ninguna
+        std::uint64_t registrar(const std::vector<diario::Registro>& registros) {
+            return _diario != nullptr ? _diario->registrar(registros) : 0;
+        }
+
+        // Espera a que la operación <secuencia> sea duradera (según el intervalo de sincronización del diario)
+        // y, si el diario ha crecido demasiado, lo compacta. El de un árbol montado no se compacta, ya que su
+        // imagen obligaría a leer todo el árbol: crece hasta que se cargue o se monte otro. Debe llamarse sin el
+        // árbol bloqueado
+        void confirmar(const std::uint64_t secuencia) {
+            if (_diario == nullptr)
+                return;
+            _diario->confirmar(secuencia);
+            if (_diario->lleno()) {
+                std::unique_lock<std::mutex> compactando(_compactando, std::try_to_lock);
+                if (compactando) {
+                    auto lock = leer();
+                    if (_diario->lleno() && _montaje == nullptr)
+                        compactar();
+                }
+            }
+        }
+
+        // Compacta el diario, si lo hay, tras una modificación del árbol que no se ha registrado en él operación
+        // a operación (sólo en una sección exclusiva)
+        void compactarDiario() {
+            if (_diario != nullptr)
+                compactar();
+        }
+
+        // Guarda el árbol en la imagen del diario y vacía éste (con el árbol bloqueado, al menos para lectura,
+        // de modo que no se registre ninguna operación mientras tanto)
+        void compactar() {
+            guardarImagen(*_root, _diario->imagen(), _diario->secuencia());
+            _diario->reiniciar();
+        }
+};
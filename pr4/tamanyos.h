@@ -0,0 +1,290 @@
+//------------------------------------------------------------------------------
+// File:   tamanyos.h
+// Author: Daniel Herce (NIP 848884), Alain Villagrasa (NIP 816787)
+// Date:   Marzo 2023
+// Coms:   Fichero que implementa los recorridos recursivos (en paralelo) del
+//         árbol: cálculo completo de tamaños y listado recursivo de du
+//------------------------------------------------------------------------------
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+#include "visitar.h"
+#include "paralelo.h"
+
+// Profundidad a partir de la cual los subdirectorios se recorren en el propio hilo, sin crear tareas
+constexpr int PROFUNDIDAD_PARALELA = 8;
+
+// Reparte los índices 0..<n>-1 en trozos (tantos como hilos disponibles, con cierto margen para equilibrar
+// la carga) y aplica <f> a cada uno de ellos en paralelo
+template <typename F>
+void repartir(const std::size_t n, F&& f) {
+    Tareas& tareas = Tareas::global();
+    std::size_t trozos = std::min(n, tareas.hilos() * 4);
+    Grupo grupo;
+    for (std::size_t t = 0; t < trozos; t++) {
+        std::size_t ini = n * t / trozos, fin = n * (t + 1) / trozos;
+        tareas.lanzar(grupo, [&f, ini, fin] {
+            for (std::size_t i = ini; i < fin; i++)
+                f(i);
+        });
+    }
+    tareas.esperar(grupo);
+}
+
+// Devuelve la suma de los <n> tamaños (no negativos) de <v>, o deja <ok> a false si no cabe en un Tamanyo.
+// Las mitades alta y baja de los tamaños se suman por separado, en un bucle sin dependencias entre
+// iteraciones ni comprobaciones que el compilador vectoriza; ninguna de las dos sumas puede desbordarse con
+// menos de 2^32 sumandos, así que sólo se comprueba el desbordamiento al combinarlas
+inline Tamanyo sumarTamanyos(const Tamanyo* v, const std::size_t n, bool& ok) {
+    std::uint64_t altos = 0, bajos = 0;
+    for (std::size_t i = 0; i < n; i++) {
+        altos += std::uint64_t(v[i]) >> 32;
+        bajos += std::uint64_t(v[i]) & 0xffffffffu;
+    }
+    unsigned __int128 total = ((unsigned __int128)altos << 32) + bajos;
+    if (total > INT64_MAX) {
+        ok = false;
+        return INT64_MAX;
+    }
+    return Tamanyo(total);
+}
+
+// Tamaños ya calculados de los directorios durante un recorrido, para no recorrer de nuevo el subárbol de
+// un directorio apuntado por varios enlaces. Puede usarse desde varios hilos; si dos hilos calculan a la vez
+// el mismo directorio, ambos obtienen el mismo resultado
+class MemoTamanyos {
+    private:
+        static constexpr std::size_t PARTICIONES = 64;
+
+        struct Particion {
+            std::mutex mutex;
+            std::unordered_map<const Nodo*, Tamanyo> tamanyos;
+        };
+
+        Particion _particiones[PARTICIONES];
+        std::atomic<bool> _desbordado{false};   // Algún tamaño calculado no cabe en un Tamanyo
+
+        Particion& particion(const Nodo* node) {
+            return _particiones[std::hash<const Nodo*>()(node) % PARTICIONES];
+        }
+    public:
+        // Devuelve true y deja en <size> el tamaño de <node> si ya se ha calculado
+        bool find(const Nodo* node, Tamanyo& size) {
+            Particion& p = particion(node);
+            std::lock_guard<std::mutex> lock(p.mutex);
+            auto it = p.tamanyos.find(node);
+            if (it == p.tamanyos.end())
+                return false;
+            size = it->second;
+            return true;
+        }
+
+        // Guarda <size> como tamaño de <node>
+        void insert(const Nodo* node, const Tamanyo size) {
+            Particion& p = particion(node);
+            std::lock_guard<std::mutex> lock(p.mutex);
+            p.tamanyos.emplace(node, size);
+        }
+
+        // Anota que algún tamaño se ha desbordado durante el recorrido
+        void desbordar() {
+            _desbordado.store(true, std::memory_order_relaxed);
+        }
+
+        // Devuelve true si algún tamaño se ha desbordado durante el recorrido
+        bool desbordado() const {
+            return _desbordado.load(std::memory_order_relaxed);
+        }
+};
+
+Tamanyo calcularTamanyo(Nodo& node, bool guardar, MemoTamanyos& memo, int depth = 0);
+
+// Calcula el tamaño con el que <node> contribuye al de su directorio (0 para los enlaces cíclicos)
+inline Tamanyo calcularContribucion(Nodo& node, MemoTamanyos& memo, const int depth) {
+    if (const Enlace* enlace = nodeCast<Enlace>(&node))
+        if (enlace->cyclic())
+            return 0;
+    return calcularTamanyo(node, false, memo, depth);
+}
+
+// Calcula el tamaño de <node> recorriendo su subárbol, sin usar los tamaños acumulados. Los enlaces se
+// siguen hasta el nodo apuntado, cuyo tamaño se calcula una sola vez aunque lo apunten varios enlaces; los
+// enlaces cíclicos no se contabilizan, lo que evita la recursión infinita. Si <guardar> es true, el
+// resultado se guarda como tamaño acumulado de cada directorio alcanzado a través del árbol (no a través
+// de enlaces, para que cada directorio se escriba una única vez). Los tamaños del contenido de cada
+// directorio se reúnen en un vector contiguo y se suman de una vez; si la suma se desborda, se anota en
+// <memo> y se toma el máximo representable
+inline Tamanyo calcularTamanyo(Nodo& node, const bool guardar, MemoTamanyos& memo, const int depth) {
+    Estadisticas::global().contar(Estadisticas::NODOS_RECORRIDOS);
+    return visit(node, [&](auto& n) -> Tamanyo {
+        using T = std::decay_t<decltype(n)>;
+        if constexpr (std::is_same_v<T, Fichero>) {
+            return n.getSize();
+        } else if constexpr (std::is_same_v<T, Enlace>) {
+            return calcularTamanyo(*n.target(), false, memo, depth + 1);
+        } else {
+            Tamanyo total = 0;
+            if (!guardar && memo.find(&n, total))
+                return total;
+            // Tamaños del contenido: primero los de los ficheros y enlaces, después los de los subdirectorios
+            std::vector<Tamanyo> sizes;
+            std::vector<Directorio*> subdirs;
+            sizes.reserve(n.numChildren());
+            n.forEachChild([&](const std::shared_ptr<Nodo>& child) {
+                if (Directorio* dir = nodeCast<Directorio>(child.get()))
+                    subdirs.push_back(dir);
+                else if (const Fichero* fichero = nodeCast<Fichero>(child.get()))
+                    sizes.push_back(fichero->getSize());
+                else
+                    sizes.push_back(calcularContribucion(*child, memo, depth + 1));
+            });
+            std::size_t primero = sizes.size();
+            sizes.resize(primero + subdirs.size());
+            auto calcularSub = [&](const std::size_t i) {
+                sizes[primero + i] = calcularTamanyo(*subdirs[i], guardar, memo, depth + 1);
+            };
+            if (subdirs.size() > 1 && depth < PROFUNDIDAD_PARALELA) {
+                repartir(subdirs.size(), calcularSub);
+            } else {
+                for (std::size_t i = 0; i < subdirs.size(); i++)
+                    calcularSub(i);
+            }
+            bool ok = true;
+            total = sumarTamanyos(sizes.data(), sizes.size(), ok);
+            if (!ok)
+                memo.desbordar();
+            if (guardar)
+                n.resetSize(total);
+            memo.insert(&n, total);
+            return total;
+        }
+    });
+}
+
+// Calcula el tamaño de <node> recorriendo en paralelo su subárbol (ver la función anterior). Si algún tamaño
+// no cabe en un Tamanyo, lanza size_overflow (y, si <guardar>, los tamaños acumulados quedan saturados)
+inline Tamanyo calcularTamanyo(Nodo& node, const bool guardar) {
+    MemoTamanyos memo;
+    Tamanyo total = calcularTamanyo(node, guardar, memo);
+    if (memo.desbordado())
+        throw size_overflow(node.getName());
+    return total;
+}
+
+// Devuelve, a uno por línea y ordenados, la ruta (relativa a <dir>, precedida de <prefijo>) y el tamaño
+// de cada nodo del subárbol de <dir>. Los enlaces se listan pero no se recorren. Los subárboles de los
+// subdirectorios se listan en paralelo y se concatenan en orden
+inline std::string listarRecursivo(const Directorio& dir, const std::string& prefijo = "", const int depth = 0) {
+    const std::vector<Nodo*>& children = dir.sortedChildren();
+    Estadisticas::global().contar(Estadisticas::NODOS_RECORRIDOS, children.size());
+    std::vector<Directorio*> subdirs;
+    for (Nodo* child : children)
+        if (Directorio* sub = nodeCast<Directorio>(child))
+            subdirs.push_back(sub);
+
+    // Listados de los subdirectorios, en el mismo orden que subdirs
+    std::vector<std::string> listados(subdirs.size());
+    auto listarSub = [&](const std::size_t i) {
+        listados[i] = listarRecursivo(*subdirs[i], prefijo + subdirs[i]->getName() + "/", depth + 1);
+    };
+    if (subdirs.size() > 1 && depth < PROFUNDIDAD_PARALELA) {
+        repartir(subdirs.size(), listarSub);
+    } else {
+        for (std::size_t i = 0; i < subdirs.size(); i++)
+            listarSub(i);
+    }
+
+    std::string res;
+    std::size_t i = 0;
+    for (Nodo* child : children) {
+        res += prefijo;
+        res += child->getName();
+        res += ", ";
+        res += std::to_string(child->getSize());
+        res += '\n';
+        if (child->kind() == TipoNodo::DIRECTORIO)
+            res += listados[i++];
+    }
+    return res;
+}
+
+// Escribe en <out> las líneas de <pagina> del mismo listado que listarRecursivo(<dir>), recorriendo el
+// subárbol en orden en un solo hilo: cada línea se escribe al alcanzarla, sin componer antes el listado,
+// por lo que la memoria necesaria sólo depende de la profundidad del subárbol. El contenido de los
+// directorios perezosos sin cargar se lee de su respaldo sin cargarlo. El recorrido termina en cuanto se
+// completa la página
+inline void escribirRecursivo(const Directorio& dir, std::ostream& out, const Pagina& pagina = {}) {
+    // Directorio en curso: sus nodos ordenados o, si no está cargado, las entradas ordenadas de su respaldo, el
+    // siguiente a escribir y la longitud del prefijo previa
+    struct Nivel {
+        const std::vector<Nodo*>* nodes;
+        std::vector<EntradaRespaldo> entradas;
+        const Respaldo* respaldo;
+        std::size_t i;
+        std::size_t prefijo;
+
+        std::size_t size() const {
+            return nodes != nullptr ? nodes->size() : entradas.size();
+        }
+    };
+    std::vector<Nivel> pila;
+    // Apila el directorio <sub>, cargado o no, o el de clave <clave> en <respaldo> si <sub> es nullptr
+    auto apilar = [&pila](const Directorio* sub, const Respaldo* respaldo, const std::uint64_t clave,
+                          const std::size_t previo) {
+        if (sub != nullptr && sub->cargado()) {
+            pila.push_back({&sub->sortedChildren(), {}, nullptr, 0, previo});
+            return;
+        }
+        Nivel nivel = {nullptr, {}, sub != nullptr ? sub->respaldo().get() : respaldo, 0, previo};
+        nivel.respaldo->contenido(sub != nullptr ? sub->clave() : clave, nivel.entradas);
+        std::sort(nivel.entradas.begin(), nivel.entradas.end(), [](const EntradaRespaldo& a, const EntradaRespaldo& b) {
+            return a.name < b.name;
+        });
+        pila.push_back(std::move(nivel));
+    };
+    apilar(&dir, nullptr, 0, 0);
+    std::string prefijo;
+    std::size_t linea = 0;
+    std::size_t fin = pagina.limit > SIZE_MAX - pagina.offset ? SIZE_MAX : pagina.offset + pagina.limit;
+    std::uint64_t recorridos = 0;
+    while (!pila.empty() && linea < fin) {
+        Nivel& nivel = pila.back();
+        if (nivel.i == nivel.size()) {
+            prefijo.resize(nivel.prefijo);
+            pila.pop_back();
+            continue;
+        }
+        recorridos++;
+        std::size_t previo = prefijo.size();
+        if (nivel.nodes != nullptr) {
+            const Nodo* child = (*nivel.nodes)[nivel.i++];
+            if (linea++ >= pagina.offset)
+                out << prefijo << child->getName() << ", " << child->getSize() << '\n';
+            if (const Directorio* sub = nodeCast<Directorio>(child)) {
+                prefijo += child->getName();
+                prefijo += '/';
+                apilar(sub, nullptr, 0, previo);
+            }
+        } else {
+            const EntradaRespaldo e = nivel.entradas[nivel.i++];
+            if (linea++ >= pagina.offset)
+                out << prefijo << e.name << ", " << e.size << '\n';
+            if (e.kind == TipoNodo::DIRECTORIO) {
+                prefijo += e.name;
+                prefijo += '/';
+                apilar(nullptr, nivel.respaldo, e.clave, previo);
+            }
+        }
+    }
+    Estadisticas::global().contar(Estadisticas::NODOS_RECORRIDOS, recorridos);
+}
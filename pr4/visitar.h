@@ -0,0 +1,54 @@
+//------------------------------------------------------------------------------
+// File:   visitar.h
+// Author: Daniel Herce (NIP 848884), Alain Villagrasa (NIP 816787)
+// Date:   Marzo 2023
+// Coms:   Fichero que implementa las conversiones y el despacho por tipo de
+//         nodo a partir de su etiqueta TipoNodo, sin recurrir a RTTI
+//------------------------------------------------------------------------------
+
+#pragma once
+
+#include <memory>
+#include "nodo.h"
+#include "fichero.h"
+#include "enlace.h"
+#include "directorio.h"
+
+// Devuelve <node> convertido a <T> si es de ese tipo, o nullptr en caso contrario
+template <typename T>
+T* nodeCast(Nodo* node) {
+    return node != nullptr && node->kind() == T::KIND ? static_cast<T*>(node) : nullptr;
+}
+template <typename T>
+const T* nodeCast(const Nodo* node) {
+    return node != nullptr && node->kind() == T::KIND ? static_cast<const T*>(node) : nullptr;
+}
+
+// Devuelve <node> convertido a <T> si es de ese tipo, o nullptr en caso contrario
+template <typename T>
+std::shared_ptr<T> nodeCast(const std::shared_ptr<Nodo>& node) {
+    return node != nullptr && node->kind() == T::KIND ? std::static_pointer_cast<T>(node) : nullptr;
+}
+
+// Aplica <f> sobre <node> convertido a su tipo concreto (Fichero&, Directorio& o Enlace&) y devuelve
+// su resultado
+template <typename F>
+decltype(auto) visit(Nodo& node, F&& f) {
+    switch (node.kind()) {
+        case TipoNodo::FICHERO:
+            return f(static_cast<Fichero&>(node));
+        case TipoNodo::DIRECTORIO:
+            return f(static_cast<Directorio&>(node));
+        default:
+            return f(static_cast<Enlace&>(node));
+    }
+}
+
+// Devuelve el nodo final al que lleva <node> siguiendo los enlaces (de forma sucesiva), o el propio
+// <node> si no es un enlace. Cada enlace conoce su nodo final, así que no se recorre la cadena
+inline const std::shared_ptr<Nodo>& follow(const std::shared_ptr<Nodo>& node) {
+    if (node->kind() != TipoNodo::ENLACE)
+        return node;
+    Estadisticas::global().contar(Estadisticas::ENLACES);
+    return static_cast<const Enlace&>(*node).target();
+}
@@ -0,0 +1,242 @@
+//------------------------------------------------------------------------------
+// File:   vista_marca.h
+// Author: Daniel Herce (NIP 848884), Alain Villagrasa (NIP 816787)
+// Date:   Marzo 2023
+// Coms:   Fichero que implementa la vista de sólo lectura de un estado marcado
+//         del árbol de ficheros
+//------------------------------------------------------------------------------
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "fichero.h"
+#include "enlace.h"
+#include "directorio.h"
+#include "visitar.h"
+#include "cambios.h"
+#include "buscar.h"
+#include "arbol_ficheros_error.h"
+
+// Estado marcado de un árbol, consultado sin modificar el árbol. Sólo se reconstruye lo que ha cambiado desde
+// la marca: el contenido de los directorios que modificaron los cambios posteriores se obtiene deshaciéndolos,
+// del más reciente al más antiguo, sobre una copia de su listado (con los nodos eliminados, que los cambios
+// conservan), y los nombres y tamaños de los nodos movidos y los ficheros editados son los anteriores al primer
+// cambio que los modificó. El resto de directorios se consultan tal cual, y sólo se recalcula el tamaño de los
+// que contienen algo que ha cambiado.
+//
+// Construirla cuesta lo mismo que volver a la marca, pero sin tocar el árbol; es válida mientras el árbol siga
+// bloqueado (al menos para lectura) y no cambie
+class VistaMarca {
+    private:
+        std::unordered_map<const Directorio*, std::vector<Nodo*>> _contenidos;  // Contenido de los directorios
+                                                                                // modificados tras la marca
+        std::unordered_map<const Nodo*, const Directorio*> _padres; // Directorio de los nodos de _contenidos
+        std::unordered_map<const Nodo*, NombreId> _nombres;         // Nombre de los nodos movidos tras la marca
+        std::unordered_map<const Nodo*, Tamanyo> _tamanyos;         // Tamaño de los ficheros editados tras ella
+        std::unordered_set<const Nodo*> _afectados;                 // Nodos cuyo tamaño puede ser otro
+        mutable std::unordered_map<const Nodo*, Tamanyo> _acumulados;   // Tamaños de directorio recalculados
+
+        // Devuelve el listado (modificable) del contenido de <dir>, copiándolo del árbol la primera vez
+        std::vector<Nodo*>& contenido(const Directorio& dir) {
+            auto [it, nuevo] = _contenidos.try_emplace(&dir);
+            if (nuevo)
+                dir.forEachChild([&it](const std::shared_ptr<Nodo>& child) {it->second.push_back(child.get());});
+            return it->second;
+        }
+
+        // Devuelve el tamaño con el que <node> contribuye al de su directorio <dir> en la vista. Un enlace que
+        // sigue en su directorio conserva su marca de cíclico; el de uno que ha cambiado de directorio se
+        // recalcula como en el árbol cuando apunta a un antecesor de su directorio
+        Tamanyo aportacion(const Nodo& node, const Directorio& dir) const {
+            const Enlace* enlace = nodeCast<Enlace>(&node);
+            if (enlace == nullptr)
+                return tamanyo(node);
+            if (!_contenidos.contains(&dir))
+                return enlace->cyclic() ? 0 : tamanyo(node);
+            for (const Directorio* d = &dir; d != nullptr; d = padre(*d))
+                if (d == enlace->target().get())
+                    return 0;
+            return tamanyo(node);
+        }
+    public:
+        // Deshace en la vista <cambio>, el más reciente de los posteriores a la marca que aún no se han deshecho
+        void deshacer(const Cambio& cambio) {
+            if (cambio.dir == nullptr) {
+                _tamanyos[cambio.puesto.get()] = cambio.size;
+                return;
+            }
+            std::vector<Nodo*>& dir = contenido(*cambio.dir);
+            if (cambio.puesto != nullptr) {
+                dir.erase(std::find(dir.begin(), dir.end(), cambio.puesto.get()));
+                if (cambio.origen != nullptr) {
+                    _nombres[cambio.puesto.get()] = cambio.nombre;
+                    contenido(*cambio.origen).push_back(cambio.puesto.get());
+                }
+            }
+            if (cambio.quitado != nullptr)
+                dir.push_back(cambio.quitado.get());
+        }
+
+        // Termina de construir la vista, una vez deshechos todos los cambios posteriores a la marca: ordena los
+        // listados reconstruidos y anota qué nodos pueden tener otro tamaño (los directorios y ficheros que han
+        // cambiado y todo lo que depende de ellos, en el árbol o en la vista)
+        void completar() {
+            std::vector<const Nodo*> pendientes;
+            for (auto& [dir, nodes] : _contenidos) {
+                std::sort(nodes.begin(), nodes.end(), [this](const Nodo* a, const Nodo* b) {
+                    return TablaNombres::global().name(nombre(*a)) < TablaNombres::global().name(nombre(*b));
+                });
+                for (const Nodo* node : nodes)
+                    _padres[node] = dir;
+                pendientes.push_back(dir);
+            }
+            for (const auto& [fichero, size] : _tamanyos)
+                pendientes.push_back(fichero);
+            while (!pendientes.empty()) {
+                const Nodo* node = pendientes.back();
+                pendientes.pop_back();
+                if (node == nullptr || !_afectados.insert(node).second)
+                    continue;
+                pendientes.push_back(padre(*node));
+                pendientes.push_back(node->getParent());
+                node->forEachRef([&pendientes](const Nodo* ref) {pendientes.push_back(ref);});
+            }
+        }
+
+        // Devuelve el identificador del nombre de <node> en la vista
+        NombreId nombre(const Nodo& node) const {
+            auto it = _nombres.find(&node);
+            return it != _nombres.end() ? it->second : node.getNameId();
+        }
+
+        // Devuelve el directorio que contiene a <node> en la vista (nullptr si no está en ninguno)
+        const Directorio* padre(const Nodo& node) const {
+            auto it = _padres.find(&node);
+            if (it != _padres.end())
+                return it->second;
+            const Nodo* parent = node.getParent();
+            if (parent == nullptr || _contenidos.contains(static_cast<const Directorio*>(parent)))
+                return nullptr;
+            return static_cast<const Directorio*>(parent);
+        }
+
+        // Devuelve el tamaño de <node> en la vista (el acumulado, en los directorios)
+        Tamanyo tamanyo(const Nodo& node) const {
+            if (const Enlace* enlace = nodeCast<Enlace>(&node))
+                return tamanyo(*enlace->target());
+            if (node.kind() == TipoNodo::FICHERO) {
+                auto it = _tamanyos.find(&node);
+                return it != _tamanyos.end() ? it->second : node.getSize();
+            }
+            if (!_afectados.contains(&node))
+                return node.getSize();
+            auto [it, nuevo] = _acumulados.try_emplace(&node, 0);
+            if (nuevo) {
+                const Directorio& dir = static_cast<const Directorio&>(node);
+                Tamanyo total = 0;
+                for (const Nodo* child : hijos(dir))
+                    total += aportacion(*child, dir);
+                _acumulados[&node] = total;
+                return total;
+            }
+            return it->second;
+        }
+
+        // Devuelve el contenido de <dir> en la vista, ordenado por nombre
+        std::vector<const Nodo*> hijos(const Directorio& dir) const {
+            auto it = _contenidos.find(&dir);
+            if (it != _contenidos.end())
+                return {it->second.begin(), it->second.end()};
+            const std::vector<Nodo*>& nodes = dir.sortedChildren();
+            return {nodes.begin(), nodes.end()};
+        }
+
+        // Busca en <dir> el nodo de nombre <name> en la vista. Si no lo encuentra devuelve nullptr
+        const Nodo* buscarNodo(const Directorio& dir, std::string_view name) const {
+            auto it = _contenidos.find(&dir);
+            if (it == _contenidos.end())
+                return dir.findNode(name).get();
+            for (const Nodo* node : it->second)
+                if (TablaNombres::global().name(nombre(*node)) == name)
+                    return node;
+            return nullptr;
+        }
+
+        // Devuelve el directorio al que lleva el nodo <name> de <dir>, siguiendo los enlaces. Si no existe, lanza
+        // elem_not_found, y si no es un directorio, is_a_file
+        const Directorio* paso(const Directorio& dir, std::string_view name) const {
+            const Nodo* node = buscarNodo(dir, name);
+            if (node == nullptr)
+                throw elem_not_found(std::string(name));
+            if (const Enlace* enlace = nodeCast<Enlace>(node))
+                node = enlace->target().get();
+            if (node->kind() != TipoNodo::DIRECTORIO)
+                throw is_a_file(std::string(name));
+            return static_cast<const Directorio*>(node);
+        }
+
+        // Escribe en <out> las líneas de <pagina> del listado de <dir> en la vista, como Directorio::print() (si
+        // <sizes>, con el tamaño de cada nodo) o, si <recursive>, como escribirRecursivo()
+        void escribir(const Directorio& dir, std::ostream& out, const bool sizes, const bool recursive,
+                      const Pagina& pagina = {}) const {
+            std::size_t fin = pagina.limit > SIZE_MAX - pagina.offset ? SIZE_MAX : pagina.offset + pagina.limit;
+            std::size_t linea = 0;
+            // Directorio en curso: su contenido, el siguiente a escribir y su prefijo
+            struct Nivel {
+                std::vector<const Nodo*> nodes;
+                std::size_t i;
+                std::string prefijo;
+            };
+            std::vector<Nivel> pila;
+            pila.push_back({hijos(dir), 0, std::string()});
+            while (!pila.empty() && linea < fin) {
+                Nivel& nivel = pila.back();
+                if (nivel.i == nivel.nodes.size()) {
+                    pila.pop_back();
+                    continue;
+                }
+                const Nodo* node = nivel.nodes[nivel.i++];
+                const std::string& name = TablaNombres::global().name(nombre(*node));
+                if (linea++ >= pagina.offset) {
+                    out << nivel.prefijo << name;
+                    if (sizes)
+                        out << ", " << tamanyo(*node);
+                    out << '\n';
+                }
+                if (recursive && node->kind() == TipoNodo::DIRECTORIO) {
+                    std::string prefijo = nivel.prefijo + name + '/';
+                    pila.push_back({hijos(static_cast<const Directorio&>(*node)), 0, std::move(prefijo)});
+                }
+            }
+        }
+
+        // Devuelve lo mismo que buscar() en el subárbol de <dir> de la vista, recorriéndolo
+        std::vector<std::string> buscar(const Directorio& dir, std::string_view pattern,
+                                        const FiltroTamanyo& filtro) const {
+            const bool comodines = tieneComodines(pattern);
+            std::vector<std::string> rutas;
+            std::vector<std::pair<const Directorio*, std::string>> pendientes = {{&dir, std::string()}};
+            while (!pendientes.empty()) {
+                auto [actual, prefijo] = std::move(pendientes.back());
+                pendientes.pop_back();
+                for (const Nodo* node : hijos(*actual)) {
+                    const std::string& name = TablaNombres::global().name(nombre(*node));
+                    std::string ruta = prefijo.empty() ? name : prefijo + '/' + name;
+                    if ((comodines ? encaja(pattern, name) : name == pattern) && filtro.cumple(tamanyo(*node)))
+                        rutas.push_back(ruta);
+                    if (node->kind() == TipoNodo::DIRECTORIO)
+                        pendientes.push_back({static_cast<const Directorio*>(node), std::move(ruta)});
+                }
+            }
+            std::sort(rutas.begin(), rutas.end());
+            return rutas;
+        }
+};